@@ -0,0 +1,108 @@
+#pragma once
+
+#include<atomic>
+#include<cstddef>
+#include<mutex>
+#include<unordered_map>
+#include<vector>
+
+namespace cnn::memory {
+    // 张量内存默认按缓存行对齐, SIMD 加载不会跨越两条缓存行
+    constexpr size_t CACHE_LINE = 64;
+
+    // 透明大页的大小
+    constexpr size_t HUGE_PAGE = 2u << 20;
+
+    // 分配器的统计信息
+    struct AllocatorStats {
+        size_t allocations = 0;         // 累计分配次数
+        size_t deallocations = 0;       // 累计释放次数
+        size_t hugePageAllocations = 0; // 其中使用透明大页的次数
+        size_t bytesInUse = 0;          // 当前占用的字节数
+        size_t peakBytes = 0;           // 占用字节数的峰值
+        size_t cacheHits = 0;           // 直接复用缓存的次数, 只有 CachingAllocator 统计
+        size_t cachedBytes = 0;         // 已经释放但留在缓存中的字节数, 包含在 bytesInUse 里
+    };
+
+    // 张量内存分配器的接口, 释放时传入的 bytes 必须和分配时一致
+    class Allocator {
+    public:
+        virtual void *allocate(size_t bytes) = 0;
+
+        virtual void deallocate(void *ptr, size_t bytes) = 0;
+
+        virtual AllocatorStats stats() const = 0;
+
+        virtual ~Allocator() = default;
+    };
+
+    // 默认的分配器, 按 alignment 对齐, 不小于 hugePageThreshold 的分配按大页对齐并建议内核使用透明大页
+    class AlignedAllocator : public Allocator {
+    private:
+        const size_t alignment_;
+        const size_t hugePageThreshold_; // 为 0 时不使用透明大页
+
+        std::atomic<size_t> allocations_{0};
+        std::atomic<size_t> deallocations_{0};
+        std::atomic<size_t> hugePageAllocations_{0};
+        std::atomic<size_t> bytesInUse_{0};
+        std::atomic<size_t> peakBytes_{0};
+
+    public:
+        explicit AlignedAllocator(size_t alignment = CACHE_LINE, size_t hugePageThreshold = 0);
+
+        void *allocate(size_t bytes) override;
+
+        void deallocate(void *ptr, size_t bytes) override;
+
+        AllocatorStats stats() const override;
+
+    private:
+        bool useHugePage(size_t bytes) const;
+
+        // 实际分配的大小, 补齐到对齐的整数倍
+        size_t blockSize(size_t bytes) const;
+    };
+
+    // 按字节数缓存释放的内存, 同样形状的张量再次分配时直接复用. batch 大小或者分辨率来回切换时,
+    // 每种形状的缓冲区只向上游分配一次. 最多缓存 maxCachedBytes 字节, 超过的部分直接还给上游
+    class CachingAllocator : public Allocator {
+    private:
+        Allocator &upstream_;
+        const size_t maxCachedBytes_;
+
+        mutable std::mutex mutex_;
+        std::unordered_map<size_t, std::vector<void *>> free_; // 按申请的字节数分组的空闲内存
+        size_t cachedBytes_ = 0;
+        size_t hits_ = 0;
+
+    public:
+        explicit CachingAllocator(Allocator &upstream, size_t maxCachedBytes = size_t(512) << 20);
+
+        CachingAllocator(const CachingAllocator &) = delete;
+
+        CachingAllocator &operator=(const CachingAllocator &) = delete;
+
+        void *allocate(size_t bytes) override;
+
+        void deallocate(void *ptr, size_t bytes) override;
+
+        AllocatorStats stats() const override;
+
+        // 把缓存的内存全部还给上游
+        void release();
+
+        ~CachingAllocator() override;
+    };
+
+    // 当前默认的分配器, 新创建的张量都从这里分配
+    Allocator &defaultAllocator();
+
+    // 替换默认的分配器, 传入 nullptr 恢复内置的分配器; 已经分配的张量仍由原来的分配器释放
+    void setDefaultAllocator(Allocator *allocator);
+
+    // 补齐到缓存行的整数倍, 向量化的循环处理末尾时不会越过分配的内存
+    inline size_t paddedBytes(const size_t bytes) {
+        return (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    }
+}
@@ -3,6 +3,8 @@
 #include<fstream>
 #include<list>
 #include<pipeline.hpp>
+#include<memory_planner.hpp>
+#include<runtime.hpp>
 
 
 namespace cnn::architectures {
@@ -24,17 +26,29 @@ namespace cnn::architectures {
         }
     };
 
+    // 一层在静态内存规划时间轴上的位置, forward 依次占用 0..n-1, backward 接在后面倒序占用 n..2n-1
+    struct LayerSchedule {
+        int forward;   // 本层 forward 的时间
+        int backward;  // 本层 backward 的时间, 不做反向传播时为 -1
+        int outputEnd; // 本层的输出最后一次被使用的时间
+        int deltaEnd;  // 本层传给上一层的梯度最后一次被使用的时间
+
+        bool training() const {
+            return backward >= 0;
+        }
+    };
+
     class Layer {
     public:
         std::string name_; //当前层的张量
-        std::vector<tensor> output_;// 当前层输出的张量
+        Tensor4D output_;// 当前层输出的张量
 
     public:
         Layer(std::string name) : name_(std::move(name)) {};
 
-        virtual std::vector<tensor> forward(const std::vector<tensor> &input) = 0;
+        virtual const Tensor4D &forward(const Tensor4D &input) = 0;
 
-        virtual std::vector<tensor> backward(std::vector<tensor> &delta) = 0;
+        virtual Tensor4D &backward(Tensor4D &delta) = 0;
 
         virtual void updateGradients(const dataType learningRate = 1e-4) {};
 
@@ -42,9 +56,47 @@ namespace cnn::architectures {
 
         virtual void loadWeights(std::ifstream &reader) {};
 
-        virtual std::vector<tensor> getOutput() {
+        virtual const Tensor4D &getOutput() {
             return this->output_;
         }
+
+        // 推导输出的形状, 同时向 planner 申请本层的缓冲区, 规划之后缓冲区变成内存池上的视图
+        virtual std::tuple<uint32_t, uint32_t, uint32_t>
+        planBuffers(memory::Planner &planner, uint32_t batchSize,
+                    const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape, const LayerSchedule &schedule) = 0;
+
+        // backward 是否直接修改传进来的 delta 并返回它, 此时上一层拿到的还是同一块缓冲区
+        virtual bool backwardInPlace() const {
+            return false;
+        }
+
+        // forward 是否直接修改传进来的输入并返回它, 此时上一层的输出要保留到下一层用完为止
+        virtual bool forwardInPlace() const {
+            return false;
+        }
+
+        // 冻结为推理模型之后释放只有反向传播才用到的缓冲区
+        virtual void releaseBackward() {};
+
+    protected:
+        // 只有 batch 大小或者形状发生变化时才重新分配缓冲区
+        static void initBuffer(Tensor4D &buffer, uint32_t batchSize,
+                               const std::tuple<uint32_t, uint32_t, uint32_t> &shape, const std::string &name);
+    };
+
+    // 卷积的实现方式
+    enum class ConvAlgorithm {
+        Direct,      // 直接按卷积定义计算
+        Im2col,      // 展开成矩阵之后使用 GEMM 计算
+        Winograd2x2, // Winograd F(2x2,3x3), 仅适用于 stride=1 的 3x3 卷积, 其他情况退回 Im2col
+        Winograd4x4  // Winograd F(4x4,3x3), 乘法更少但数值误差稍大
+    };
+
+    // 卷积之后在同一趟里完成的运算, 先池化再 ReLU, 和先 ReLU 再池化的结果一样
+    struct ConvEpilogue {
+        bool relu = false; // 输出经过 ReLU
+        int poolSize = 0;  // 大于 0 时再做 poolSize x poolSize, 步长为 poolStep 的最大池化
+        int poolStep = 0;
     };
 
     class Conv2D : public Layer {
@@ -62,24 +114,48 @@ namespace cnn::architectures {
 
         const int padding_; // 填充的大小
 
+        ConvAlgorithm algorithm_; // 前向传播使用的算法
+        ConvEpilogue epilogue_;   // 卷积之后直接完成的 ReLU 和池化
+
         std::default_random_engine seed_;
-        std::vector<int> offset_; //执行卷积操作时辅助使用
 
-        std::vector<tensor> _input_; //求梯度需要，即反向传播过程
+        const Tensor4D *_input_ = nullptr; //求梯度需要，即反向传播过程
 
         // 缓冲区
-        std::vector<tensor> deltaOutput_;   //反向传播时传给上一层的梯度
+        Tensor4D deltaOutput_;   //反向传播时传给上一层的梯度
         std::vector<tensor> weightsGradients_;  // 权重的梯度
         std::vector<dataType> biasGradients_;        // bias 的梯度
 
+        // GEMM 需要
+        Tensor4D columns_;                   // 每张输入图像 im2col 展开之后的矩阵
+        std::vector<dataType> weightMatrix_; // 所有卷积核拼接成的 outChannels x paramsForAKernel 矩阵
+        Tensor4D deltaColumns_;              // 传给上一层的梯度在 col2im 之前的展开形式, 每个梯度分片一份
+        bool columnsReady_ = false;          // columns_ 是否是当前输入展开的结果
+
+        // Winograd 需要
+        std::vector<dataType> winogradWeights_; // 变换之后的卷积核, 只在权重改变之后重新计算
+        bool winogradStale_ = true;
+
+        // 按 batch 并行求梯度时每个分片的权重和 bias 梯度, 排布为 weightMatrix_ 后面接 outChannels 个 bias
+        runtime::GradientShards gradientShards_;
+
+        // 池化需要, 池化之前的卷积结果不保存
+        Tensor4D deltaConv_;           // 传回池化之前的梯度
+        uint8_t *mask_ = nullptr;      // 每个池化输出对应的最大值在窗口内的下标, 指向 maskStorage_ 或者内存池
+        std::vector<uint8_t> maskStorage_;
+        size_t maskCapacity_ = 0;
+        size_t maskLength_ = 0;        // 每个样本的 mask 长度
+
     public:
         Conv2D(const std::string &name, const int inChannels = 3, const int outChannels = 16, const int kernelSize = 3,
-               const int stride = 2) : Layer(name), outChannels_(outChannels), inChannels_(inChannels),
-                                       kernelSize_(kernelSize), stride_(stride), padding_(0),
+               const int stride = 2, const int padding = 0,
+               const ConvAlgorithm algorithm = ConvAlgorithm::Im2col) :
+                Layer(name), outChannels_(outChannels), inChannels_(inChannels),
+                kernelSize_(kernelSize), stride_(stride), padding_(padding),
                                        paramsForAKernel_(inChannels_ * kernelSize_ * kernelSize_),
-                                       bias_(outChannels), offset_(kernelSize_ * kernelSize_) {
+                                       bias_(outChannels), algorithm_(algorithm) {
             assert(kernelSize_ & 1 && kernelSize_ >= 3);
-            assert(inChannels_ > 0 && outChannels_ > 0 && stride_ > 0);
+            assert(inChannels_ > 0 && outChannels_ > 0 && stride_ > 0 && padding_ >= 0);
 
             weights_.reserve(outChannels_);
             this->seed_.seed(212);
@@ -103,9 +179,17 @@ namespace cnn::architectures {
 
         int getParamsNum() const;
 
-        std::vector<tensor> forward(const std::vector<tensor> &input) override;
+        void setAlgorithm(ConvAlgorithm algorithm);
+
+        ConvAlgorithm getAlgorithm() const;
+
+        void setEpilogue(const ConvEpilogue &epilogue);
+
+        const ConvEpilogue &getEpilogue() const;
 
-        std::vector<tensor> backward(std::vector<tensor> &delta) override;
+        const Tensor4D &forward(const Tensor4D &input) override;
+
+        Tensor4D &backward(Tensor4D &delta) override;
 
         void updateGradients(dataType learningRate) override;
 
@@ -113,20 +197,54 @@ namespace cnn::architectures {
 
         void loadWeights(std::ifstream &reader) override;
 
+        std::tuple<uint32_t, uint32_t, uint32_t>
+        planBuffers(memory::Planner &planner, uint32_t batchSize,
+                    const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                    const LayerSchedule &schedule) override;
+
+        // 把紧跟在后面的逐通道仿射变换 y = scale * x + shift 合并进权重和 bias
+        void fold(const std::vector<dataType> &scale, const std::vector<dataType> &shift);
+
+        void releaseBackward() override;
+
     private:
 
-        void initForward(int batchSize, std::tuple<uint32_t, uint32_t, uint32_t> &shape, int preWeight);
+        int outputSize(int inputSize) const;
+
+        std::tuple<uint32_t, uint32_t, uint32_t> columnsShape(int outLength) const;
+
+        std::pair<int, int> pooledSize(int outHeight, int outWidth) const;
+
+        void initForward(int batchSize, std::tuple<uint32_t, uint32_t, uint32_t> &shape);
+
+        void epiloguePlane(int b, int oc, dataType *conv, int outHeight, int outWidth);
+
+        void epilogueImage(int b, int ocBegin, int ocEnd, dataType *conv, int outHeight, int outWidth);
+
+        Tensor4D &backwardEpilogue(Tensor4D &delta);
+
+        void forwardDirect(const Tensor4D &input, int outHeight, int outWidth);
+
+        void forwardIm2col(const Tensor4D &input, int outHeight, int outWidth);
+
+        void forwardWinograd(const Tensor4D &input, int tile);
+
+        bool winogradApplicable() const;
+
+        void packWeightMatrix();
 
         void initBackward(std::vector<tensor> &v, int size,
                           std::tuple<uint32_t, uint32_t, uint32_t> shape, std::string name);
 
-        void
-        calWeightAndBiasGradients(std::vector<tensor> &delta, uint32_t outHeight, uint32_t outWidth, uint32_t height,
-                                  uint32_t width);
+        void calWeightAndBiasGradients(Tensor4D &delta, uint32_t outHeight, uint32_t outWidth);
+
+        void calDeltaGradients(Tensor4D &delta, uint32_t outHeight, uint32_t outWidth, uint32_t inHeight,
+                               uint32_t inWidth);
 
-        void
-        calDeltaGradients(std::vector<tensor> &delta, uint32_t height, uint32_t width, uint32_t inHeight,
-                          uint32_t inWidth);
+        void backwardIm2col(Tensor4D &delta, uint32_t outHeight, uint32_t outWidth, uint32_t height,
+                            uint32_t width);
+
+        void reduceGradients();
     };
 
 
@@ -137,33 +255,73 @@ namespace cnn::architectures {
         const int padding_;// 暂不支持
 
         // 缓冲区
-        std::vector<std::vector<int>> mask_;
-        std::vector<tensor> deltaOutput_;
-        std::vector<int> offset_;
+        uint8_t *mask_ = nullptr;          // 每个输出对应的最大值在窗口内的下标, 指向 maskStorage_ 或者内存池
+        std::vector<uint8_t> maskStorage_; // 没有经过内存规划时自己持有的 mask
+        size_t maskCapacity_ = 0;          // mask_ 可用的长度
+        size_t maskLength_ = 0;            // 每个样本的 mask 长度
+        Tensor4D deltaOutput_;
 
     public:
         MaxPool2D(const std::string &name, const int kernelSize = 2, const int step = 2) :
                 Layer(name),
                 kernelSize_(kernelSize),
                 step_(step),
-                padding_(0),
-                offset_(kernelSize * kernelSize) {};
+                padding_(0) {
+            assert(kernelSize_ > 0 && kernelSize_ * kernelSize_ <= 256 && step_ > 0);
+        };
+
+        int kernelSize() const {
+            return kernelSize_;
+        }
+
+        int step() const {
+            return step_;
+        }
+
+        const Tensor4D &forward(const Tensor4D &input) override;
 
-        std::vector<tensor> forward(const std::vector<tensor> &input) override;
+        Tensor4D &backward(Tensor4D &delta) override;
 
-        std::vector<tensor> backward(std::vector<tensor> &delta) override;
+        std::tuple<uint32_t, uint32_t, uint32_t>
+        planBuffers(memory::Planner &planner, uint32_t batchSize,
+                    const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                    const LayerSchedule &schedule) override;
+
+        void releaseBackward() override;
 
     private:
         void init(int batchSize, std::tuple<uint32_t, uint32_t, uint32_t> shape, uint32_t height, uint32_t width);
     };
 
     class ReLU : public Layer {
+    private:
+        bool inPlace_;                    // 直接在输入上计算, 不需要 output_
+        const Tensor4D *result_ = nullptr; // 本次 forward 的结果, output_ 或者输入, backward 根据它的正负传梯度
+
     public:
-        explicit ReLU(const std::string &name) : Layer(name) {}
+        explicit ReLU(const std::string &name, const bool inPlace = false) : Layer(name), inPlace_(inPlace) {}
+
+        // 只有上一层的输出不会再被别人用到的时候才能原地计算, 例如不能是网络的输入
+        void setInPlace(bool inPlace);
+
+        const Tensor4D &forward(const Tensor4D &input) override;
 
-        std::vector<tensor> forward(const std::vector<tensor> &input) override;
+        Tensor4D &backward(Tensor4D &delta) override;
 
-        std::vector<tensor> backward(std::vector<tensor> &delta) override;
+        const Tensor4D &getOutput() override;
+
+        std::tuple<uint32_t, uint32_t, uint32_t>
+        planBuffers(memory::Planner &planner, uint32_t batchSize,
+                    const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                    const LayerSchedule &schedule) override;
+
+        bool backwardInPlace() const override {
+            return true;
+        }
+
+        bool forwardInPlace() const override {
+            return inPlace_;
+        }
 
     private:
         void init(int size, std::tuple<uint32_t, uint32_t, uint32_t> shape);
@@ -180,12 +338,13 @@ namespace cnn::architectures {
 
         //历史信息
         std::tuple<uint32_t, uint32_t, uint32_t> deltaShape_;
-        std::vector<tensor> _input_;
+        Tensor4D flatInput_; // 展平成 inChannels x 1 x 1 的输入视图, 求梯度需要, 输入不变时在 forward 之间复用
 
         // 缓冲区
-        std::vector<tensor> deltaOutPut_;
+        Tensor4D deltaOutPut_;
         std::vector<dataType> weightGradients_;
         std::vector<dataType> biasGradients_;
+        runtime::GradientShards gradientShards_; // 按 batch 并行求权重梯度时每个分片的结果
 
     public:
         LinearLayer(const std::string &name, const int inChannels, const int outChannels) :
@@ -209,9 +368,9 @@ namespace cnn::architectures {
             }
         }
 
-        std::vector<tensor> forward(const std::vector<tensor> &input) override;
+        const Tensor4D &forward(const Tensor4D &input) override;
 
-        std::vector<tensor> backward(std::vector<tensor> &delta) override;
+        Tensor4D &backward(Tensor4D &delta) override;
 
         virtual void updateGradients(const dataType learningRate = 1e-4) override;
 
@@ -219,11 +378,18 @@ namespace cnn::architectures {
 
         virtual void loadWeights(std::ifstream &reader) override;
 
-        void calWeightGradients(std::vector<tensor> &delta);
+        std::tuple<uint32_t, uint32_t, uint32_t>
+        planBuffers(memory::Planner &planner, uint32_t batchSize,
+                    const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                    const LayerSchedule &schedule) override;
+
+        void releaseBackward() override;
+
+        void calWeightGradients(Tensor4D &delta);
 
-        void calBiasGradients(std::vector<tensor> &delta);
+        void calBiasGradients(Tensor4D &delta);
 
-        void calInputGradients(std::vector<tensor> &delta);
+        void calInputGradients(Tensor4D &delta);
     };
 
 
@@ -243,7 +409,7 @@ namespace cnn::architectures {
         std::vector<dataType> movingVar_;
 
         // 缓冲区
-        std::vector<tensor> normedInput_;
+        Tensor4D normedInput_;
         std::vector<dataType> bufferMean_;
         std::vector<dataType> bufferVar_;
 
@@ -251,11 +417,8 @@ namespace cnn::architectures {
         std::vector<dataType> gammaGradients_;
         std::vector<dataType> betaGradients_;
 
-        // 临时的梯度信息
-        tensor normGradients_;
-
         // 求梯度需要
-        std::vector<tensor> _input_;
+        const Tensor4D *_input_ = nullptr;
 
     public:
         BatchNorm2D(const std::string &name, const int outChannels, const dataType eps = 1e-4,
@@ -264,16 +427,16 @@ namespace cnn::architectures {
                 outChannels_(outChannels),
                 eps_(eps),
                 momentNum_(momentNum),
-                gamma_(outChannels, 0),
+                gamma_(outChannels, 1),
                 beta_(outChannels, 0),
                 movingMean_(outChannels, 0),
                 movingVar_(outChannels, 0),
                 bufferMean_(outChannels, 0),
                 bufferVar_(outChannels, 0) {}
 
-        std::vector<tensor> forward(const std::vector<tensor> &input) override;
+        const Tensor4D &forward(const Tensor4D &input) override;
 
-        std::vector<tensor> backward(std::vector<tensor> &delta) override;
+        Tensor4D &backward(Tensor4D &delta) override;
 
         void updateGradients(const dataType learningRate) override;
 
@@ -281,7 +444,19 @@ namespace cnn::architectures {
 
         void loadWeights(std::ifstream &reader) override;
 
-        std::vector<tensor> getOutput() override;
+        const Tensor4D &getOutput() override;
+
+        std::tuple<uint32_t, uint32_t, uint32_t>
+        planBuffers(memory::Planner &planner, uint32_t batchSize,
+                    const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                    const LayerSchedule &schedule) override;
+
+        bool backwardInPlace() const override {
+            return true;
+        }
+
+        // 推理时的归一化等价于逐通道的 y = scale * x + shift, 返回 (scale, shift)
+        std::pair<std::vector<dataType>, std::vector<dataType>> inferenceAffine() const;
 
     private:
         void init(std::tuple<uint32_t, uint32_t, uint32_t> &&shape);
@@ -297,12 +472,24 @@ namespace cnn::architectures {
     private:
         std::list<std::shared_ptr<Layer>> layerSequence_;
 
+        // 静态内存规划, 所有层的输出和梯度都放在 arena_ 中
+        memory::Planner planner_;
+        memory::Arena arena_;
+        uint32_t plannedBatch_ = 0;
+        std::tuple<uint32_t, uint32_t, uint32_t> plannedShape_{0, 0, 0};
+        bool plannedTraining_ = false;
+
+        bool frozen_ = false; // 冻结之后只能推理
+
+        // 把 Conv2D 之后紧跟的 ReLU 和 MaxPool2D 合并进卷积的 epilogue
+        void fuseEpilogues();
+
     public:
         AlexNet(const int numOfClasses = 3, const bool batchNorm = false);
 
-        std::vector<tensor> forward(const std::vector<tensor> &input);
+        const Tensor4D &forward(const Tensor4D &input);
 
-        void backward(std::vector<tensor> &delta);
+        void backward(Tensor4D &delta);
 
         void updateGradients(const dataType learningRate = 1e-4);
 
@@ -311,8 +498,24 @@ namespace cnn::architectures {
         void loadWeights(const std::filesystem::path &path);
 
         cv::Mat gradCam(const std::string &layerName) const;
+
+        // 按照输入的形状和是否需要反向传播规划内存, forward 时形状变化会自动调用
+        void planMemory(uint32_t batchSize, const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape);
+
+        const memory::Planner &memoryPlan() const {
+            return planner_;
+        }
+
+        // 冻结为推理模型: BatchNorm2D 合并进前面的 Conv2D 并从网络中删除, 释放所有反向传播用到的缓冲区.
+        // 之后的 forward 总是不求梯度, 不能再 backward 和 updateGradients.
+        // 保存的权重和 batchNorm = false 构造的网络格式一致
+        void freeze();
+
+        bool frozen() const {
+            return frozen_;
+        }
     };
 
 
-    void printTensor(const std::vector<cnn::tensor> &input);
+    void printTensor(const Tensor4D &input);
 }
\ No newline at end of file
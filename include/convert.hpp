@@ -0,0 +1,14 @@
+#pragma once
+
+#include<data_format.hpp>
+
+namespace cnn::kernels {
+    // 把 pixels 个 HWC 排布的 3 通道 uint8 像素拆成 CHW 排布的 float, 同时做线性变换
+    // output[c * pixels + i] = image[3 * i + c] * scale[c] + bias[c]
+    void hwcToChw(const uchar *image, uint32_t pixels, const dataType scale[3], const dataType bias[3],
+                  dataType *output);
+
+    // 由 mean/std 算出 hwcToChw 的参数, 等价于先除以 255 再做 (x - mean) / std
+    void normalizeParams(const std::vector<dataType> &mean, const std::vector<dataType> &standardDeviation,
+                         dataType scale[3], dataType bias[3]);
+}
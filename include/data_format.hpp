@@ -3,12 +3,86 @@
 #include<iostream>
 #include<vector>
 #include<opencv2/core.hpp>
+#include<allocator.hpp>
 
 
 namespace cnn {
     // tensor 数据类型
     using dataType = float;
 
+    // 不持有内存的 CHW 视图, 通过步长访问数据, 四周可以带一圈虚拟的 0 填充.
+    // 填充, 翻转, 通道切片和 reshape 都只修改描述信息, 不复制数据
+    class TensorView {
+    private:
+        const dataType *data_ = nullptr; // 逻辑坐标 (0, 0, 0) 对应的位置, 翻转之后指向平面的末尾
+        uint32_t channels_ = 0;
+        uint32_t height_ = 0;            // 不含填充的高和宽
+        uint32_t width_ = 0;
+        ptrdiff_t channelStride_ = 0;
+        ptrdiff_t rowStride_ = 0;
+        ptrdiff_t colStride_ = 0;
+        uint32_t padding_ = 0;           // 四周虚拟填充的宽度, 读到的值都是 0
+
+    public:
+        TensorView() = default;
+
+        // 连续存放的 CHW 数据
+        TensorView(const dataType *data, uint32_t channels, uint32_t height, uint32_t width);
+
+        uint32_t getChannels() const {
+            return channels_;
+        }
+
+        // 包含填充的高和宽
+        uint32_t getHeight() const {
+            return height_ + 2 * padding_;
+        }
+
+        uint32_t getWidth() const {
+            return width_ + 2 * padding_;
+        }
+
+        uint32_t getPadding() const {
+            return padding_;
+        }
+
+        // 读取 (c, y, x), 坐标包含填充, 落在填充上时返回 0
+        dataType at(const uint32_t c, int y, int x) const {
+            y -= static_cast<int>(padding_);
+            x -= static_cast<int>(padding_);
+            if (y < 0 || x < 0 || y >= static_cast<int>(height_) || x >= static_cast<int>(width_)) {
+                return 0;
+            }
+            return data_[c * channelStride_ + y * rowStride_ + x * colStride_];
+        }
+
+        // 在已有的填充之外再加一圈
+        TensorView padded(uint32_t padding) const;
+
+        // 每个通道的平面旋转 180 度
+        TensorView rot180() const;
+
+        // 通道 [begin, end)
+        TensorView slice(uint32_t begin, uint32_t end) const;
+
+        // 只有连续且没有填充的视图才能 reshape
+        TensorView reshape(uint32_t channels, uint32_t height, uint32_t width) const;
+
+        TensorView flatten() const;
+
+        bool contiguous() const;
+
+        // 连续且没有填充时的数据指针
+        const dataType *data() const;
+
+        uint32_t length() const;
+
+        std::tuple<uint32_t, uint32_t, uint32_t> shape() const;
+
+        // 按 CHW 连续写出, 包含填充
+        void copyTo(dataType *dst) const;
+    };
+
 
     class Tensor3D {
     private:
@@ -18,6 +92,8 @@ namespace cnn {
         const uint32_t length_; // channels_*height_width_
 
         dataType *data_;
+        const bool owner_ = true; // 是否持有 data_ 的内存, 视图不负责释放
+        memory::Allocator *allocator_ = nullptr; // 分配 data_ 的分配器, 释放时使用同一个
 
         std::string name_;
     public:
@@ -40,28 +116,42 @@ namespace cnn {
         Tensor3D(uint32_t channel, uint32_t height, uint32_t width, std::string name = {"pipeline"}) :
                 channels_(channel), height_(height), width_(width), name_(std::move(name)),
                 length_(height_ * width_ * channels_) {
-            this->data_ = new dataType[channel * height * width];
+            allocate();
         }
 
-        Tensor3D(std::tuple<uint32_t, uint32_t, uint32_t> &shape, std::string name = {"pipeline"}) :
+        Tensor3D(const std::tuple<uint32_t, uint32_t, uint32_t> &shape, std::string name = {"pipeline"}) :
                 channels_(std::get<0>(shape)),
                 height_(std::get<1>(shape)),
                 width_(std::get<2>(shape)),
                 name_(std::move(name)), length_(height_ * width_ * channels_) {
-            this->data_ = new dataType[std::get<0>(shape) * std::get<1>(shape) * std::get<2>(shape)];
+            allocate();
         }
 
 
         Tensor3D(const int length, std::string name = {"pipeline"}) : channels_(length), height_(1), width_(1),
                                                                       length_(height_ * width_ * channels_) {
-            this->data_ = new dataType[length];
+            allocate();
         }
 
+        // 不持有内存的视图, 数据由外部管理
+        Tensor3D(dataType *data, uint32_t channel, uint32_t height, uint32_t width, std::string name = {"view"}) :
+                channels_(channel), height_(height), width_(width), length_(height_ * width_ * channels_),
+                data_(data), owner_(false), name_(std::move(name)) {}
+
+        // 持有的内存只能有一个 Tensor3D 负责释放
+        Tensor3D(const Tensor3D &) = delete;
+
+        Tensor3D &operator=(const Tensor3D &) = delete;
+
 
         void readData(cv::Mat &image);
 
         void readData(const uchar *image, uint32_t size);
 
+        // 读取的同时做归一化, 和先 readData 再 normalize 的结果一致, 只需要遍历一次
+        void readData(const uchar *image, uint32_t size, const std::vector<dataType> &mean,
+                      const std::vector<dataType> &standardDeviation);
+
         void setZero();
 
         dataType max() const;
@@ -88,12 +178,134 @@ namespace cnn {
 
         void print(uint32_t channel = 0) const;
 
+        TensorView view() const;
+
         std::shared_ptr<Tensor3D> rot180() const;
 
         std::shared_ptr<Tensor3D> padding(const int padding) const;
 
         ~Tensor3D();
+
+    private:
+        void allocate();
     };
 
     using tensor = std::shared_ptr<Tensor3D>;
+
+    // 一整个 batch 的数据, 按 NCHW 排布在同一块 64 字节对齐的内存中
+    class Tensor4D {
+    private:
+        uint32_t batch_ = 0;
+        uint32_t channels_ = 0;
+        uint32_t height_ = 0;
+        uint32_t width_ = 0;
+        size_t sampleStride_ = 0; // 相邻两个样本起始位置的间隔, 补齐到 64 字节, 保证每个样本都是对齐的
+
+        dataType *data_ = nullptr;
+        bool owner_ = true;         // 是否持有 data_ 的内存, 从内存池中划分出来的不负责释放
+        memory::Allocator *allocator_ = nullptr;
+        std::vector<tensor> views_; // 每个样本对应的 Tensor3D 视图, 构造时创建一次
+
+        std::string name_;
+
+    public:
+        Tensor4D() = default;
+
+        Tensor4D(uint32_t batch, uint32_t channel, uint32_t height, uint32_t width, std::string name = {"batch"});
+
+        Tensor4D(uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape,
+                 std::string name = {"batch"});
+
+        // 不持有内存, 数据放在外部分配好的 data 上, data 必须 64 字节对齐且至少有 bytes(batch, shape) 大小
+        Tensor4D(dataType *data, uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape,
+                 std::string name = {"batch"});
+
+        Tensor4D(const Tensor4D &) = delete;
+
+        Tensor4D &operator=(const Tensor4D &) = delete;
+
+        Tensor4D(Tensor4D &&other) noexcept;
+
+        Tensor4D &operator=(Tensor4D &&other) noexcept;
+
+        uint32_t getBatch() const {
+            return batch_;
+        }
+
+        uint32_t getChannels() const {
+            return channels_;
+        }
+
+        uint32_t getHeight() const {
+            return height_;
+        }
+
+        uint32_t getWidth() const {
+            return width_;
+        }
+
+        dataType *getData() const {
+            return data_;
+        }
+
+        // 第 b 个样本的起始地址
+        dataType *data(uint32_t b) const {
+            return data_ + b * sampleStride_;
+        }
+
+        // 第 b 个样本的视图
+        const tensor &at(uint32_t b) const {
+            return views_.at(b);
+        }
+
+        // 第 b 个样本的步长视图
+        TensorView view(uint32_t b) const {
+            return {data(b), channels_, height_, width_};
+        }
+
+        // 样本数据个数不变, 换一个形状, 返回不持有内存的视图
+        Tensor4D reshape(const std::tuple<uint32_t, uint32_t, uint32_t> &shape) const;
+
+        // 每个样本展平成 length x 1 x 1
+        Tensor4D flatten() const;
+
+        // 第 [begin, end) 个样本
+        Tensor4D slice(uint32_t begin, uint32_t end) const;
+
+        const std::vector<tensor> &views() const {
+            return views_;
+        }
+
+        bool empty() const {
+            return data_ == nullptr;
+        }
+
+        size_t sampleStride() const {
+            return sampleStride_;
+        }
+
+        uint32_t sampleLength() const;
+
+        std::tuple<uint32_t, uint32_t, uint32_t> sampleShape() const;
+
+        bool matches(uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape) const;
+
+        bool isOwner() const {
+            return owner_;
+        }
+
+        // 给定 batch 大小和样本形状时需要的字节数, 包含每个样本对齐补齐的部分
+        static size_t bytes(uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape);
+
+        void setZero();
+
+        void printShape() const;
+
+        ~Tensor4D();
+
+    private:
+        void createViews();
+
+        void release();
+    };
 }
\ No newline at end of file
@@ -0,0 +1,230 @@
+#pragma once
+
+#include<cstdint>
+#include<filesystem>
+#include<fstream>
+#include<map>
+#include<memory>
+#include<mutex>
+#include<random>
+#include<string>
+#include<tuple>
+#include<unordered_map>
+#include<vector>
+#include<opencv2/core.hpp>
+#include<sampler.hpp>
+
+namespace cnn::pipeline {
+    using listType = std::vector<std::pair<std::string, int>>;
+
+    // 数据集中图像的来源, DataLoader 只通过下标访问
+    class DatasetSource {
+    public:
+        virtual size_t size() const = 0;
+
+        virtual int label(size_t index) const = 0;
+
+        // 解码第 index 张图像, 返回 HWC 排布的 BGR 图像, 调用者可以原地修改
+        virtual cv::Mat decode(size_t index) const = 0;
+
+        // 之后要缩小到 minimum 的时候可以解码出更小的图像, 宽高都不小于 minimum. 默认就是 decode
+        virtual cv::Mat decodeAtLeast(size_t index, cv::Size minimum) const;
+
+        // 已经是 height x width 的 HWC 字节时直接返回数据的指针, 可以跳过解码和缩放, 否则返回 nullptr
+        virtual const uchar *raw(size_t index, uint32_t height, uint32_t width) const;
+
+        // 在所有数据来源中唯一标识第 index 张图像, 用作解码缓存的键. 返回空字符串表示不需要缓存
+        virtual std::string key(size_t index) const;
+
+        // 每一轮开始时决定这一轮的读取顺序, 默认由 sampler 决定. 顺序读取的来源在这里安排自己的顺序
+        virtual void arrange(std::vector<size_t> &order, const Sampler &sampler, uint64_t epoch) const;
+
+        virtual ~DatasetSource() = default;
+    };
+
+    // 解码内存中的图像文件. JPEG 文件头中的尺寸是 minimum 的 2, 4, 8 倍以上时让解码器在 DCT 域直接缩小
+    cv::Mat decodeImage(const std::vector<uchar> &bytes, cv::Size minimum = {});
+
+    // 读取并解码图像文件, 缩小的规则和 decodeImage 一样
+    cv::Mat readImage(const std::string &path, cv::Size minimum = {});
+
+    // 图像文件列表, 每次用 cv::imread 解码
+    class FileSource : public DatasetSource {
+    private:
+        listType images_;
+
+    public:
+        explicit FileSource(listType images);
+
+        size_t size() const override;
+
+        int label(size_t index) const override;
+
+        cv::Mat decode(size_t index) const override;
+
+        cv::Mat decodeAtLeast(size_t index, cv::Size minimum) const override;
+
+        std::string key(size_t index) const override;
+    };
+
+    // 清单中的一张图像, path 是相对于数据集目录的路径
+    struct ManifestEntry {
+        std::string path;
+        int label;
+        std::string split;   // train, test 或者 valid
+        uint64_t bytes;
+        int64_t modified;    // 文件的修改时间, 和 bytes 一起判断文件有没有变化
+        uint32_t width;
+        uint32_t height;
+        uint64_t hash;       // 文件内容的 FNV-1a 哈希
+    };
+
+    // 数据集的清单, 保存所有图像的路径, 类别, 大小, 解码之后的尺寸, 内容哈希和所属的划分.
+    // 启动时只读一个清单文件, 不需要遍历目录
+    class DatasetManifest {
+    private:
+        std::filesystem::path dataset_;
+        std::vector<std::string> categories_;
+        std::pair<float, float> ratios_;
+        std::vector<ManifestEntry> entries_; // 按路径排序
+
+    public:
+        DatasetManifest(std::filesystem::path dataset, std::vector<std::string> categories,
+                        const std::pair<float, float> &ratios = {0.8, 0.1});
+
+        // 读取清单文件, 文件不存在或者格式不对时抛出异常
+        static DatasetManifest load(const std::filesystem::path &file);
+
+        void save(const std::filesystem::path &file) const;
+
+        // 遍历数据集目录, 只对新增或者变化的图像计算哈希和尺寸, 删除已经不存在的图像. 返回重新索引的图像数目
+        size_t update();
+
+        // 清单中的数据集目录, 类别和划分比例是否和给定的一致
+        bool matches(const std::filesystem::path &dataset, const std::vector<std::string> &categories,
+                     const std::pair<float, float> &ratios) const;
+
+        // 按划分返回图像的完整路径和类别
+        std::map<std::string, listType> splits() const;
+
+        const std::vector<ManifestEntry> &entries() const;
+    };
+
+    // 打包文件的格式: 文件头, count 个索引项, 之后是按缓存行对齐的 height x width x channels 字节的图像
+    struct PackHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint32_t height;
+        uint32_t width;
+        uint32_t channels;
+        uint32_t reserved;
+        uint64_t dataOffset; // 第一张图像的偏移
+        uint64_t stride;     // 相邻两张图像的间隔
+    };
+
+    struct PackEntry {
+        int32_t label;
+        uint32_t reserved;
+    };
+
+    // 把图像列表解码并缩放到 imageSize (height, width, channels) 之后写进一个打包文件, 只需要执行一次.
+    // 有图像缺失或者损坏时不留下打包文件, 抛出的异常中包含图像的路径
+    void packDataset(const listType &images, const std::filesystem::path &output,
+                     const std::tuple<uint32_t, uint32_t, uint32_t> &imageSize);
+
+    // 只读映射的打包文件, 打开时只做 mmap, 读取一张图像就是读映射的内存
+    class PackedSource : public DatasetSource {
+    private:
+        const uchar *mapped_ = nullptr;
+        size_t mappedBytes_ = 0;
+        const PackHeader *header_ = nullptr;
+        const PackEntry *entries_ = nullptr;
+
+    public:
+        explicit PackedSource(const std::filesystem::path &file);
+
+        PackedSource(const PackedSource &) = delete;
+
+        PackedSource &operator=(const PackedSource &) = delete;
+
+        ~PackedSource() override;
+
+        size_t size() const override;
+
+        int label(size_t index) const override;
+
+        cv::Mat decode(size_t index) const override;
+
+        const uchar *raw(size_t index, uint32_t height, uint32_t width) const override;
+
+        std::tuple<uint32_t, uint32_t, uint32_t> imageSize() const;
+    };
+
+    // 把图像列表写成 WebDataset 格式的 tar 分片, 每个分片 perShard 张图像, 返回分片的路径
+    std::vector<std::filesystem::path> writeShards(const listType &images, const std::filesystem::path &directory,
+                                                   size_t perShard = 1000);
+
+    // WebDataset 格式的 tar 分片, 同一个 key 的图像 (.jpg .jpeg .png) 和类别 (.cls, 文本的整数) 相邻存放.
+    // 打开时只读取 tar 的文件头建立索引; 训练时按分片顺序大块读取, 在 bufferSize 张图像的缓冲区里打乱
+    class TarShardSource : public DatasetSource {
+    private:
+        struct Member {
+            uint32_t shard;
+            uint64_t offset; // 图像数据在分片中的偏移
+            uint64_t bytes;
+            int label;
+        };
+
+        // 读进内存的样本, generation 是读入时的轮次
+        struct Buffered {
+            uint64_t generation;
+            std::vector<uchar> bytes;
+        };
+
+        std::vector<std::filesystem::path> shards_;
+        std::vector<Member> members_;                    // 按给定的分片顺序, 分片内按文件中的顺序
+        std::vector<std::pair<size_t, size_t>> ranges_;  // 每个分片的样本在 members_ 中的范围
+        const size_t bufferSize_;
+
+        // 这一轮顺序读取的状态, 由多个解码线程共享
+        mutable std::mutex mutex_;
+        mutable std::vector<size_t> pass_;          // 这一轮按文件顺序读取样本的次序
+        mutable std::vector<size_t> passPosition_;  // 每个样本在 pass_ 中的位置
+        mutable size_t cursor_ = 0;                 // pass_ 中下一个要读取的位置
+        mutable uint64_t generation_ = 0;           // 第几次 startPass_
+        mutable std::unordered_map<size_t, Buffered> buffer_; // 已经读进内存, 还没有被取走的样本
+        mutable std::ifstream stream_;
+        mutable int64_t streamShard_ = -1;
+        mutable uint64_t streamOffset_ = 0;
+        mutable size_t randomReads_ = 0;
+        std::unique_ptr<char[]> streamBuffer_;
+
+        // 顺序读入 pass_[cursor_] 放进缓冲区
+        void readNext_() const;
+
+        // 不在这一轮顺序读取范围内的样本, 单独定位读取
+        std::vector<uchar> readAt_(size_t index) const;
+
+        void startPass_(std::vector<size_t> pass) const;
+
+    public:
+        explicit TarShardSource(std::vector<std::filesystem::path> shards, size_t bufferSize = 1000);
+
+        size_t size() const override;
+
+        int label(size_t index) const override;
+
+        cv::Mat decode(size_t index) const override;
+
+        cv::Mat decodeAtLeast(size_t index, cv::Size minimum) const override;
+
+        // 分片就是 sampler 的块, 打乱分片之后顺序读取, 读出的样本进入缓冲区, 每次从缓冲区中随机取出一个
+        void arrange(std::vector<size_t> &order, const Sampler &sampler, uint64_t epoch) const override;
+
+        std::string key(size_t index) const override;
+
+        // 没能顺序读取, 需要单独定位读取的次数, 例如上一轮还没有解码完的样本
+        size_t randomReads() const;
+    };
+}
@@ -2,13 +2,21 @@
 
 #include<data_format.hpp>
 
-std::vector<cnn::tensor> softMax(const std::vector<cnn::tensor> &input);
+// softMax, oneHot 和 crossEntropyBackward 分开计算, 训练和验证已经改用 softmaxCrossEntropy,
+// 现在只在 softmaxCrossEntropyTest 中作为对照的参考实现
+cnn::Tensor4D softMax(const cnn::Tensor4D &input);
 
-std::vector<cnn::tensor> oneHot(const std::vector<int> &labels, const int numOfClasses);
+cnn::Tensor4D oneHot(const std::vector<int> &labels, const int numOfClasses);
 
-std::pair<cnn::dataType, std::vector<cnn::tensor>> crossEntropyBackward(
-        const std::vector<cnn::tensor> &probs, const std::vector<cnn::tensor> &labels
+std::pair<cnn::dataType, cnn::Tensor4D> crossEntropyBackward(
+        const cnn::Tensor4D &probs, const cnn::Tensor4D &labels
 );
 
+// softmax 和交叉熵一起计算, 返回平均的损失. 用 log-sum-exp 求 log(prob), 概率下溢时也不会得到 -inf.
+// predict 写入每个样本得分最高的类别; delta 不为空时写入对 logits 的梯度 prob - onehot,
+// 只有形状变化时才重新分配, 训练时每一步传同一个 delta 就不会再分配内存
+cnn::dataType softmaxCrossEntropy(const cnn::Tensor4D &logits, const std::vector<int> &labels,
+                                  std::vector<int> &predict, cnn::Tensor4D *delta = nullptr);
+
 std::string floatToString(const float value, const int precision);
 
@@ -0,0 +1,19 @@
+#pragma once
+
+#include<data_format.hpp>
+
+namespace cnn::kernels {
+    // 行主序的单精度矩阵乘法 C = alpha * op(A) * op(B) + beta * C
+    // op(A) 为 M x K, op(B) 为 K x N, C 为 M x N
+    void sgemm(bool transA, bool transB, int M, int N, int K, dataType alpha,
+               const dataType *A, int lda, const dataType *B, int ldb,
+               dataType beta, dataType *C, int ldc);
+
+    // 将一张 CHW 图像展开成 (channels*kernel*kernel) x (outHeight*outWidth) 的矩阵
+    void im2col(const dataType *image, int channels, int height, int width,
+                int kernelSize, int stride, int padding, dataType *columns);
+
+    // im2col 的逆过程, 把展开矩阵中的值累加回 CHW 图像对应的位置
+    void col2im(const dataType *columns, int channels, int height, int width,
+                int kernelSize, int stride, int padding, dataType *image);
+}
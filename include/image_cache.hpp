@@ -0,0 +1,44 @@
+#pragma once
+
+#include<list>
+#include<mutex>
+#include<string>
+#include<unordered_map>
+#include<opencv2/core.hpp>
+
+namespace cnn::pipeline {
+    struct CacheStats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;  // 为了腾出空间被淘汰的图像数
+        size_t images = 0;     // 当前缓存的图像数
+        size_t bytes = 0;      // 当前缓存的图像占用的字节数
+    };
+
+    // 按字节数限制大小的 LRU 缓存, 保存解码之后还没有增强的图像, 多个 DataLoader 可以共享一个.
+    // 返回的图像和缓存共享内存, 不能原地修改
+    class ImageCache {
+    private:
+        struct Entry {
+            std::string key;
+            cv::Mat image;
+            cv::Size minimum; // 解码时要求的最小尺寸
+        };
+
+        const size_t capacity_;
+        std::list<Entry> entries_; // 最近使用的在前面
+        std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+        mutable std::mutex mutex_;
+        CacheStats stats_;
+
+    public:
+        explicit ImageCache(size_t capacityBytes);
+
+        // 查找按不小于 minimum 解码的图像, 没有或者缓存的分辨率不够时返回空的图像
+        cv::Mat find(const std::string &key, cv::Size minimum);
+
+        void insert(const std::string &key, const cv::Mat &image, cv::Size minimum);
+
+        CacheStats stats() const;
+    };
+}
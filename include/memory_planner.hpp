@@ -0,0 +1,78 @@
+#pragma once
+
+#include<functional>
+#include<string>
+#include<vector>
+#include<data_format.hpp>
+
+namespace cnn::memory {
+    // 一个缓冲区的申请, 生命周期 [begin, end] 两端都包含, 时间以层的 forward/backward 执行顺序计
+    struct Request {
+        std::string name;
+        size_t bytes;
+        int begin;
+        int end;
+        std::function<void(void *)> bind; // 规划完成之后把分配到的地址交给缓冲区的持有者
+        size_t offset = 0;                // 在内存池中的偏移
+    };
+
+    // 静态内存规划, 生命周期不重叠的缓冲区共用同一段内存
+    class Planner {
+    private:
+        std::vector<Request> requests_;
+        size_t plannedBytes_ = 0;
+
+    public:
+        void add(std::string name, size_t bytes, int begin, int end, std::function<void(void *)> bind);
+
+        // 申请一个 Tensor4D, 规划之后 tensor 变成指向内存池的视图
+        void addTensor(Tensor4D &tensor, uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape,
+                       const std::string &name, int begin, int end);
+
+        // 为所有申请分配偏移, 返回内存池需要的字节数
+        size_t plan();
+
+        // 把规划好的地址交给各个缓冲区, arena 至少要有 plannedBytes() 大小
+        void bind(char *arena) const;
+
+        size_t plannedBytes() const;
+
+        // 每个缓冲区单独分配时一共需要的字节数
+        size_t naiveBytes() const;
+
+        const std::vector<Request> &requests() const;
+
+        void clear();
+    };
+
+    // 64 字节对齐的一整块内存, 只增不减, 重新规划之后可以直接复用
+    class Arena {
+    private:
+        char *data_ = nullptr;
+        size_t capacity_ = 0;
+        Allocator *allocator_ = nullptr;
+
+    public:
+        Arena() = default;
+
+        Arena(const Arena &) = delete;
+
+        Arena &operator=(const Arena &) = delete;
+
+        // 保证至少有 bytes 大小, 不够时重新分配, 之前的内容不保留
+        char *reserve(size_t bytes);
+
+        // 归还持有的内存, 之后的 reserve 重新分配
+        void release();
+
+        char *data() const {
+            return data_;
+        }
+
+        size_t capacity() const {
+            return capacity_;
+        }
+
+        ~Arena();
+    };
+}
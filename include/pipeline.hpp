@@ -2,23 +2,46 @@
 
 #include<vector>
 #include<data_format.hpp>
+#include<dataset.hpp>
+#include<image_cache.hpp>
 #include<random>
 #include<map>
 #include<opencv2/core.hpp>
 #include<opencv2/highgui.hpp>
 #include<opencv2/imgproc.hpp>
 #include<filesystem>
+#include<condition_variable>
+#include<mutex>
+#include<thread>
 
 namespace cnn::pipeline {
-    //
-    using listType = std::vector<std::pair<std::string, int>>;
-
     std::map<std::string, listType> getImagesForClassification(
             const std::filesystem::path &dataset,
             const std::vector<std::string> &categories = {},
             const std::pair<float, float> &ratios = {0.8, 0.1}
     );
 
+    // 通过清单文件得到划分, 清单不存在, 和参数不一致或者 rescan 时遍历目录增量更新清单
+    std::map<std::string, listType> getImagesForClassification(
+            const std::filesystem::path &dataset,
+            const std::vector<std::string> &categories,
+            const std::filesystem::path &manifest,
+            bool rescan = false,
+            const std::pair<float, float> &ratios = {0.8, 0.1}
+    );
+
+    enum class AugmentOp {
+        HFlip, VFlip, Crop, Rotate
+    };
+
+    // 2x3 的仿射矩阵, 把原图中的坐标映射到输出图像中的坐标
+    struct Affine {
+        double m[6] = {1, 0, 0, 0, 1, 0};
+
+        // 先做当前的变换, 再做 next
+        Affine then(const Affine &next) const;
+    };
+
     class ImageAugmentor {
     private:
         //e 用来获得操作 l 用来打乱操作列表 c 用来裁剪需要的概率 r 用来得到旋转的概率
@@ -28,49 +51,151 @@ namespace cnn::pipeline {
         std::uniform_real_distribution<float> cropEngine_;
         std::uniform_real_distribution<float> rotateEngine_;
         std::uniform_int_distribution<int> minusEngine_;
-        std::vector<std::pair<std::string, int>> operations_; // 操作列表合集
+        std::vector<std::pair<AugmentOp, float>> operations_; // 操作列表合集, 构造时从名字解析一次
 
     public:
-        explicit ImageAugmentor(const std::vector<std::pair<std::string, int>> &operations = {{"hflip",  0.5},
-                                                                                              {"vflip",  0.5},
-                                                                                              {"crop",   0.7},
-                                                                                              {"rotate", 0.5}}) :
-                operations_(operations), e_(212), l_(826), c_(230), r_(520),
-                engine_(0.0, 1.0), cropEngine_(0.0, 0.25), rotateEngine_(15, 75), minusEngine_(1, 10) {
+        // 裁剪之后至少保留的边长比例
+        static constexpr float MIN_CROP_RATIO = 0.7f;
+
+        explicit ImageAugmentor(const std::vector<std::pair<std::string, float>> &operations = {{"hflip",  0.5},
+                                                                                                {"vflip",  0.5},
+                                                                                                {"crop",   0.7},
+                                                                                                {"rotate", 0.5}});
 
-        }
+        // 随机选择的操作和最后缩放到 target 合成一个仿射变换, 只用一次 warpAffine 写进 output
+        void augment(const cv::Mat &origin, cv::Size target, cv::Mat &output);
 
+        // 原地增强, 输出的大小是各个操作之后自然的大小
         void makeAugment(cv::Mat &origin, const bool show = false);
+
+        // 随机数由 seed 和 sequence 重新决定, 操作列表恢复到固定的次序. 同样的参数得到同样的增强
+        void reseed(uint32_t seed, uint64_t sequence);
+
+    private:
+        // 抽取这一次的随机操作, 合成从原图到增强结果的变换, size 返回增强结果的大小
+        Affine compose(cv::Size source, cv::Size &size);
     };
 
 
+    // 预取的统计信息, 训练线程等待的次数多说明解码跟不上计算, 需要更多的解码线程
+    struct PrefetchStats {
+        size_t batches = 0;        // 训练线程取走的 batch 数
+        size_t stalls = 0;         // 取 batch 时还没有解码好, 训练线程需要等待的次数
+        double stallSeconds = 0;   // 训练线程等待的总时间
+        size_t producerWaits = 0;  // 队列已满, 解码线程等待空位的次数
+    };
+
     class DataLoader {
-        using batchType = std::pair<std::vector<cnn::tensor>, std::vector<int>>;
+        using batchType = std::pair<const cnn::Tensor4D &, std::vector<int>>;
+
+        // 预取队列中的一个位置, 状态按 Free -> Filling -> Ready -> Lent -> Free 循环
+        struct Slot {
+            enum class State {
+                Free, Filling, Ready, Lent
+            };
+
+            Tensor4D images;
+            Tensor4D partial;         // 不满的 batch 时指向 images 的前几张
+            std::vector<int> labels;
+            State state = State::Free;
+
+            Slot(uint32_t batch, uint32_t channels, uint32_t height, uint32_t width) :
+                    images(batch, channels, height, width, "prefetch") {}
+        };
 
     private:
-        listType images_;           // 数据集列表
-        int imageNum_;                  // 这个子数据集一共有多少张图像和对应的标签
+        std::shared_ptr<const DatasetSource> source_; // 数据集
+        std::vector<size_t> order_; // 这一轮图像的读取顺序
+        int imageNum_;                  // 这一轮要读取多少张图像, 分片读取时只是数据集的一部分
         const uint32_t batchSize_;  // 每次打包几张图像
         const bool augment_;        // 是否要做图像增强
-        const bool shuffle_;        // 是否要打乱列表
-        const int seed_;            // 每次随机打乱列表的种子
-        int iterator_;              // 当前采集到了第 iterator 张图像
-        std::vector<tensor> buffer_;// batch 缓冲区，用来从图像生成 tensor 的
+        const Sampler sampler_;     // 决定每一轮的读取顺序
+        uint64_t epoch_ = 0;        // 当前是第几轮
+        int iterator_ = -1;         // 当前采集到了第 iterator 张图像
+        Tensor4D buffer_;           // batch 缓冲区，用来从图像生成 tensor 的
+        Tensor4D partial_;          // 不满的 batch 时指向 buffer_ 的前几张
+        bool partialLast_ = false;  // 每一轮的最后一个 batch 是否只包含这一轮剩下的图像
 
         const uint32_t channels_, width_, height_;
 
+        // 像素转换成 float 时的 x * scale + bias, 默认只除以 255, 设置归一化之后同时减均值除以标准差
+        dataType scale_[3] = {1.f / 255, 1.f / 255, 1.f / 255};
+        dataType bias_[3] = {0, 0, 0};
+
+        // 解码之后的图像缓存, 为空时每次都解码
+        std::shared_ptr<ImageCache> cache_;
+
+        // 预取, workers 为 0 时在训练线程上同步读取. 解码线程在第一次 generateBatch 时启动
+        const int workerCount_;
+        std::vector<std::unique_ptr<Slot>> ring_; // 环形队列, 第 k 个 batch 放在 k % size 的位置
+        std::vector<std::thread> workers_;
+        std::mutex mutex_;
+        std::condition_variable changed_;
+        size_t produced_ = 0;   // 下一个要解码的 batch 的序号
+        size_t consumed_ = 0;   // 下一个要取走的 batch 的序号
+        int lent_ = -1;         // 正在被训练线程使用的位置
+        bool stop_ = false;
+        PrefetchStats stats_;
+
     public:
+        // workers 个解码线程在后台读取, 最多提前准备好 queueDepth 个 batch
         DataLoader(listType images, const uint32_t batchSize, const bool augment, const bool shuffle,
                    std::tuple<uint32_t, uint32_t, uint32_t> imageSize = {224u, 224u, 3u},
-                   const int seed = 212);
+                   const int seed = 212, const int workers = 0, const int queueDepth = 2);
+
+        // 从任意的数据来源读取, 例如 mmap 的打包文件
+        DataLoader(std::shared_ptr<const DatasetSource> source, const uint32_t batchSize, const bool augment,
+                   const bool shuffle, std::tuple<uint32_t, uint32_t, uint32_t> imageSize = {224u, 224u, 3u},
+                   const int seed = 212, const int workers = 0, const int queueDepth = 2);
+
+        // 读取顺序由 sampler 决定, 例如块打乱或者多个读取者分片
+        DataLoader(std::shared_ptr<const DatasetSource> source, const uint32_t batchSize, const bool augment,
+                   const Sampler &sampler, std::tuple<uint32_t, uint32_t, uint32_t> imageSize = {224u, 224u, 3u},
+                   const int workers = 0, const int queueDepth = 2);
+
+        DataLoader(const DataLoader &) = delete;
+
+        DataLoader &operator=(const DataLoader &) = delete;
+
+        ~DataLoader();
 
         int length() const;
 
+        // 返回的图像引用在下一次调用 generateBatch 之前有效
         batchType generateBatch();
 
+        PrefetchStats stats();
+
+        // 读取图像时同时做归一化, 需要在第一次 generateBatch 之前设置
+        void setNormalization(const std::vector<dataType> &mean = {0.406, 0.456, 0.485},
+                              const std::vector<dataType> &standardDeviation = {0.225, 0.224, 0.229});
+
+        // 每一轮的最后一个 batch 不再用下一轮的图像补齐, 只包含剩下的图像, 验证时每张图像恰好计算一次.
+        // 需要在第一次 generateBatch 之前设置
+        void setPartialLastBatch(bool partial = true);
+
+        // 一轮有多少个 batch, 最后一个不满的 batch 是否计入和 setPartialLastBatch 一致
+        int batchesPerEpoch() const;
+
+        // 解码之后的图像放进 cache, 之后直接从内存读取, 数据增强仍然每次随机. 需要在第一次 generateBatch 之前设置
+        void setCache(std::shared_ptr<ImageCache> cache);
+
     private:
         std::pair<tensor, int> addToBuffer_(const int batchIndex);
 
+        // 按顺序取下一张图像, 一轮结束之后按下一轮的顺序重新排列, 调用者需要保证互斥
+        size_t nextSample_();
+
+        // 刚取出的是这一轮的最后一张图像, 并且 batch 要在这里截断
+        bool batchEnds_() const;
+
+        // 读取, 增强并缩放一张图像, 写进 target
+        void loadSample_(size_t index, ImageAugmentor &augmentor, dataType *target) const;
+
+        void prefetchLoop_();
+
+        void startWorkers_();
+
         ImageAugmentor imageAugmentor_;
     };
 
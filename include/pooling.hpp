@@ -0,0 +1,19 @@
+#pragma once
+
+#include<cstdint>
+#include<data_format.hpp>
+
+namespace cnn::kernels {
+    // 最大池化, 每次处理一个 height x width 的平面, 窗口大小 size x size, 步长 step, 不填充.
+    // mask 记录每个窗口中最大值在窗口内按行展开的下标 0..size*size-1, 有多个最大值时取第一个
+
+    // 池化之后的边长
+    int pooledLength(int length, int size, int step);
+
+    // mask 为空时只计算输出. 2x2 步长为 2 的池化走专门的实现
+    void maxPool(const dataType *input, int height, int width, int size, int step, dataType *output, uint8_t *mask);
+
+    // 把输出的梯度累加到 mask 记录的位置, 窗口有重叠时同一个位置可能收到多个梯度, inputDelta 的其他位置保持不变
+    void maxPoolBackward(const dataType *delta, const uint8_t *mask, int height, int width, int size, int step,
+                         dataType *inputDelta);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include<atomic>
+#include<condition_variable>
+#include<deque>
+#include<functional>
+#include<memory>
+#include<mutex>
+#include<thread>
+#include<vector>
+#include<data_format.hpp>
+
+namespace cnn::runtime {
+    // 任务窃取线程池. 每个工作线程有自己的任务队列, 自己从队尾取, 空闲时从别的队列队头偷.
+    // 调用 parallelFor 的线程也会参与执行, 所以嵌套调用不会死锁
+    class ThreadPool {
+    private:
+        using Task = std::function<void()>;
+
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues_; // 每个工作线程一个, 最后一个给外部调用的线程
+        std::vector<std::thread> workers_;
+
+        std::mutex sleepMutex_;
+        std::condition_variable wake_;
+        std::atomic<size_t> pending_{0}; // 还没有被取走的任务数
+        std::atomic<size_t> next_{0};    // 外部线程提交任务时轮流放进各个队列
+        bool stop_ = false;
+
+    public:
+        // threads 为参与计算的线程总数, 包括调用 parallelFor 的线程, 所以会额外创建 threads-1 个工作线程
+        explicit ThreadPool(int threads);
+
+        ThreadPool(const ThreadPool &) = delete;
+
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        ~ThreadPool();
+
+        int size() const;
+
+        // 把 [begin, end) 切成每块至少 grain 个的若干块并行执行 func(blockBegin, blockEnd), 全部完成后返回
+        void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)> &func);
+
+    private:
+        void workerLoop(int index);
+
+        void push(Task task);
+
+        bool tryRun(int index);
+    };
+
+    // 全局线程池, 第一次使用时按 CNN_NUM_THREADS 环境变量或者硬件线程数创建
+    ThreadPool &pool();
+
+    // 重新设置计算线程数, 0 表示使用全部硬件线程. OpenCV 内部的并行同时设为 opencvThreads,
+    // 默认 1 即串行, 图像的读取和增强由数据管道按图像并行, 两边的线程池不会同时占满 CPU
+    void setNumThreads(int threads, int opencvThreads = 1);
+
+    int getNumThreads();
+
+    // 全局线程池上的 parallelFor
+    void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)> &func);
+
+    // 对 [0, count) 的每个下标并行执行 func(i), 适合 (batch, outChannel, 行块) 展平之后的下标
+    void parallelFor(size_t count, const std::function<void(size_t)> &func);
+
+    // 把 work 份工作分给多少个分片, 不超过线程数
+    int shardCount(size_t work);
+
+    // 梯度分片. 按 batch 并行求梯度时每个分片只累加自己负责的图像, 最后按固定的二叉树顺序归约到第 0 个分片.
+    // 分片的个数和每个分片负责的范围只由线程数决定, 和任务实际被哪个线程执行无关, 所以线程数相同时结果逐位一致
+    class GradientShards {
+    private:
+        std::vector<std::vector<dataType>> shards_;
+        size_t length_ = 0;
+        int count_ = 0;
+
+    public:
+        // 准备 count 个长度为 length 的分片并清零
+        void reset(int count, size_t length);
+
+        int count() const;
+
+        dataType *shard(int index);
+
+        // 第 index 个分片负责的 [begin, end)
+        std::pair<size_t, size_t> range(size_t total, int index) const;
+
+        // 两两相加直到只剩第 0 个分片, 返回归约的结果
+        const dataType *reduce();
+
+        // 释放所有分片的内存
+        void release();
+    };
+}
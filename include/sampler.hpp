@@ -0,0 +1,42 @@
+#pragma once
+
+#include<cstdint>
+#include<random>
+#include<vector>
+
+namespace cnn::pipeline {
+    enum class SampleMode {
+        Sequential,   // 按数据集中的顺序
+        Shuffle,      // 整体打乱
+        BlockShuffle  // 先打乱连续的块的顺序, 再在窗口内打乱, 读取的位置保持局部性
+    };
+
+    // 决定每一轮读取图像的顺序. 每一轮的随机数由 seed 和轮数决定, 同样的参数得到同样的顺序.
+    // shards > 1 时把数据集分给多个读取者, 第 shard 个读取者只得到属于自己的部分, 块模式下按整块分配
+    class Sampler {
+    private:
+        SampleMode mode_;
+        uint32_t seed_;
+        size_t blockSize_;  // 块模式下每块连续的图像数目
+        size_t window_;     // 块模式下打乱的窗口大小
+        uint32_t shards_;
+        uint32_t shard_;
+
+    public:
+        explicit Sampler(SampleMode mode = SampleMode::Shuffle, uint32_t seed = 789, size_t blockSize = 64,
+                         size_t window = 512, uint32_t shards = 1, uint32_t shard = 0);
+
+        // 第 epoch 轮的随机数引擎
+        std::default_random_engine engine(uint64_t epoch) const;
+
+        // count 个块这一轮的读取顺序, 只包含属于自己的块. Sequential 时不打乱
+        std::vector<size_t> blocks(size_t count, std::default_random_engine &engine) const;
+
+        // size 张图像第 epoch 轮的读取顺序
+        std::vector<size_t> order(size_t size, uint64_t epoch) const;
+
+        SampleMode mode() const;
+
+        uint32_t seed() const;
+    };
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include<data_format.hpp>
+
+namespace cnn::kernels {
+    // Winograd F(tile x tile, 3x3) 卷积, tile 支持 2 和 4, 只适用于 stride = 1 的 3x3 卷积
+
+    // 变换之后的卷积核的大小 (tile+2)^2 * outChannels * inChannels
+    size_t winogradWeightsLength(int outChannels, int inChannels, int tile);
+
+    // 卷积核变换 U = G g G^T, weights 的排布为 outChannels x inChannels x 3 x 3
+    void winogradWeights(const dataType *weights, int outChannels, int inChannels, int tile, dataType *transformed);
+
+    // 对一张 CHW 图像做卷积, 四周补 padding 圈 0, 输出为 outChannels x (height+2p-2) x (width+2p-2)
+    void winogradConv(const dataType *image, int inChannels, int height, int width, int padding,
+                      const dataType *transformed, int outChannels, int tile,
+                      const dataType *bias, dataType *output);
+}
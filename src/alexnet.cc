@@ -42,44 +42,69 @@ cnn::architectures::AlexNet::AlexNet(const int numOfClasses, const bool batchNor
     //TODO 线性连接层
     // batchSize *128*6*6 ---> batchSize * numOfClasses
     this->layerSequence_.emplace_back(std::make_shared<LinearLayer>("linear_1", 128 * 6 * 6, numOfClasses));
+
+    // 有 BatchNorm2D 时卷积后面不是 ReLU, 要等冻结之后才能合并
+    fuseEpilogues();
+
+    // 剩下的 ReLU 前面一层的输出只给 ReLU 用, 直接在上面原地计算
+    for (auto layer = std::next(layerSequence_.begin()); layer != layerSequence_.end(); ++layer) {
+        if (const auto relu = std::dynamic_pointer_cast<ReLU>(*layer)) {
+            relu->setInPlace(true);
+        }
+    }
 }
 
-std::vector<cnn::tensor> cnn::architectures::AlexNet::forward(const std::vector<tensor> &input) {
-    assert(input.size());
+const cnn::Tensor4D &cnn::architectures::AlexNet::forward(const Tensor4D &input) {
+    assert(input.getBatch());
+    // 冻结之后的网络没有反向传播需要的参数和缓冲区
+    if (this->frozen_ && !noGrad) {
+        WithOutGrad guard;
+        return forward(input);
+    }
     if (this->printInfo) {
-        input.front()->printShape();
+        input.printShape();
     }
 
-    std::vector<tensor> output(input);
+    // batch 大小, 输入形状或者是否需要反向传播变了, 缓冲区的大小和生命周期都要重新规划
+    if (input.getBatch() != this->plannedBatch_ || input.sampleShape() != this->plannedShape_ ||
+        noGrad == this->plannedTraining_) {
+        planMemory(input.getBatch(), input.sampleShape());
+    }
+
+    // 每一层的输出都保存在层内, 这里只传递引用
+    const Tensor4D *output = &input;
     int i = 0;
     for (const auto &sequence: layerSequence_) {
 //        long long start = std::chrono::steady_clock::now().time_since_epoch().count();
-//        cnn::architectures::printTensor(output);
-        output = sequence->forward(output);
+//        cnn::architectures::printTensor(*output);
+        output = &sequence->forward(*output);
 //        long long end = std::chrono::steady_clock::now().time_since_epoch().count();
 
 //        std::cout << i++ << "  ---  " << end - start << std::endl;
         if (this->printInfo) {
-            output.front()->printShape();
+            output->printShape();
         }
     }
-    return output;
+    return *output;
 }
 
-void cnn::architectures::AlexNet::backward(std::vector<tensor> &delta) {
+void cnn::architectures::AlexNet::backward(Tensor4D &delta) {
+    assert(!this->frozen_);
     if (this->printInfo) {
-        delta.front()->printShape();
+        delta.printShape();
     }
 
+    Tensor4D *current = &delta;
     for (auto layer = layerSequence_.rbegin(); layer != layerSequence_.rend(); layer++) {
-        delta = layer.operator->()->operator->()->backward(delta);
+        current = &layer.operator->()->operator->()->backward(*current);
         if (this->printInfo) {
-            delta.front()->printShape();
+            current->printShape();
         }
     }
 }
 
 void cnn::architectures::AlexNet::updateGradients(const cnn::dataType learningRate) {
+    assert(!this->frozen_);
     for (const auto &layer: layerSequence_) {
         layer->updateGradients(learningRate);
     }
@@ -112,6 +137,127 @@ void cnn::architectures::AlexNet::loadWeights(const std::filesystem::path &path)
     reader.close();
 }
 
+/**
+ * @brief 冻结为推理模型. 推理时 BatchNorm2D 只是逐通道的仿射变换, 合并进前面 Conv2D 的权重和 bias 之后
+ * 每个卷积块少读写一遍特征图, 也不再需要归一化的中间结果. 之后释放各层只有反向传播才用到的缓冲区,
+ * 内存池也按推理重新规划
+ */
+void cnn::architectures::AlexNet::freeze() {
+    if (this->frozen_) {
+        return;
+    }
+
+    for (auto layer = layerSequence_.begin(); layer != layerSequence_.end();) {
+        const auto norm = std::dynamic_pointer_cast<BatchNorm2D>(*layer);
+        if (norm == nullptr || layer == layerSequence_.begin()) {
+            ++layer;
+            continue;
+        }
+        const auto conv = std::dynamic_pointer_cast<Conv2D>(*std::prev(layer));
+        if (conv == nullptr) {
+            ++layer;
+            continue;
+        }
+        const auto [scale, shift] = norm->inferenceAffine();
+        conv->fold(scale, shift);
+        layer = layerSequence_.erase(layer);
+    }
+
+    fuseEpilogues();
+
+    for (const auto &layer: layerSequence_) {
+        layer->releaseBackward();
+    }
+
+    // 训练时规划的内存池比推理大得多, 归还之后下一次 forward 重新规划
+    this->planner_.clear();
+    this->arena_.release();
+    this->plannedBatch_ = 0;
+    this->frozen_ = true;
+}
+
+/**
+ * @brief 卷积后面紧跟的 ReLU 和 MaxPool2D 合并进卷积的 epilogue, 在卷积结果还在缓存里的时候完成,
+ * 不再单独读写一遍完整的特征图. 训练时池化的 mask 由卷积层记录
+ */
+void cnn::architectures::AlexNet::fuseEpilogues() {
+    for (auto layer = layerSequence_.begin(); layer != layerSequence_.end(); ++layer) {
+        const auto conv = std::dynamic_pointer_cast<Conv2D>(*layer);
+        if (conv == nullptr) {
+            continue;
+        }
+        auto epilogue = conv->getEpilogue();
+        auto next = std::next(layer);
+        if (!epilogue.relu && epilogue.poolSize == 0 && next != layerSequence_.end() &&
+            std::dynamic_pointer_cast<ReLU>(*next) != nullptr) {
+            epilogue.relu = true;
+            next = layerSequence_.erase(next);
+        }
+        if (epilogue.poolSize == 0 && next != layerSequence_.end()) {
+            if (const auto pool = std::dynamic_pointer_cast<MaxPool2D>(*next)) {
+                epilogue.poolSize = pool->kernelSize();
+                epilogue.poolStep = pool->step();
+                layerSequence_.erase(next);
+            }
+        }
+        conv->setEpilogue(epilogue);
+    }
+}
+
 cv::Mat cnn::architectures::AlexNet::gradCam(const std::string &layerName) const {
     return cv::Mat();
-}
\ No newline at end of file
+}
+/**
+ * @brief 静态内存规划. 先按层的顺序推导每一层的形状, 根据执行顺序得到每个缓冲区的生命周期,
+ * 再把所有缓冲区放到同一个内存池中, 生命周期不重叠的缓冲区共用同一段内存.
+ * 训练时每一层的输出要保留到本层的 backward, 梯度在上一层 backward 之后就不再需要;
+ * 推理时每一层的输出在下一层 forward 之后就不再需要
+ * @param batchSize batch 大小
+ * @param inputShape 网络输入的形状
+ */
+void cnn::architectures::AlexNet::planMemory(const uint32_t batchSize,
+                                             const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape) {
+    const bool training = !noGrad;
+    const std::vector<std::shared_ptr<Layer>> sequence(layerSequence_.begin(), layerSequence_.end());
+    const int layers = static_cast<int>(sequence.size());
+    const auto backwardTime = [layers](const int i) {
+        return 2 * layers - 1 - i;
+    };
+
+    this->planner_.clear();
+    auto shape = inputShape;
+    for (int i = 0; i < layers; ++i) {
+        // 后面原地 forward 的层把输出原样传下去, 一直到真正读它的层用完为止
+        int reader = i + 1;
+        while (reader < layers && sequence[reader]->forwardInPlace()) {
+            ++reader;
+        }
+        LayerSchedule schedule{i, -1, reader, -1};
+        if (training) {
+            schedule.backward = backwardTime(i);
+            // 下一层的 backward 和本层的 backward 都可能用到本层的输出, 本层的更晚
+            schedule.outputEnd = backwardTime(i);
+            // 原地 backward 的层会把梯度原样传下去, 一直到真正产生新梯度的层用完为止
+            int consumer = i - 1;
+            while (consumer >= 0 && sequence[consumer]->backwardInPlace()) {
+                --consumer;
+            }
+            schedule.deltaEnd = consumer >= 0 ? backwardTime(consumer) : backwardTime(0);
+        }
+        shape = sequence[i]->planBuffers(this->planner_, batchSize, shape, schedule);
+    }
+
+    const size_t plannedBytes = this->planner_.plan();
+    this->planner_.bind(this->arena_.reserve(plannedBytes));
+
+    this->plannedBatch_ = batchSize;
+    this->plannedShape_ = inputShape;
+    this->plannedTraining_ = training;
+
+    if (this->printInfo) {
+        const double MB = 1024.0 * 1024.0;
+        printf("[memory plan] batch %u %s: %zu buffers, planned %.2f MB, naive %.2f MB\n", batchSize,
+               training ? "train" : "eval", this->planner_.requests().size(), plannedBytes / MB,
+               this->planner_.naiveBytes() / MB);
+    }
+}
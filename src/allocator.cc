@@ -0,0 +1,148 @@
+#include<allocator.hpp>
+#include<algorithm>
+#include<cassert>
+#include<new>
+
+#ifdef __linux__
+
+#include<sys/mman.h>
+
+#endif
+
+namespace {
+    // 不小于 8MB 的张量(例如整个 batch 的激活值和内存池)使用透明大页, 减少 TLB 缺失
+    constexpr size_t DEFAULT_HUGE_PAGE_THRESHOLD = 4 * cnn::memory::HUGE_PAGE;
+
+    // 故意不析构, 全局或静态的张量在程序退出时释放内存, 分配器必须还活着
+    cnn::memory::AlignedAllocator &builtinAllocator() {
+        static auto *allocator = new cnn::memory::AlignedAllocator(cnn::memory::CACHE_LINE,
+                                                                   DEFAULT_HUGE_PAGE_THRESHOLD);
+        return *allocator;
+    }
+
+    std::atomic<cnn::memory::Allocator *> currentAllocator{nullptr};
+}
+
+cnn::memory::AlignedAllocator::AlignedAllocator(const size_t alignment, const size_t hugePageThreshold) :
+        alignment_(std::max(alignment, alignof(std::max_align_t))), hugePageThreshold_(hugePageThreshold) {
+    // 对齐必须是 2 的幂
+    assert((alignment_ & (alignment_ - 1)) == 0);
+}
+
+bool cnn::memory::AlignedAllocator::useHugePage(const size_t bytes) const {
+    return this->hugePageThreshold_ != 0 && bytes >= this->hugePageThreshold_;
+}
+
+size_t cnn::memory::AlignedAllocator::blockSize(const size_t bytes) const {
+    const size_t alignment = useHugePage(bytes) ? HUGE_PAGE : this->alignment_;
+    return (std::max<size_t>(bytes, 1) + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * @brief 分配对齐的内存. 大块内存按 2MB 对齐并补齐到 2MB 的整数倍, 再用 madvise 建议内核使用透明大页,
+ * 在 /sys/kernel/mm/transparent_hugepage/enabled 为 madvise 或 always 时生效
+ * @param bytes 需要的字节数
+ */
+void *cnn::memory::AlignedAllocator::allocate(const size_t bytes) {
+    const bool huge = useHugePage(bytes);
+    const size_t size = blockSize(bytes);
+    void *ptr = ::operator new(size, std::align_val_t(huge ? HUGE_PAGE : this->alignment_));
+
+#ifdef __linux__
+    if (huge && ::madvise(ptr, size, MADV_HUGEPAGE) == 0) {
+        ++this->hugePageAllocations_;
+    }
+#endif
+
+    ++this->allocations_;
+    const size_t inUse = this->bytesInUse_ += size;
+    size_t peak = this->peakBytes_.load();
+    while (inUse > peak && !this->peakBytes_.compare_exchange_weak(peak, inUse)) {}
+
+    return ptr;
+}
+
+void cnn::memory::AlignedAllocator::deallocate(void *ptr, const size_t bytes) {
+    if (ptr == nullptr) {
+        return;
+    }
+    ::operator delete(ptr, std::align_val_t(useHugePage(bytes) ? HUGE_PAGE : this->alignment_));
+
+    ++this->deallocations_;
+    this->bytesInUse_ -= blockSize(bytes);
+}
+
+cnn::memory::AllocatorStats cnn::memory::AlignedAllocator::stats() const {
+    AllocatorStats stats;
+    stats.allocations = this->allocations_.load();
+    stats.deallocations = this->deallocations_.load();
+    stats.hugePageAllocations = this->hugePageAllocations_.load();
+    stats.bytesInUse = this->bytesInUse_.load();
+    stats.peakBytes = this->peakBytes_.load();
+    return stats;
+}
+
+cnn::memory::CachingAllocator::CachingAllocator(Allocator &upstream, const size_t maxCachedBytes) :
+        upstream_(upstream), maxCachedBytes_(maxCachedBytes) {}
+
+void *cnn::memory::CachingAllocator::allocate(const size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        const auto found = this->free_.find(bytes);
+        if (found != this->free_.end() && !found->second.empty()) {
+            void *ptr = found->second.back();
+            found->second.pop_back();
+            this->cachedBytes_ -= bytes;
+            ++this->hits_;
+            return ptr;
+        }
+    }
+    return this->upstream_.allocate(bytes);
+}
+
+void cnn::memory::CachingAllocator::deallocate(void *ptr, const size_t bytes) {
+    if (ptr == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        if (this->cachedBytes_ + bytes <= this->maxCachedBytes_) {
+            this->free_[bytes].push_back(ptr);
+            this->cachedBytes_ += bytes;
+            return;
+        }
+    }
+    this->upstream_.deallocate(ptr, bytes);
+}
+
+cnn::memory::AllocatorStats cnn::memory::CachingAllocator::stats() const {
+    AllocatorStats stats = this->upstream_.stats();
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    stats.cacheHits = this->hits_;
+    stats.cachedBytes = this->cachedBytes_;
+    return stats;
+}
+
+void cnn::memory::CachingAllocator::release() {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    for (auto &[bytes, blocks]: this->free_) {
+        for (void *ptr: blocks) {
+            this->upstream_.deallocate(ptr, bytes);
+        }
+    }
+    this->free_.clear();
+    this->cachedBytes_ = 0;
+}
+
+cnn::memory::CachingAllocator::~CachingAllocator() {
+    release();
+}
+
+cnn::memory::Allocator &cnn::memory::defaultAllocator() {
+    Allocator *allocator = currentAllocator.load(std::memory_order_acquire);
+    return allocator != nullptr ? *allocator : builtinAllocator();
+}
+
+void cnn::memory::setDefaultAllocator(Allocator *allocator) {
+    currentAllocator.store(allocator, std::memory_order_release);
+}
@@ -3,10 +3,10 @@
 cnn::dataType cnn::architectures::randomTimes = 10.f;
 bool cnn::architectures::noGrad = false;
 
-void cnn::architectures::printTensor(const std::vector<cnn::tensor> &input) {
+void cnn::architectures::printTensor(const Tensor4D &input) {
 
-    for (int i = 0; i < input.size(); ++i) {
-        auto cur = input.at(i);
+    for (int i = 0; i < input.getBatch(); ++i) {
+        const auto &cur = input.at(i);
         printf("input[%d] length==%d\n", i, cur->length());
         for (int j = 0; j < cur->length(); ++j) {
             printf("%lf ", cur->getData()[j]);
@@ -16,4 +16,19 @@ void cnn::architectures::printTensor(const std::vector<cnn::tensor> &input) {
 
     std::cout << std::endl;
 
-}
\ No newline at end of file
+}
+
+/**
+ * @brief 初始化层内的缓冲区, 已有缓冲区的 batch 大小和形状都一致时直接复用
+ * @param buffer 要初始化的缓冲区
+ * @param batchSize batch 大小
+ * @param shape 每个样本的形状
+ * @param name 缓冲区的名字
+ */
+void cnn::architectures::Layer::initBuffer(Tensor4D &buffer, const uint32_t batchSize,
+                                           const std::tuple<uint32_t, uint32_t, uint32_t> &shape,
+                                           const std::string &name) {
+    if (!buffer.matches(batchSize, shape)) {
+        buffer = Tensor4D(batchSize, shape, name);
+    }
+}
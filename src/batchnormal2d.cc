@@ -1,39 +1,41 @@
 #include<architectures.hpp>
+#include<runtime.hpp>
 
 inline cnn::dataType square(const cnn::dataType x) {
     return x * x;
 }
 
-std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::forward(const std::vector<tensor> &input) {
-    const int batchSize = input.size();
-    const int height = input.front()->getHeight();
-    const int width = input.front()->getWidth();
+const cnn::Tensor4D &cnn::architectures::BatchNorm2D::forward(const Tensor4D &input) {
+    const int batchSize = input.getBatch();
+    const int height = input.getHeight();
+    const int width = input.getWidth();
 
     init({batchSize, height, width});
 
     // 如果需要进行反向传播
     if (!noGrad) {
-        this->_input_ = input;
+        this->_input_ = &input;
     }
 
     const int featureMapLength = height * width;
     const int outputLength = batchSize * featureMapLength;
 
-    for (int oc = 0; oc < outChannels_; ++oc) {
+    // 每个通道的统计量和归一化互不影响, 按通道并行
+    runtime::parallelFor(outChannels_, [&](const size_t oc) {
         if (!noGrad) {
             // TODO 计算均值
             dataType u = 0;
             for (int b = 0; b < batchSize; ++b) {
-                dataType *src = input.at(b)->getData() + oc * featureMapLength;
+                dataType *src = input.data(b) + oc * featureMapLength;
                 u += std::accumulate(src, src + featureMapLength, 0.f);
             }
             u /= outputLength * 1.0;
-            // TODO 计算方差
+            // TODO 计算方差, 先减去均值再平方, 得到 E[(x-u)^2]
             dataType var = 0;
             for (int b = 0; b < batchSize; ++b) {
-                dataType *src = input.at(b)->getData() + oc * featureMapLength;
-                var += std::accumulate(src, src + featureMapLength, 0.f, [](dataType sum, dataType cur) {
-                    return sum + square(cur);
+                dataType *src = input.data(b) + oc * featureMapLength;
+                var += std::accumulate(src, src + featureMapLength, 0.f, [u](dataType sum, dataType cur) {
+                    return sum + square(cur - u);
                 });
             }
             var /= outputLength * 1.0;
@@ -45,13 +47,13 @@ std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::forward(const std::vec
             // +eps 的目的是防止方差为 0 导致出现除以 0 的结果
             const dataType varInvert = 1.0 / ::sqrt(var + eps_);
             for (int b = 0; b < batchSize; ++b) {
-                dataType *srcPtr = input.at(b)->getData() + oc * featureMapLength;
-                dataType *normPtr = normedInput_.at(b)->getData() + oc * featureMapLength;
-                dataType *dst = output_.at(b)->getData() + oc * featureMapLength;
+                dataType *srcPtr = input.data(b) + oc * featureMapLength;
+                dataType *normPtr = normedInput_.data(b) + oc * featureMapLength;
+                dataType *dst = output_.data(b) + oc * featureMapLength;
 
                 for (int i = 0; i < featureMapLength; ++i) {
                     normPtr[i] = (srcPtr[i] - u) * varInvert; // 减去平均数/方差
-                    dst[i] = gamma_[oc] * normPtr[oc] + beta_[oc]; //归一化结果*变换+偏移
+                    dst[i] = gamma_[oc] * normPtr[i] + beta_[oc]; //归一化结果*变换+偏移
                 }
 
             }
@@ -63,29 +65,28 @@ std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::forward(const std::vec
             const dataType varInvert = 1.0 / ::sqrt(movingVar_[oc] + eps_);
 
             for (int b = 0; b < batchSize; ++b) {
-                dataType *src = input.at(b)->getData() + oc + featureMapLength;
-                dataType *normPtr = normedInput_.at(b)->getData() + oc * featureMapLength;
-                dataType *dst = output_.at(b)->getData() + oc * featureMapLength;
+                dataType *src = input.data(b) + oc * featureMapLength;
+                dataType *normPtr = normedInput_.data(b) + oc * featureMapLength;
+                dataType *dst = output_.data(b) + oc * featureMapLength;
                 for (int i = 0; i < featureMapLength; ++i) {
                     normPtr[i] = (src[i] - u) * varInvert;
                     dst[i] = gamma_[oc] * normPtr[i] + beta_[oc];
                 }
             }
         }
-    }
+    });
     return this->output_;
 }
 
-std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::backward(std::vector<tensor> &delta) {
-    const int batchSize = delta.size();
-    auto t = delta.front();
+cnn::Tensor4D &cnn::architectures::BatchNorm2D::backward(Tensor4D &delta) {
+    const int batchSize = delta.getBatch();
+    const auto &t = delta.at(0);
     const int featureMapLength = t->getWidth() * t->getHeight();
     const int outputLength = batchSize * featureMapLength;
 
     if (gammaGradients_.empty()) {
         gammaGradients_.assign(outChannels_, 0);
         betaGradients_.assign(outChannels_, 0);
-        normGradients_ = std::make_shared<Tensor3D>(batchSize, t->getHeight(), t->getWidth());
     }
 
     //  每次都先清空，不考虑历史梯度信息
@@ -93,14 +94,15 @@ std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::backward(std::vector<t
         gammaGradients_[oc] = betaGradients_[oc] = 0;
     }
 
-    // 从后往前推
-    for (int oc = 0; oc < outChannels_; ++oc) {
-        normGradients_->setZero();
+    // 从后往前推, 按通道并行, 每个线程用自己的临时缓冲区保存归一化结果的梯度
+    runtime::parallelFor(outChannels_, [&](const size_t oc) {
+        thread_local std::vector<dataType> normGradients;
+        normGradients.assign(outputLength, 0);
         //TODO beta 和 gamma 以及 norm 的梯度
         for (int b = 0; b < batchSize; ++b) {
-            dataType *deltaPtr = delta[b]->getData() + oc * featureMapLength;
-            dataType *normPtr = normedInput_.at(b)->getData() + oc * featureMapLength;
-            dataType *normGradPtr = normGradients_->getData() + b * featureMapLength;
+            dataType *deltaPtr = delta.data(b) + oc * featureMapLength;
+            dataType *normPtr = normedInput_.data(b) + oc * featureMapLength;
+            dataType *normGradPtr = normGradients.data() + b * featureMapLength;
 
             for (int i = 0; i < featureMapLength; ++i) {
                 gammaGradients_[oc] += deltaPtr[i] * normPtr[i];
@@ -116,8 +118,8 @@ std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::backward(std::vector<t
         const dataType varInvertCube = varInvert * varGradient * varInvert;
 
         for (int i = 0; i < batchSize; ++i) {
-            dataType *src = this->_input_[i]->getData() + oc * featureMapLength;
-            dataType *normGradPtr = normGradients_->getData() + i * featureMapLength;
+            dataType *src = this->_input_->data(i) + oc * featureMapLength;
+            dataType *normGradPtr = normGradients.data() + i * featureMapLength;
             for (int j = 0; j < featureMapLength; ++j) {
                 varGradient += normGradPtr[j] * (src[j] - u) * 0.5 * varInvertCube;
             }
@@ -127,8 +129,8 @@ std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::backward(std::vector<t
         dataType uGradient = 0;
         const dataType inv = varGradient / outputLength;
         for (int b = 0; b < batchSize; ++b) {
-            dataType *src = this->_input_[b]->getData() + oc * featureMapLength;
-            dataType *normGradPtr = normGradients_->getData() + b * featureMapLength;
+            dataType *src = this->_input_->data(b) + oc * featureMapLength;
+            dataType *normGradPtr = normGradients.data() + b * featureMapLength;
             for (int i = 0; i < featureMapLength; ++i) {
                 uGradient += normGradPtr[i] * (-varInvert) + inv * (-2) * (src[i] - u);
             }
@@ -136,14 +138,14 @@ std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::backward(std::vector<t
 
         //TODO 求最后的输入的梯度
         for (int b = 0; b < batchSize; ++b) {
-            dataType *src = this->_input_[b]->getData() + oc * featureMapLength;
-            dataType *normGradPtr = normGradients_->getData() + b * featureMapLength;
-            dataType *backPtr = delta.at(b)->getData() + oc * featureMapLength;
+            dataType *src = this->_input_->data(b) + oc * featureMapLength;
+            dataType *normGradPtr = normGradients.data() + b * featureMapLength;
+            dataType *backPtr = delta.data(b) + oc * featureMapLength;
             for (int i = 0; i < featureMapLength; ++i) {
                 uGradient += normGradPtr[i] * (-varInvert) + inv * 2 * (src[i] - u) + uGradient / outputLength;
             }
         }
-    }
+    });
 
     return delta;
 }
@@ -171,7 +173,37 @@ void cnn::architectures::BatchNorm2D::loadWeights(std::ifstream &reader) {
     reader.read((char *) (&movingVar_[0]), static_cast<std::streamsize>(size));
 }
 
-std::vector<cnn::tensor> cnn::architectures::BatchNorm2D::getOutput() {
+/**
+ * @brief 训练时归一化之后的结果要保留到 backward, 推理时只在 forward 内部使用
+ */
+std::tuple<uint32_t, uint32_t, uint32_t>
+cnn::architectures::BatchNorm2D::planBuffers(memory::Planner &planner, const uint32_t batchSize,
+                                             const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                                             const LayerSchedule &schedule) {
+    assert(std::get<0>(inputShape) == static_cast<uint32_t>(outChannels_));
+    planner.addTensor(this->output_, batchSize, inputShape, this->name_ + "_output", schedule.forward,
+                      schedule.outputEnd);
+    planner.addTensor(this->normedInput_, batchSize, inputShape, this->name_ + "_normed", schedule.forward,
+                      schedule.training() ? schedule.backward : schedule.forward);
+    return inputShape;
+}
+
+/**
+ * @brief 推理时 y = gamma * (x - mean) / sqrt(var + eps) + beta, 其中 mean 和 var 是滑动平均的统计量,
+ * 整理成 y = scale * x + shift
+ */
+std::pair<std::vector<cnn::dataType>, std::vector<cnn::dataType>>
+cnn::architectures::BatchNorm2D::inferenceAffine() const {
+    std::vector<dataType> scale(outChannels_);
+    std::vector<dataType> shift(outChannels_);
+    for (int oc = 0; oc < outChannels_; ++oc) {
+        scale[oc] = gamma_[oc] / ::sqrt(movingVar_[oc] + eps_);
+        shift[oc] = beta_[oc] - movingMean_[oc] * scale[oc];
+    }
+    return {scale, shift};
+}
+
+const cnn::Tensor4D &cnn::architectures::BatchNorm2D::getOutput() {
     return Layer::getOutput();
 }
 
@@ -180,18 +212,8 @@ void cnn::architectures::BatchNorm2D::init(std::tuple<uint32_t, uint32_t, uint32
     uint32_t height = std::get<1>(shape);
     uint32_t width = std::get<2>(shape);
 
-    if (this->output_.empty()) {
-        this->output_.reserve(batchSize);
-        this->normedInput_.reserve(batchSize);
-
-        for (int i = 0; i < batchSize; ++i) {
-            this->output_.emplace_back(std::make_shared<Tensor3D>(outChannels_, height, width,
-                                                                  this->name_ + "_output_" + std::to_string(i)));
-
-            this->output_.emplace_back(std::make_shared<Tensor3D>(outChannels_, height, width,
-                                                                  this->name_ + "_normed_" + std::to_string(i)));
-        }
-    }
+    initBuffer(this->output_, batchSize, {outChannels_, height, width}, this->name_ + "_output");
+    initBuffer(this->normedInput_, batchSize, {outChannels_, height, width}, this->name_ + "_normed");
 }
 
 
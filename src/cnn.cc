@@ -11,26 +11,47 @@ int main(int argc, char **argv) {
 
     setbuf(stdout, 0);
 
+    // 训练和验证的 batch 大小不同, 来回切换时各种形状的缓冲区从缓存中复用. 和内置的分配器一样不析构
+    cnn::memory::setDefaultAllocator(new cnn::memory::CachingAllocator(cnn::memory::defaultAllocator()));
+
     std::cout << "OpenCV " << CV_VERSION << std::endl;
     std::cout << "Clang " << __VERSION__ << std::endl;
 
     const int trainBatchSize = 4;
-    const int validBatchSize = 1;
-    const int testBatchSize = 1;
-
-    assert(trainBatchSize >= validBatchSize && validBatchSize >= testBatchSize);
-    assert(validBatchSize == 1 && testBatchSize == 1);
+    // 验证时不需要保存反向传播的中间结果, batch 可以比训练时大
+    const int validBatchSize = 16;
 
     const std::tuple<uint32_t, uint32_t, uint32_t> imageSize{224, 224, 3};
 
     const std::filesystem::path datasetPath{"../datasets/animals"};
     const std::vector<std::string> categories{"dog", "panda", "bird"};
 
-    auto dataset = cnn::pipeline::getImagesForClassification(datasetPath, categories);
+    // 启动时只读清单, 加上 --rescan 参数时遍历目录, 只索引新增或者变化的图像
+    const std::filesystem::path cacheDir{"./dataset_cache"};
+    const std::filesystem::path manifest = cacheDir / "manifest.tsv";
+    const bool rescan = argc > 1 && std::string(argv[1]) == "--rescan";
+    auto dataset = cnn::pipeline::getImagesForClassification(datasetPath, categories, manifest, rescan);
+
+    // 第一次运行时把解码并缩放好的图像打包, 之后只需要 mmap 打包文件. 清单更新过时重新打包
+    auto packed = [&](const std::string &split) {
+        const auto file = cacheDir / (split + "_" + std::to_string(std::get<0>(imageSize)) + ".pack");
+        if (!std::filesystem::exists(file) ||
+            std::filesystem::last_write_time(file) < std::filesystem::last_write_time(manifest)) {
+            cnn::pipeline::packDataset(dataset[split], file, imageSize);
+        }
+        auto source = std::make_shared<cnn::pipeline::PackedSource>(file);
+        if (source->size() != dataset[split].size()) {
+            source.reset();
+            cnn::pipeline::packDataset(dataset[split], file, imageSize);
+            source = std::make_shared<cnn::pipeline::PackedSource>(file);
+        }
+        return source;
+    };
 
-    // 构造数据流
-    cnn::pipeline::DataLoader trainLoader(dataset["train"], trainBatchSize, false, true, imageSize);
-    cnn::pipeline::DataLoader validLoader(dataset["valid"], validBatchSize, false, false, imageSize);
+    // 构造数据流, 训练集由 4 个后台线程读取, 提前准备 3 个 batch
+    cnn::pipeline::DataLoader trainLoader(packed("train"), trainBatchSize, false, true, imageSize, 212, 4, 3);
+    cnn::pipeline::DataLoader validLoader(packed("valid"), validBatchSize, false, false, imageSize);
+    validLoader.setPartialLastBatch();
 
     // 定义网络结构
     const int numOfClasses = categories.size();
@@ -53,28 +74,22 @@ int main(int argc, char **argv) {
 
     ClassificationEvaluator trainEvaluator; //计算累积的准确率
     std::vector<int> predict(trainBatchSize, -1);//  存储每个 batch 的预测结果 计算准确率使用
+    cnn::Tensor4D lossDelta; // 损失对网络输出的梯度, 每一步复用
 
 
     for (int i = startIters; i < totalIters; ++i) {
 
         const auto sample = trainLoader.generateBatch();
 
-        const auto out = alexNet.forward(sample.first);
-
-        const auto probs = softMax(out);
+        const auto &out = alexNet.forward(sample.first);
 
-        auto lossDelta = crossEntropyBackward(probs, oneHot(sample.second, numOfClasses));
+        // 同时得到损失, 梯度和预测结果
+        meanLoss += softmaxCrossEntropy(out, sample.second, predict, &lossDelta);
 
-        meanLoss += lossDelta.first;
-
-        alexNet.backward(lossDelta.second);
+        alexNet.backward(lossDelta);
 
         alexNet.updateGradients(learningRate);
 
-        for (int b = 0; b < trainBatchSize; ++b) {
-            predict[b] = probs[b]->argmax();
-        }
-
         trainEvaluator.compute(predict, sample.second);
         ++curIter;
 
@@ -84,29 +99,31 @@ int main(int argc, char **argv) {
 
         // 开始验证
         if (i % validInters == 0) {
+            const auto prefetch = trainLoader.stats();
+            printf("\n[数据预取] batches %zu, stalls %zu (%.2f s), producer waits %zu\n", prefetch.batches,
+                   prefetch.stalls, prefetch.stallSeconds, prefetch.producerWaits);
             printf("\n[开始验证]\n\n");
             cnn::architectures::WithOutGrad guard;
-            float meanValidLoss = 0.f;
+            float validLossSum = 0.f;
+            int validSamples = 0;
             ClassificationEvaluator validEvaluator;
+            std::vector<int> validPredict;
 
-            const int samplesNum = validLoader.length();
+            // 每张图像恰好计算一次, 最后一个 batch 可能不满
+            const int batchesNum = validLoader.batchesPerEpoch();
 
-            for (int s = 0; s < samplesNum; ++s) {
+            for (int s = 0; s < batchesNum; ++s) {
                 const auto validSample = validLoader.generateBatch();
-                const auto validOut = alexNet.forward(sample.first);
-                const auto _probs = softMax(validOut);
+                const auto &validOut = alexNet.forward(validSample.first);
 
-                const auto validLossDelta = crossEntropyBackward(_probs, oneHot(sample.second, numOfClasses));
-
-                meanValidLoss += validLossDelta.first;
-                for (int j = 0; j < trainBatchSize; ++j) {
-                    predict[j] = _probs[j]->argmax();
-                }
+                const int count = validSample.second.size();
+                validLossSum += softmaxCrossEntropy(validOut, validSample.second, validPredict) * count;
+                validSamples += count;
 
-                validEvaluator.compute(predict, sample.second);
+                validEvaluator.compute(validPredict, validSample.second);
 
-                printf("\rValid===> [batch %d/%d] [loss %.3f] [Accuracy %4.3f]", s, samplesNum, meanValidLoss / s,
-                       validEvaluator.get());
+                printf("\rValid===> [batch %d/%d] [loss %.3f] [Accuracy %4.3f]", s + 1, batchesNum,
+                       validLossSum / validSamples, validEvaluator.get());
             }
 
             printf("\n\n");
@@ -1,82 +1,303 @@
 #include<architectures.hpp>
+#include<gemm.hpp>
+#include<pooling.hpp>
+#include<runtime.hpp>
+#include<winograd.hpp>
 
-std::vector<cnn::tensor> cnn::architectures::Conv2D::forward(const std::vector<tensor> &input) {
-    const int batchSize = input.size();
-    const int previousWidth = input.front()->getWidth();
-    const int previousHeight = input.front()->getHeight();
-    const int length = previousWidth * previousHeight;
+const cnn::Tensor4D &cnn::architectures::Conv2D::forward(const Tensor4D &input) {
+    const int batchSize = input.getBatch();
+    const int previousWidth = input.getWidth();
+    const int previousHeight = input.getHeight();
 
-    const int curWidth = (previousWidth - kernelSize_ - 2 * padding_) / stride_ + 1;
-    const int curHeight = (previousHeight - kernelSize_ - 2 * padding_) / stride_ + 1;
+    const int curWidth = outputSize(previousWidth);
+    const int curHeight = outputSize(previousHeight);
 
-    const int radius = kernelSize_ / 2;// 自动向下取整
+    // 池化之后的大小才是输出的大小
+    const auto [outHeight, outWidth] = pooledSize(curHeight, curWidth);
+    std::tuple<uint32_t, uint32_t, uint32_t> shape = std::make_tuple(outChannels_, outHeight, outWidth);
 
-
-    std::tuple<uint32_t, uint32_t, uint32_t> shape = std::make_tuple(outChannels_, curHeight, curWidth);
-
-    initForward(batchSize, shape, previousWidth);// 初始化相关
+    initForward(batchSize, shape);// 初始化相关
 
     //cnn::architectures::printTensor(this->weights_);
     // 如果要backward 则需要记录当前的输入
     if (!noGrad) {
-        this->_input_ = input;
+        this->_input_ = &input;
+    }
+
+    this->columnsReady_ = false;
+    switch (this->algorithm_) {
+        case ConvAlgorithm::Direct:
+            forwardDirect(input, curHeight, curWidth);
+            break;
+        case ConvAlgorithm::Im2col:
+            forwardIm2col(input, curHeight, curWidth);
+            break;
+        case ConvAlgorithm::Winograd2x2:
+        case ConvAlgorithm::Winograd4x4:
+            if (winogradApplicable()) {
+                forwardWinograd(input, this->algorithm_ == ConvAlgorithm::Winograd2x2 ? 2 : 4);
+            } else {
+                forwardIm2col(input, curHeight, curWidth);
+            }
+            break;
     }
 
-    const int convBoundaryOfWeight = previousWidth - radius;
-    const int convBoundaryOfHeight = previousHeight - radius;
+    return this->output_;
+}
 
+/**
+ * @brief 按照卷积的定义直接计算, 每个输出像素都遍历一遍卷积核, 填充部分通过视图读出 0, 不复制输入.
+ * 每个 (图像, 卷积核) 的输出平面互不重叠, 展平之后并行
+ */
+void cnn::architectures::Conv2D::forwardDirect(const Tensor4D &input, const int outHeight, const int outWidth) {
+    const int batchSize = input.getBatch();
+    const int height = input.getHeight();
+    const int width = input.getWidth();
+    const int length = height * width;
     const int windowsLength = kernelSize_ * kernelSize_;
-    const int outLength = curWidth * curHeight;
-    const int *offset = this->offset_.data();
+    const int outLength = outWidth * outHeight;
+    const bool pooling = this->epilogue_.poolSize > 0;
+
+    runtime::parallelFor(batchSize * outChannels_, [&](const size_t index) {
+        const int b = index / outChannels_;
+        const int oc = index % outChannels_;
+        const dataType *image = input.data(b);
+        const TensorView src = input.view(b).padded(padding_);
+        // 输出位置指针, 要池化时先算到线程自己的一个平面里
+        thread_local std::vector<dataType> plane;
+        if (pooling) {
+            plane.resize(outLength);
+        }
+        dataType *outPtr = pooling ? plane.data() : this->output_.data(b) + oc * outLength;
+        // 卷积核权重指针
+        dataType *weightPtr = weights_.at(oc)->getData();
+
+        int cnt = 0;
+        for (int x = 0; x < outHeight; ++x) {
+            for (int y = 0; y < outWidth; ++y) {
+                dataType sumValue = 0.f;
+                const int iy = x * stride_ - padding_;
+                const int ix = y * stride_ - padding_;
+                // 窗口完全落在图像内部时直接读原始数据, 只有边界上才经过视图判断是否在填充里
+                const bool inside = iy >= 0 && ix >= 0 &&
+                                    iy + kernelSize_ <= height && ix + kernelSize_ <= width;
+                for (int ic = 0; ic < inChannels_; ++ic) {
+                    const dataType *kernel = weightPtr + ic * windowsLength;
+                    if (inside) {
+                        const dataType *window = image + ic * length + iy * width + ix;
+                        for (int kx = 0; kx < kernelSize_; ++kx) {
+                            for (int ky = 0; ky < kernelSize_; ++ky) {
+                                sumValue += window[kx * width + ky] * kernel[kx * kernelSize_ + ky];
+                            }
+                        }
+                        continue;
+                    }
+                    for (int kx = 0; kx < kernelSize_; ++kx) {
+                        for (int ky = 0; ky < kernelSize_; ++ky) {
+                            sumValue += src.at(ic, x * stride_ + kx, y * stride_ + ky) *
+                                        kernel[kx * kernelSize_ + ky];
+                        }
+                    }
+                }
+
+                sumValue += this->bias_.at(oc);
+                outPtr[cnt] = sumValue;
+                ++cnt;
+            }
+        }
+        epiloguePlane(b, oc, outPtr, outHeight, outWidth);
+    });
+}
+
+/**
+ * @brief 先把每张输入 im2col 展开, 再和所有卷积核组成的权重矩阵做一次 GEMM
+ * output[outChannels x outLength] = weights[outChannels x K] * columns[K x outLength] + bias.
+ * 要池化时 GEMM 的结果只是一张图像的临时缓冲区, 还在缓存里就做完 ReLU 和池化.
+ * 按通道分块做 GEMM 可以让临时缓冲区更小, 但是块的行数凑不满微内核, 反而更慢
+ */
+void cnn::architectures::Conv2D::forwardIm2col(const Tensor4D &input, const int outHeight, const int outWidth) {
+    const int batchSize = input.getBatch();
+    const int width = input.getWidth();
+    const int height = input.getHeight();
+    const int outLength = outHeight * outWidth;
+
+    packWeightMatrix();
+
+    // 不需要反向传播时所有图像共用一块展开的缓冲区
+    initBuffer(this->columns_, noGrad ? 1 : batchSize, columnsShape(outLength), this->name_ + "_columns");
+
+    const bool pooling = this->epilogue_.poolSize > 0;
+    thread_local std::vector<dataType> imageOutput;
+    if (pooling) {
+        imageOutput.resize(static_cast<size_t>(outChannels_) * outLength);
+    }
 
-    // 首先每一张图像分开卷积
     for (int b = 0; b < batchSize; ++b) {
-        dataType *src = input.at(b)->getData();
+        dataType *columns = this->columns_.data(noGrad ? 0 : b);
+        kernels::im2col(input.data(b), inChannels_, height, width, kernelSize_, stride_, padding_, columns);
 
-        // 每一个卷积核
+        // 先用 bias 填充输出, 再把 GEMM 的结果累加上去
+        dataType *outPtr = pooling ? imageOutput.data() : this->output_.data(b);
         for (int oc = 0; oc < outChannels_; ++oc) {
-            // 输出位置指针
-            dataType *outPtr = this->output_.at(b)->getData() + oc * outLength;
-            // 卷积核权重指针
-            dataType *weightPtr = weights_.at(oc)->getData();
+            std::fill(outPtr + oc * outLength, outPtr + (oc + 1) * outLength, this->bias_.at(oc));
+        }
 
-            int cnt = 0;
-            for (int x = radius; x < convBoundaryOfHeight; x += stride_) {
-                for (int y = radius; y < convBoundaryOfWeight; y += stride_) {
-                    dataType sumValue = 0.f;
-                    const int coord = x * previousWidth + y;
-                    for (int ic = 0; ic < inChannels_; ++ic) {
+        kernels::sgemm(false, false, outChannels_, outLength, paramsForAKernel_, 1.f,
+                       this->weightMatrix_.data(), paramsForAKernel_, columns, outLength, 1.f, outPtr, outLength);
 
-                        const int start = ic * length + coord; // 当前像素点相对于本张图像的偏移
-                        const int startOfWeight = ic * windowsLength;
+        epilogueImage(b, 0, outChannels_, outPtr, outHeight, outWidth);
+    }
 
-                        for (int k = 0; k < windowsLength; ++k) {
-                            sumValue += src[start + offset[k]] * weightPtr[startOfWeight + k];
-                        }
-                    }
+    this->columnsReady_ = !noGrad;
+}
 
-                    sumValue += this->bias_.at(oc);
-                    outPtr[cnt] = sumValue;
-                    ++cnt;
-                }
-            }
+/**
+ * @brief Winograd F(tile x tile, 3x3) 前向传播, 变换之后的卷积核会缓存下来, 只有权重改变之后才重新计算
+ * @param tile 每次计算的输出块大小, 2 或 4
+ */
+void cnn::architectures::Conv2D::forwardWinograd(const Tensor4D &input, const int tile) {
+    const int batchSize = input.getBatch();
+    const int width = input.getWidth();
+    const int height = input.getHeight();
+
+    const size_t transformedLength = kernels::winogradWeightsLength(outChannels_, inChannels_, tile);
+    if (this->winogradStale_ || this->winogradWeights_.size() != transformedLength) {
+        packWeightMatrix();
+        this->winogradWeights_.resize(transformedLength);
+        kernels::winogradWeights(this->weightMatrix_.data(), outChannels_, inChannels_, tile,
+                                 this->winogradWeights_.data());
+        this->winogradStale_ = false;
+    }
+
+    // 要池化时一次只保留一张图像池化之前的结果
+    const int outHeight = outputSize(height);
+    const int outWidth = outputSize(width);
+    const bool pooling = this->epilogue_.poolSize > 0;
+    thread_local std::vector<dataType> imageOutput;
+    if (pooling) {
+        imageOutput.resize(static_cast<size_t>(outChannels_) * outHeight * outWidth);
+    }
+
+    for (int b = 0; b < batchSize; ++b) {
+        dataType *outPtr = pooling ? imageOutput.data() : this->output_.data(b);
+        kernels::winogradConv(input.data(b), inChannels_, height, width, padding_, this->winogradWeights_.data(),
+                              outChannels_, tile, this->bias_.data(), outPtr);
+        epilogueImage(b, 0, outChannels_, outPtr, outHeight, outWidth);
+    }
+}
+
+/**
+ * @brief 第 b 张图像第 oc 个通道的卷积结果 (已经加上 bias) 做 ReLU 和池化. 不池化时 conv 就是 output_ 中的位置,
+ * 原地做 ReLU; 池化时先池化写进 output_, 需要反向传播时记录最大值在窗口内的下标, 再对池化的结果做 ReLU
+ * @param conv outHeight x outWidth 的卷积结果
+ */
+void cnn::architectures::Conv2D::epiloguePlane(const int b, const int oc, dataType *conv, const int outHeight,
+                                               const int outWidth) {
+    int length = outHeight * outWidth;
+    dataType *dst = conv;
+    if (this->epilogue_.poolSize > 0) {
+        const auto [pooledHeight, pooledWidth] = pooledSize(outHeight, outWidth);
+        length = pooledHeight * pooledWidth;
+        dst = this->output_.data(b) + oc * length;
+        uint8_t *maskPtr = noGrad ? nullptr : this->mask_ + b * this->maskLength_ + oc * length;
+        kernels::maxPool(conv, outHeight, outWidth, this->epilogue_.poolSize, this->epilogue_.poolStep, dst, maskPtr);
+    }
+
+    if (this->epilogue_.relu) {
+        for (int i = 0; i < length; ++i) {
+            dst[i] = (dst[i] >= 0) ? dst[i] : 0;
         }
     }
+}
 
-    return this->output_;
+/**
+ * @brief 一张图像第 [ocBegin, ocEnd) 个通道的卷积结果做 epilogue, 按通道并行
+ * @param conv 这些通道连续排布的卷积结果
+ */
+void cnn::architectures::Conv2D::epilogueImage(const int b, const int ocBegin, const int ocEnd, dataType *conv,
+                                               const int outHeight, const int outWidth) {
+    if (!this->epilogue_.relu && this->epilogue_.poolSize == 0) {
+        return;
+    }
+    const int length = outHeight * outWidth;
+    runtime::parallelFor(ocEnd - ocBegin, [&](const size_t i) {
+        epiloguePlane(b, ocBegin + static_cast<int>(i), conv + i * length, outHeight, outWidth);
+    });
 }
 
-std::vector<cnn::tensor> cnn::architectures::Conv2D::backward(std::vector<tensor> &delta) {
+/**
+ * @brief 把输出的梯度传回卷积的输出. 先原地把输出不大于 0 的位置的梯度清零 (ReLU),
+ * 池化时再把梯度放回 mask 记录的位置
+ * @param delta 输出的梯度
+ * @return 卷积输出的梯度
+ */
+cnn::Tensor4D &cnn::architectures::Conv2D::backwardEpilogue(Tensor4D &delta) {
+    const int batchSize = delta.getBatch();
+    const int length = delta.sampleLength();
+
+    if (this->epilogue_.relu) {
+        runtime::parallelFor(batchSize, [&](const size_t b) {
+            dataType *src = delta.data(b);
+            const dataType *out = this->output_.data(b);
+            for (int i = 0; i < length; ++i) {
+                src[i] = (out[i] <= 0) ? 0 : src[i];
+            }
+        });
+    }
+    if (this->epilogue_.poolSize == 0) {
+        return delta;
+    }
+
+    const int outHeight = outputSize(_input_->getHeight());
+    const int outWidth = outputSize(_input_->getWidth());
+    initBuffer(this->deltaConv_, batchSize, {outChannels_, outHeight, outWidth}, this->name_ + "_conv_delta");
+    this->deltaConv_.setZero();
+
+    // 每个 (图像, 通道) 只写自己的平面, 展平之后并行
+    const int pooledLength = delta.getHeight() * delta.getWidth();
+    runtime::parallelFor(batchSize * outChannels_, [&](const size_t plane) {
+        const int b = plane / outChannels_;
+        const int oc = plane % outChannels_;
+        kernels::maxPoolBackward(delta.data(b) + oc * pooledLength,
+                                 this->mask_ + b * this->maskLength_ + oc * pooledLength, outHeight, outWidth,
+                                 this->epilogue_.poolSize, this->epilogue_.poolStep,
+                                 this->deltaConv_.data(b) + oc * outHeight * outWidth);
+    });
+    return this->deltaConv_;
+}
+
+/**
+ * @brief Winograd 只实现了 stride=1 的 3x3 卷积
+ */
+bool cnn::architectures::Conv2D::winogradApplicable() const {
+    return this->kernelSize_ == 3 && this->stride_ == 1;
+}
+
+/**
+ * @brief 卷积核各自是一个 Tensor3D, 拼成一个连续的 outChannels x paramsForAKernel 矩阵
+ */
+void cnn::architectures::Conv2D::packWeightMatrix() {
+    this->weightMatrix_.resize(outChannels_ * paramsForAKernel_);
+    for (int oc = 0; oc < outChannels_; ++oc) {
+        const dataType *weightPtr = this->weights_.at(oc)->getData();
+        std::copy(weightPtr, weightPtr + paramsForAKernel_, this->weightMatrix_.data() + oc * paramsForAKernel_);
+    }
+}
+
+cnn::Tensor4D &cnn::architectures::Conv2D::backward(Tensor4D &outputDelta) {
+    // 先把梯度传回 ReLU 和池化之前
+    Tensor4D &delta = backwardEpilogue(outputDelta);
+
     // 获取回传的信息 forward 的输出是多大 delta 就是多大
-    const int batchSize = delta.size();
-    const int outHeight = delta.front()->getHeight();
-    const int outWidth = delta.front()->getWidth();
+    const int batchSize = delta.getBatch();
+    const int outHeight = delta.getHeight();
+    const int outWidth = delta.getWidth();
 
     const int outLength = outHeight * outWidth;
 
     // 获取之前 forward 的输入特征
-    const uint32_t height = _input_.front()->getHeight();
-    const uint32_t width = _input_.front()->getWidth();
+    const uint32_t height = _input_->getHeight();
+    const uint32_t width = _input_->getWidth();
     const uint32_t length = height * width;
 
     initBackward(this->weightsGradients_, outChannels_, {inChannels_, kernelSize_, kernelSize_},
@@ -90,19 +311,20 @@ std::vector<cnn::tensor> cnn::architectures::Conv2D::backward(std::vector<tensor
         this->biasGradients_.at(oc) = 0;
     }
 
-    //TODO 先计算 weight 和 bias 的梯度
-    calWeightAndBiasGradients(delta, outHeight, outWidth, height, width);
+    initBuffer(this->deltaOutput_, batchSize, {inChannels_, height, width}, this->name_ + "_delta");
+    // 清零
+    this->deltaOutput_.setZero();
 
+    if (this->algorithm_ == ConvAlgorithm::Direct) {
+        //TODO 先计算 weight 和 bias 的梯度
+        calWeightAndBiasGradients(delta, outHeight, outWidth);
 
-    // TODO 计算从输出到输入的梯度 delta_output
-    initBackward(this->deltaOutput_, batchSize, {inChannels_, height, width}, this->name_ + "_delta_");
-    // 清零
-    for (int b = 0; b < batchSize; ++b) {
-        this->deltaOutput_.at(b)->setZero();
+        // TODO 计算从输出到输入的梯度 delta_output
+        calDeltaGradients(delta, outHeight, outWidth, height, width);
+    } else {
+        backwardIm2col(delta, outHeight, outWidth, height, width);
     }
 
-    calDeltaGradients(delta, outHeight, outWidth, height, width);
-
     return this->deltaOutput_;
 }
 
@@ -118,6 +340,8 @@ void cnn::architectures::Conv2D::updateGradients(const cnn::dataType learningRat
 
         bias_.at(oc) -= learningRate * biasGradients_.at(oc);
     }
+
+    this->winogradStale_ = true;
 }
 
 void cnn::architectures::Conv2D::saveWeights(std::ofstream &writer) {
@@ -137,31 +361,153 @@ void cnn::architectures::Conv2D::loadWeights(std::ifstream &reader) {
                     static_cast<std::streamsize>(filter_size));
     reader.read((char *) (&bias_[0]),
                 static_cast<std::streamsize>(sizeof(dataType) * outChannels_));
+
+    this->winogradStale_ = true;
 }
 
-int cnn::architectures::Conv2D::getParamsNum() const {
-    return (this->paramsForAKernel_ + 1) * this->outChannels_;
+/**
+ * @brief 卷积的输出逐通道做 y = scale * x + shift, 等价于把第 oc 个卷积核和 bias 都乘以 scale[oc],
+ * bias 再加上 shift[oc]. 推理时用来合并 BatchNorm2D
+ * @param scale 每个输出通道的缩放
+ * @param shift 每个输出通道的偏移
+ */
+void cnn::architectures::Conv2D::fold(const std::vector<dataType> &scale, const std::vector<dataType> &shift) {
+    assert(scale.size() == static_cast<size_t>(outChannels_) && shift.size() == static_cast<size_t>(outChannels_));
+    for (int oc = 0; oc < outChannels_; ++oc) {
+        dataType *weightPtr = this->weights_.at(oc)->getData();
+        for (int i = 0; i < paramsForAKernel_; ++i) {
+            weightPtr[i] *= scale[oc];
+        }
+        this->bias_.at(oc) = this->bias_.at(oc) * scale[oc] + shift[oc];
+    }
+
+    this->winogradStale_ = true;
 }
 
-void
-cnn::architectures::Conv2D::initForward(int batchSize, std::tuple<uint32_t, uint32_t, uint32_t> &shape, int preWeight) {
-    if (this->output_.empty()) {
-        this->output_.reserve(batchSize);
-        for (int i = 0; i < batchSize; ++i) {
-            this->output_.emplace_back(new Tensor3D(shape,
-                                                    this->name_ + "_output_" + std::to_string(i)));
+void cnn::architectures::Conv2D::releaseBackward() {
+    this->_input_ = nullptr;
+    this->deltaOutput_ = Tensor4D();
+    this->deltaColumns_ = Tensor4D();
+    this->columns_ = Tensor4D();
+    this->columnsReady_ = false;
+    std::vector<tensor>().swap(this->weightsGradients_);
+    std::vector<dataType>().swap(this->biasGradients_);
+    this->gradientShards_.release();
+    this->deltaConv_ = Tensor4D();
+    std::vector<uint8_t>().swap(this->maskStorage_);
+    this->mask_ = nullptr;
+    this->maskCapacity_ = 0;
+    this->maskLength_ = 0;
+}
+
+/**
+ * @brief 输入的高或宽经过卷积之后的大小
+ */
+int cnn::architectures::Conv2D::outputSize(const int inputSize) const {
+    return (inputSize + 2 * padding_ - kernelSize_) / stride_ + 1;
+}
+
+/**
+ * @brief 一张图像 im2col 展开之后的形状, (inChannels*k*k) x outLength
+ */
+std::tuple<uint32_t, uint32_t, uint32_t> cnn::architectures::Conv2D::columnsShape(const int outLength) const {
+    return {paramsForAKernel_, outLength, 1};
+}
+
+/**
+ * @brief 卷积层需要的缓冲区: 输出, 传给上一层的梯度, 以及 GEMM 路径上 im2col 展开的矩阵.
+ * 训练时展开的矩阵要从 forward 保留到 backward 复用, 推理时只在 forward 内部临时使用.
+ * 有池化的 epilogue 时输出是池化之后的大小, 训练时还需要 mask 和传回池化之前的梯度
+ */
+std::tuple<uint32_t, uint32_t, uint32_t>
+cnn::architectures::Conv2D::planBuffers(memory::Planner &planner, const uint32_t batchSize,
+                                        const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                                        const LayerSchedule &schedule) {
+    assert(std::get<0>(inputShape) == static_cast<uint32_t>(inChannels_));
+    const int outHeight = outputSize(std::get<1>(inputShape));
+    const int outWidth = outputSize(std::get<2>(inputShape));
+    const auto [pooledHeight, pooledWidth] = pooledSize(outHeight, outWidth);
+    const std::tuple<uint32_t, uint32_t, uint32_t> outShape{outChannels_, pooledHeight, pooledWidth};
+    const auto columns = columnsShape(outHeight * outWidth);
+
+    planner.addTensor(this->output_, batchSize, outShape, this->name_ + "_output", schedule.forward,
+                      schedule.outputEnd);
+
+    const bool gemmForward = this->algorithm_ == ConvAlgorithm::Im2col ||
+                             (this->algorithm_ != ConvAlgorithm::Direct && !winogradApplicable());
+    if (schedule.training()) {
+        planner.addTensor(this->deltaOutput_, batchSize, inputShape, this->name_ + "_delta", schedule.backward,
+                          schedule.deltaEnd);
+        if (this->algorithm_ != ConvAlgorithm::Direct) {
+            planner.addTensor(this->columns_, batchSize, columns, this->name_ + "_columns",
+                              gemmForward ? schedule.forward : schedule.backward, schedule.backward);
+            planner.addTensor(this->deltaColumns_, runtime::shardCount(batchSize), columns,
+                              this->name_ + "_delta_columns", schedule.backward,
+                              schedule.backward);
+        }
+        if (this->epilogue_.poolSize > 0) {
+            planner.addTensor(this->deltaConv_, batchSize, {outChannels_, outHeight, outWidth},
+                              this->name_ + "_conv_delta", schedule.backward, schedule.backward);
+
+            const size_t maskCapacity = static_cast<size_t>(batchSize) * outChannels_ * pooledHeight * pooledWidth;
+            planner.add(this->name_ + "_mask", maskCapacity * sizeof(uint8_t), schedule.forward, schedule.backward,
+                        [this, maskCapacity](void *data) {
+                            this->mask_ = static_cast<uint8_t *>(data);
+                            this->maskCapacity_ = maskCapacity;
+                            std::vector<uint8_t>().swap(this->maskStorage_);
+                        });
         }
+    } else if (gemmForward) {
+        planner.addTensor(this->columns_, 1, columns, this->name_ + "_columns", schedule.forward, schedule.forward);
     }
 
-    int radius = kernelSize_ / 2;
+    return outShape;
+}
+
+int cnn::architectures::Conv2D::getParamsNum() const {
+    return (this->paramsForAKernel_ + 1) * this->outChannels_;
+}
+
+void cnn::architectures::Conv2D::setAlgorithm(const ConvAlgorithm algorithm) {
+    this->algorithm_ = algorithm;
+}
+
+cnn::architectures::ConvAlgorithm cnn::architectures::Conv2D::getAlgorithm() const {
+    return this->algorithm_;
+}
+
+void cnn::architectures::Conv2D::setEpilogue(const ConvEpilogue &epilogue) {
+    assert(epilogue.poolSize == 0 || epilogue.poolStep > 0);
+    this->epilogue_ = epilogue;
+}
+
+const cnn::architectures::ConvEpilogue &cnn::architectures::Conv2D::getEpilogue() const {
+    return this->epilogue_;
+}
+
+void cnn::architectures::Conv2D::initForward(int batchSize, std::tuple<uint32_t, uint32_t, uint32_t> &shape) {
+    initBuffer(this->output_, batchSize, shape, this->name_ + "_output");
 
-    int position = 0;
-    for (int i = -radius; i <= radius; ++i) {
-        for (int j = -radius; j <= radius; ++j) {
-            this->offset_[position++] = i * preWeight + j;
+    // 池化的 mask 对 batch 中的每一张图都分配空间, 内存规划已经分配好的就直接使用
+    if (this->epilogue_.poolSize > 0 && !noGrad) {
+        this->maskLength_ = std::get<0>(shape) * std::get<1>(shape) * std::get<2>(shape);
+        if (this->maskCapacity_ < batchSize * this->maskLength_) {
+            this->maskStorage_.resize(batchSize * this->maskLength_);
+            this->mask_ = this->maskStorage_.data();
+            this->maskCapacity_ = this->maskStorage_.size();
         }
     }
+}
 
+/**
+ * @brief 池化之后的高和宽, 不池化时就是卷积输出的大小
+ */
+std::pair<int, int> cnn::architectures::Conv2D::pooledSize(const int outHeight, const int outWidth) const {
+    if (this->epilogue_.poolSize == 0) {
+        return {outHeight, outWidth};
+    }
+    return {(outHeight - this->epilogue_.poolSize) / this->epilogue_.poolStep + 1,
+            (outWidth - this->epilogue_.poolSize) / this->epilogue_.poolStep + 1};
 }
 
 void
@@ -175,85 +521,177 @@ cnn::architectures::Conv2D::initBackward(std::vector<tensor> &v, int size,
     }
 }
 
-void
-cnn::architectures::Conv2D::calWeightAndBiasGradients(std::vector<tensor> &delta, uint32_t outHeight, uint32_t outWidth,
-                                                      uint32_t height,
-                                                      uint32_t width) {
-    const uint32_t batchSize = delta.size();
-    for (int b = 0; b < batchSize; ++b) {
-        // 每一个卷积核
-        for (int oc = 0; oc < outChannels_; ++oc) {
-            dataType *outDelta = delta.at(b)->getData() + oc * outHeight * outWidth;
-
-            //每一个输入的通道
-            for (int ic = 0; ic < inChannels_; ++ic) {
-                // 第 b 张输入，找到第 i 个通道的起始地址
-                dataType *srcPtr = this->_input_.at(b)->getData() + ic * height * width;
-                // 第 oc 个卷积核的第 i 个通道的起始地址
-                dataType *weightPtr = this->weightsGradients_.at(oc)->getData() + ic * kernelSize_ * kernelSize_;
-
-                //遍历卷积核中的每一个参数
-                for (int kx = 0; kx < kernelSize_; ++kx) {
-                    for (int ky = 0; ky < kernelSize_; ++ky) {
-                        dataType sumValues = 0.f;
-
-                        for (int x = 0; x < outHeight; ++x) {
-                            dataType *deltaPtr = outDelta + x * outWidth;
-                            dataType *inputPtr = srcPtr + (x * stride_ + kx) + width;
-
-                            for (int y = 0; y < outWidth; ++y) {
-                                // 当前的 weight 的梯度 由参与计算的输入和下一层返回的梯度相乘再累加
-                                sumValues += deltaPtr[y] * inputPtr[y * stride_ + ky];
+/**
+ * @brief 直接计算权重和 bias 的梯度. batch 切分给若干个梯度分片并行, 每个分片只累加自己的图像, 最后归约
+ */
+void cnn::architectures::Conv2D::calWeightAndBiasGradients(Tensor4D &delta, const uint32_t outHeight,
+                                                           const uint32_t outWidth) {
+    const uint32_t batchSize = delta.getBatch();
+    const int windowsSize = kernelSize_ * kernelSize_;
+    const size_t weightLength = static_cast<size_t>(outChannels_) * paramsForAKernel_;
+    this->gradientShards_.reset(runtime::shardCount(batchSize), weightLength + outChannels_);
+
+    runtime::parallelFor(this->gradientShards_.count(), [&](const size_t s) {
+        dataType *weightGradients = this->gradientShards_.shard(s);
+        dataType *biasGradients = weightGradients + weightLength;
+        const auto [begin, end] = this->gradientShards_.range(batchSize, s);
+
+        for (size_t b = begin; b < end; ++b) {
+            // 带填充的输入视图, 和 forward 时看到的一致
+            const TensorView src = this->_input_->view(b).padded(padding_);
+
+            // 每一个卷积核
+            for (int oc = 0; oc < outChannels_; ++oc) {
+                dataType *outDelta = delta.data(b) + oc * outHeight * outWidth;
+
+                //每一个输入的通道
+                for (int ic = 0; ic < inChannels_; ++ic) {
+                    // 第 oc 个卷积核的第 i 个通道的起始地址
+                    dataType *weightPtr = weightGradients + oc * paramsForAKernel_ + ic * windowsSize;
+
+                    //遍历卷积核中的每一个参数
+                    for (int kx = 0; kx < kernelSize_; ++kx) {
+                        for (int ky = 0; ky < kernelSize_; ++ky) {
+                            dataType sumValues = 0.f;
+
+                            for (int x = 0; x < outHeight; ++x) {
+                                dataType *deltaPtr = outDelta + x * outWidth;
+                                for (int y = 0; y < outWidth; ++y) {
+                                    // 当前的 weight 的梯度 由参与计算的输入和下一层返回的梯度相乘再累加
+                                    sumValues += deltaPtr[y] * src.at(ic, x * stride_ + kx, y * stride_ + ky);
+                                }
                             }
+                            weightPtr[kx * kernelSize_ + ky] += sumValues / batchSize * 1.0;
                         }
-                        weightPtr[kx * kernelSize_ + ky] += sumValues / batchSize * 1.0;
                     }
                 }
-            }
-            // 计算 bias 的梯度 bias 的大小就是 outChannels
-            dataType sumValue = 0.f;
-            for (int d = 0; d < outHeight * outWidth; ++d) {
-                sumValue += outDelta[d];
-            }
+                // 计算 bias 的梯度 bias 的大小就是 outChannels
+                dataType sumValue = 0.f;
+                for (uint32_t d = 0; d < outHeight * outWidth; ++d) {
+                    sumValue += outDelta[d];
+                }
 
-            biasGradients_[oc] += sumValue / batchSize * 1.0;
+                biasGradients[oc] += sumValue / batchSize * 1.0;
+            }
         }
-    }
+    });
+
+    reduceGradients();
 }
 
-void cnn::architectures::Conv2D::calDeltaGradients(std::vector<tensor> &delta, uint32_t height, uint32_t width,
-                                                   uint32_t inHeight, uint32_t inWidth) {
-    const int batchSize = delta.size();
-    const int radius = kernelSize_ / 2;
-    const int boundaryHeight = height - radius;
-    const int boundaryWidth = width - radius;
+/**
+ * @brief 直接计算传给上一层的梯度, 每张图像只写自己的梯度, 按图像并行
+ */
+void cnn::architectures::Conv2D::calDeltaGradients(Tensor4D &delta, const uint32_t outHeight, const uint32_t outWidth,
+                                                   const uint32_t inHeight, const uint32_t inWidth) {
+    const int batchSize = delta.getBatch();
     const int windowsSize = kernelSize_ * kernelSize_;
+    const int inLength = inHeight * inWidth;
 
     //  多个batch 分开计算
-    for (int b = 0; b < batchSize; ++b) {
+    runtime::parallelFor(batchSize, [&](const size_t b) {
         // 输出  inChannels * 224 * 224
-        dataType *deltaOut = this->deltaOutput_.at(b)->getData();
+        dataType *deltaOut = this->deltaOutput_.data(b);
         for (int oc = 0; oc < outChannels_; ++oc) {
-            dataType *outPtr = delta.at(b)->getData() + oc * height * width;
+            dataType *outPtr = delta.data(b) + oc * outHeight * outWidth;
             dataType *weightPtr = this->weights_.at(oc)->getData();
 
             int cnt = 0;
-            // 遍历图像平面上的每一个点
-            for (int x = radius; x < inHeight - radius; x += stride_) {
-                for (int y = 0; y < inWidth - radius; y += stride_) {
-                    const int coord = x * width + y;
+            // 遍历输出平面上的每一个点, 把梯度分给参与计算的输入, 落在填充上的部分丢弃
+            for (int x = 0; x < outHeight; ++x) {
+                for (int y = 0; y < outWidth; ++y) {
+                    const dataType value = outPtr[cnt++];
                     for (int ic = 0; ic < inChannels_; ++ic) {
-                        const int start = ic * inHeight * inWidth + coord;
-                        const int weightStart = ic * windowsSize;
-                        for (int k = 0; k < windowsSize; ++k) {
-                            deltaOut[start + offset_[k]] += weightPtr[weightStart + k] * outPtr[cnt];
+                        const dataType *kernel = weightPtr + ic * windowsSize;
+                        dataType *plane = deltaOut + ic * inLength;
+                        for (int kx = 0; kx < kernelSize_; ++kx) {
+                            const int iy = x * stride_ + kx - padding_;
+                            if (iy < 0 || iy >= static_cast<int>(inHeight)) {
+                                continue;
+                            }
+                            for (int ky = 0; ky < kernelSize_; ++ky) {
+                                const int ix = y * stride_ + ky - padding_;
+                                if (ix >= 0 && ix < static_cast<int>(inWidth)) {
+                                    plane[iy * inWidth + ix] += kernel[kx * kernelSize_ + ky] * value;
+                                }
+                            }
                         }
                     }
-                    cnt++;
                 }
             }
         }
-    }
+    });
 }
 
 
+
+/**
+ * @brief 基于 GEMM 的反向传播, 复用 forward 时 im2col 展开的矩阵. batch 切分给若干个梯度分片并行:
+ * weightGradients[outChannels x K] = sum_b delta_b[outChannels x outLength] * columns_b^T / batchSize
+ * deltaColumns[K x outLength] = weights^T * delta_b, 再通过 col2im 累加回输入的梯度
+ */
+void cnn::architectures::Conv2D::backwardIm2col(Tensor4D &delta, const uint32_t outHeight, const uint32_t outWidth,
+                                                const uint32_t height, const uint32_t width) {
+    const int batchSize = delta.getBatch();
+    const int outLength = outHeight * outWidth;
+
+    // Winograd 的前向传播没有展开输入, 这里补上
+    if (!this->columnsReady_) {
+        packWeightMatrix();
+        initBuffer(this->columns_, batchSize, columnsShape(outLength), this->name_ + "_columns");
+        for (int b = 0; b < batchSize; ++b) {
+            kernels::im2col(this->_input_->data(b), inChannels_, height, width, kernelSize_, stride_,
+                            padding_, this->columns_.data(b));
+        }
+    }
+
+    const size_t weightLength = static_cast<size_t>(outChannels_) * paramsForAKernel_;
+    this->gradientShards_.reset(runtime::shardCount(batchSize), weightLength + outChannels_);
+    initBuffer(this->deltaColumns_, this->gradientShards_.count(), columnsShape(outLength),
+               this->name_ + "_delta_columns");
+
+    const dataType scale = 1.f / batchSize;
+    runtime::parallelFor(this->gradientShards_.count(), [&](const size_t s) {
+        dataType *weightGradients = this->gradientShards_.shard(s);
+        dataType *biasGradients = weightGradients + weightLength;
+        dataType *deltaColumns = this->deltaColumns_.data(s);
+        const auto [begin, end] = this->gradientShards_.range(batchSize, s);
+
+        for (size_t b = begin; b < end; ++b) {
+            const dataType *deltaPtr = delta.data(b);
+            const dataType *columns = this->columns_.data(b);
+
+            // 权重的梯度累加到当前分片
+            kernels::sgemm(false, true, outChannels_, paramsForAKernel_, outLength, scale,
+                           deltaPtr, outLength, columns, outLength, 1.f, weightGradients, paramsForAKernel_);
+
+            // bias 的梯度就是 delta 每一行的和
+            for (int oc = 0; oc < outChannels_; ++oc) {
+                const dataType *row = deltaPtr + oc * outLength;
+                biasGradients[oc] += std::accumulate(row, row + outLength, 0.f) * scale;
+            }
+
+            // 输入的梯度, 每张图像只写自己的 deltaOutput_
+            kernels::sgemm(true, false, paramsForAKernel_, outLength, outChannels_, 1.f,
+                           this->weightMatrix_.data(), paramsForAKernel_, deltaPtr, outLength, 0.f,
+                           deltaColumns, outLength);
+            kernels::col2im(deltaColumns, inChannels_, height, width, kernelSize_, stride_, padding_,
+                            this->deltaOutput_.data(b));
+        }
+    });
+
+    reduceGradients();
+}
+
+/**
+ * @brief 归约各个分片的梯度, 写回每个卷积核的梯度和 bias 的梯度
+ */
+void cnn::architectures::Conv2D::reduceGradients() {
+    const dataType *gradients = this->gradientShards_.reduce();
+    for (int oc = 0; oc < outChannels_; ++oc) {
+        const dataType *src = gradients + oc * paramsForAKernel_;
+        std::copy(src, src + paramsForAKernel_, this->weightsGradients_.at(oc)->getData());
+    }
+    const dataType *bias = gradients + static_cast<size_t>(outChannels_) * paramsForAKernel_;
+    std::copy(bias, bias + outChannels_, this->biasGradients_.begin());
+}
@@ -0,0 +1,96 @@
+#include<convert.hpp>
+#include<cassert>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include<immintrin.h>
+#endif
+
+namespace {
+    using cnn::dataType;
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+    // 16 个像素共 48 个字节, 分三次读入; masks[c][k] 从第 k 段中取出通道 c 的字节放到对应的位置, 其余位置置 0
+    struct ShuffleMasks {
+        __m128i masks[3][3];
+
+        ShuffleMasks() {
+            for (int c = 0; c < 3; ++c) {
+                alignas(16) int8_t bytes[3][16];
+                for (auto &chunk: bytes) {
+                    for (auto &b: chunk) {
+                        b = -1;
+                    }
+                }
+                for (int p = 0; p < 16; ++p) {
+                    const int source = 3 * p + c;
+                    bytes[source / 16][p] = static_cast<int8_t>(source % 16);
+                }
+                for (int k = 0; k < 3; ++k) {
+                    masks[c][k] = _mm_load_si128(reinterpret_cast<const __m128i *>(bytes[k]));
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief 16 个字节转成 float, 做 x * scale + bias 之后写出
+     */
+    inline void convert16(const __m128i bytes, const __m256 scale, const __m256 bias, dataType *output) {
+        const __m256 low = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+        const __m256 high = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+        _mm256_storeu_ps(output, _mm256_fmadd_ps(low, scale, bias));
+        _mm256_storeu_ps(output + 8, _mm256_fmadd_ps(high, scale, bias));
+    }
+
+#endif
+}
+
+/**
+ * @brief 一次遍历完成通道拆分, 类型转换, 缩放和归一化. 有 AVX2 时每次处理 16 个像素:
+ * 三次 128 位读取之后用 pshufb 拆出每个通道的 16 个字节, 再扩展成 float 做一次 FMA
+ * @param image HWC 排布的像素, 例如 OpenCV 的 BGR 图像
+ * @param pixels 像素个数, 即 height * width
+ * @param output CHW 排布的输出, 可以直接是 Tensor4D 中某个样本的起始位置
+ */
+void cnn::kernels::hwcToChw(const uchar *image, const uint32_t pixels, const dataType scale[3],
+                            const dataType bias[3], dataType *output) {
+    dataType *planes[3] = {output, output + pixels, output + 2 * pixels};
+    uint32_t i = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    static const ShuffleMasks shuffle;
+    const __m256 scales[3] = {_mm256_set1_ps(scale[0]), _mm256_set1_ps(scale[1]), _mm256_set1_ps(scale[2])};
+    const __m256 biases[3] = {_mm256_set1_ps(bias[0]), _mm256_set1_ps(bias[1]), _mm256_set1_ps(bias[2])};
+
+    for (; i + 16 <= pixels; i += 16) {
+        const uchar *src = image + 3 * i;
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16));
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32));
+
+        for (int ch = 0; ch < 3; ++ch) {
+            const __m128i bytes = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, shuffle.masks[ch][0]),
+                                                            _mm_shuffle_epi8(b, shuffle.masks[ch][1])),
+                                               _mm_shuffle_epi8(c, shuffle.masks[ch][2]));
+            convert16(bytes, scales[ch], biases[ch], planes[ch] + i);
+        }
+    }
+#endif
+
+    for (; i < pixels; ++i) {
+        const uchar *src = image + 3 * i;
+        planes[0][i] = src[0] * scale[0] + bias[0];
+        planes[1][i] = src[1] * scale[1] + bias[1];
+        planes[2][i] = src[2] * scale[2] + bias[2];
+    }
+}
+
+void cnn::kernels::normalizeParams(const std::vector<dataType> &mean, const std::vector<dataType> &standardDeviation,
+                                   dataType scale[3], dataType bias[3]) {
+    assert(mean.size() == 3 && standardDeviation.size() == 3);
+    for (int c = 0; c < 3; ++c) {
+        scale[c] = 1.f / (255.f * standardDeviation[c]);
+        bias[c] = -mean[c] / standardDeviation[c];
+    }
+}
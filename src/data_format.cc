@@ -1,5 +1,8 @@
 #include<data_format.hpp>
+#include<convert.hpp>
 #include<iomanip>
+#include<utility>
+#include<cassert>
 
 /**
  * @brief 从cv::Mat 中读取数据到 this->data_
@@ -16,15 +19,23 @@ void cnn::Tensor3D::readData(cv::Mat &image) {
  * @param size 指针区域的大小
  */
 void cnn::Tensor3D::readData(const uchar *const image, const uint32_t size) {
-
     // 最初是按照一行一行的进行复制，但是OpenCV里面本来也是线性的，还使用二维的方式反而多次一举啦
-    for (int i = 0; i < size; ++i) {
-        uint32_t position = 3 * i;
-        this->data_[i] = image[position] * 1.0 / 255;
-        this->data_[size + i] = image[position + 1] * 1.0 / 255;
-        this->data_[size * 2 + i] = image[position + 2] * 1.0 / 255;
-//        ::printf("%d %d %d\n", image[position], image[position + 1], image[position + 2]);
-    }
+    const dataType scale[3] = {1.f / 255, 1.f / 255, 1.f / 255};
+    const dataType bias[3] = {0, 0, 0};
+    kernels::hwcToChw(image, size, scale, bias, this->data_);
+}
+
+/**
+ * @brief 从原始指针读取数据并归一化, 拆分通道, 转换类型和归一化在同一次遍历中完成
+ * @param mean 每个通道在 [0, 1] 范围内的均值
+ * @param standardDeviation 每个通道的标准差
+ */
+void cnn::Tensor3D::readData(const uchar *const image, const uint32_t size, const std::vector<dataType> &mean,
+                             const std::vector<dataType> &standardDeviation) {
+    dataType scale[3];
+    dataType bias[3];
+    kernels::normalizeParams(mean, standardDeviation, scale, bias);
+    kernels::hwcToChw(image, size, scale, bias, this->data_);
 }
 
 /**
@@ -101,9 +112,10 @@ void cnn::Tensor3D::normalize(const std::vector<dataType> &mean, const std::vect
         return;
     }
 
+    const uint32_t planeLength = height_ * width_;
     for (int c = 0; c < channels_; ++c) {
-        cnn::dataType *curChannel = this->data_ + c * length_;
-        for (int i = 0; i < length_; ++i) {
+        cnn::dataType *curChannel = this->data_ + c * planeLength;
+        for (int i = 0; i < planeLength; ++i) {
             curChannel[i] = (curChannel[i] - mean.at(c)) / standardDeviation.at(c);
         }
     }
@@ -178,52 +190,252 @@ void cnn::Tensor3D::print(uint32_t channel) const {
 }
 
 /**
- * @brief 图像数据旋转180度
- * @return 旋转180度之后的Tensor
+ * @brief 不补边, 连续存放的只读视图, 不复制数据
+ * @return 指向 data_ 的 TensorView
+ */
+cnn::TensorView cnn::Tensor3D::view() const {
+    return {this->data_, this->channels_, this->height_, this->width_};
+}
+
+/**
+ * @brief 每个通道旋转 180 度之后的拷贝, 只读的场景直接用 view().rot180()
  */
 std::shared_ptr<cnn::Tensor3D> cnn::Tensor3D::rot180() const {
     std::shared_ptr<Tensor3D> rot{std::make_shared<Tensor3D>(this->channels_, this->height_, this->width_, "_rot180_")};
-
-    for (int c = 0; c < channels_; ++c) {
-        dataType *src = this->data_ + length_ * c;
-        dataType *dst = rot->data_ + length_ * c;
-
-        for (int i = 0; i < length_; ++i) {
-            dst[i] = src[length_ - 1 - i];
-        }
-    }
-
+    view().rot180().copyTo(rot->data_);
     return rot;
 }
 
 /**
- * @brief 对图像数据进行 padding
- * @param padding 填充的size
- * @return 填充之后的 Tensor
+ * @brief 四周补 0 之后的拷贝, 只读的场景直接用 view().padded(padding)
  */
 std::shared_ptr<cnn::Tensor3D> cnn::Tensor3D::padding(const int padding) const {
     std::shared_ptr<Tensor3D> pad{
             std::make_shared<Tensor3D>(this->channels_, this->height_ + 2 * padding, this->width_ + 2 * padding,
                                        "_padding_" + std::to_string(padding))};
-    const uint32_t paddedWidth = this->width_ + 2 * padding;
-    const uint32_t paddedSize = (this->height_ + 2 * padding) * paddedWidth;
+    view().padded(padding).copyTo(pad->data_);
+    return pad;
+}
 
-    for (int c = 0; c < channels_; ++c) {
-        for (int i = 0; i < height_; ++i) {
-            ::memcpy(pad->data_ + c * paddedSize + (padding + i) * paddedWidth + padding,
-                     this->data_ + c * length_ + i * this->width_,
-                     sizeof(cnn::dataType) * this->width_);
-        }
+/**
+ * @brief 从默认分配器申请 length_ 个元素, 起始地址按缓存行对齐, 大小补齐到缓存行的整数倍
+ */
+void cnn::Tensor3D::allocate() {
+    this->allocator_ = &memory::defaultAllocator();
+    const size_t bytes = memory::paddedBytes(sizeof(dataType) * length_);
+    this->data_ = static_cast<dataType *>(this->allocator_->allocate(bytes));
+}
+
+cnn::Tensor3D::~Tensor3D() {
+    if (this->owner_ && this->data_ != nullptr) {
+        this->allocator_->deallocate(this->data_, memory::paddedBytes(sizeof(dataType) * length_));
+        this->data_ = nullptr;
     }
+}
 
-    return pad;
 
+namespace {
+    // 每个样本的起始地址按缓存行对齐
+    constexpr size_t ALIGNED_ELEMENTS = cnn::memory::CACHE_LINE / sizeof(cnn::dataType);
+
+    size_t alignedSampleStride(const std::tuple<uint32_t, uint32_t, uint32_t> &shape) {
+        const size_t length = static_cast<size_t>(std::get<0>(shape)) * std::get<1>(shape) * std::get<2>(shape);
+        return (length + ALIGNED_ELEMENTS - 1) / ALIGNED_ELEMENTS * ALIGNED_ELEMENTS;
+    }
 }
 
-cnn::Tensor3D::~Tensor3D() {
+cnn::Tensor4D::Tensor4D(const uint32_t batch, const uint32_t channel, const uint32_t height, const uint32_t width,
+                        std::string name) :
+        batch_(batch), channels_(channel), height_(height), width_(width), name_(std::move(name)) {
+    this->sampleStride_ = alignedSampleStride(sampleShape());
+
+    this->allocator_ = &memory::defaultAllocator();
+    this->data_ = static_cast<dataType *>(this->allocator_->allocate(bytes(batch, sampleShape())));
+
+    createViews();
+}
+
+cnn::Tensor4D::Tensor4D(dataType *data, const uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape,
+                        std::string name) :
+        batch_(batch), channels_(std::get<0>(shape)), height_(std::get<1>(shape)), width_(std::get<2>(shape)),
+        data_(data), owner_(false), name_(std::move(name)) {
+    assert(reinterpret_cast<uintptr_t>(data) % memory::CACHE_LINE == 0);
+    this->sampleStride_ = alignedSampleStride(shape);
+    createViews();
+}
+
+/**
+ * @brief 每个样本的 Tensor3D 视图都指向 data_ 中对应的位置
+ */
+void cnn::Tensor4D::createViews() {
+    this->views_.clear();
+    this->views_.reserve(batch_);
+    for (uint32_t b = 0; b < batch_; ++b) {
+        this->views_.emplace_back(std::make_shared<Tensor3D>(this->data(b), channels_, height_, width_,
+                                                             this->name_ + "_" + std::to_string(b)));
+    }
+}
+
+size_t cnn::Tensor4D::bytes(const uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape) {
+    return alignedSampleStride(shape) * batch * sizeof(dataType);
+}
+
+cnn::Tensor4D::Tensor4D(const uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape,
+                        std::string name) :
+        Tensor4D(batch, std::get<0>(shape), std::get<1>(shape), std::get<2>(shape), std::move(name)) {}
+
+cnn::Tensor4D::Tensor4D(cnn::Tensor4D &&other) noexcept {
+    *this = std::move(other);
+}
+
+cnn::Tensor4D &cnn::Tensor4D::operator=(cnn::Tensor4D &&other) noexcept {
+    if (this != &other) {
+        release();
+        this->batch_ = std::exchange(other.batch_, 0);
+        this->channels_ = std::exchange(other.channels_, 0);
+        this->height_ = std::exchange(other.height_, 0);
+        this->width_ = std::exchange(other.width_, 0);
+        this->sampleStride_ = std::exchange(other.sampleStride_, 0);
+        this->data_ = std::exchange(other.data_, nullptr);
+        this->owner_ = std::exchange(other.owner_, true);
+        this->allocator_ = std::exchange(other.allocator_, nullptr);
+        this->views_ = std::move(other.views_);
+        this->name_ = std::move(other.name_);
+        other.views_.clear();
+    }
+    return *this;
+}
+
+/**
+ * @brief 每个样本的数据个数, 即 channels*height*width, 不包含对齐补齐的部分
+ */
+uint32_t cnn::Tensor4D::sampleLength() const {
+    return this->channels_ * this->height_ * this->width_;
+}
+
+/**
+ * @brief 单个样本的形状
+ */
+std::tuple<uint32_t, uint32_t, uint32_t> cnn::Tensor4D::sampleShape() const {
+    return {this->channels_, this->height_, this->width_};
+}
+
+/**
+ * @brief 判断当前的 batch 大小和样本形状是否与给定的一致, 层内的缓冲区据此决定是否需要重新分配
+ */
+bool cnn::Tensor4D::matches(const uint32_t batch, const std::tuple<uint32_t, uint32_t, uint32_t> &shape) const {
+    return !this->empty() && this->batch_ == batch && this->sampleShape() == shape;
+}
+
+/**
+ * @brief 整个 batch 清零
+ */
+void cnn::Tensor4D::setZero() {
     if (this->data_ != nullptr) {
-        delete this->data_;
-        this->data_ = nullptr;
+        ::memset(this->data_, 0, sizeof(cnn::dataType) * this->sampleStride_ * this->batch_);
     }
 }
 
+void cnn::Tensor4D::printShape() const {
+    ::printf("[%d,%d,%d,%d]\n", this->batch_, this->channels_, this->height_, this->width_);
+}
+
+void cnn::Tensor4D::release() {
+    this->views_.clear();
+    if (this->owner_ && this->data_ != nullptr) {
+        this->allocator_->deallocate(this->data_, bytes(batch_, sampleShape()));
+    }
+    this->data_ = nullptr;
+    this->owner_ = true;
+    this->allocator_ = nullptr;
+}
+
+cnn::Tensor4D::~Tensor4D() {
+    release();
+}
+
+cnn::TensorView::TensorView(const dataType *data, const uint32_t channels, const uint32_t height,
+                            const uint32_t width) :
+        data_(data), channels_(channels), height_(height), width_(width),
+        channelStride_(static_cast<ptrdiff_t>(height) * width), rowStride_(width), colStride_(1) {}
+
+cnn::TensorView cnn::TensorView::padded(const uint32_t padding) const {
+    TensorView result(*this);
+    result.padding_ += padding;
+    return result;
+}
+
+/**
+ * @brief 起点移到每个平面的最后一个元素, 行列步长取反; 填充是对称的, 保持不变
+ */
+cnn::TensorView cnn::TensorView::rot180() const {
+    TensorView result(*this);
+    result.data_ = this->data_ + (static_cast<ptrdiff_t>(height_) - 1) * rowStride_ +
+                   (static_cast<ptrdiff_t>(width_) - 1) * colStride_;
+    result.rowStride_ = -this->rowStride_;
+    result.colStride_ = -this->colStride_;
+    return result;
+}
+
+cnn::TensorView cnn::TensorView::slice(const uint32_t begin, const uint32_t end) const {
+    assert(begin <= end && end <= this->channels_);
+    TensorView result(*this);
+    result.data_ = this->data_ + begin * this->channelStride_;
+    result.channels_ = end - begin;
+    return result;
+}
+
+cnn::TensorView cnn::TensorView::reshape(const uint32_t channels, const uint32_t height, const uint32_t width) const {
+    assert(contiguous());
+    assert(channels * height * width == length());
+    return {this->data_, channels, height, width};
+}
+
+cnn::TensorView cnn::TensorView::flatten() const {
+    return reshape(length(), 1, 1);
+}
+
+bool cnn::TensorView::contiguous() const {
+    return this->padding_ == 0 && this->colStride_ == 1 && this->rowStride_ == this->width_ &&
+           (this->channels_ <= 1 || this->channelStride_ == static_cast<ptrdiff_t>(this->height_) * this->width_);
+}
+
+const cnn::dataType *cnn::TensorView::data() const {
+    assert(contiguous());
+    return this->data_;
+}
+
+uint32_t cnn::TensorView::length() const {
+    return this->channels_ * getHeight() * getWidth();
+}
+
+std::tuple<uint32_t, uint32_t, uint32_t> cnn::TensorView::shape() const {
+    return {this->channels_, getHeight(), getWidth()};
+}
+
+void cnn::TensorView::copyTo(dataType *dst) const {
+    const int height = static_cast<int>(getHeight());
+    const int width = static_cast<int>(getWidth());
+    for (uint32_t c = 0; c < this->channels_; ++c) {
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                *dst++ = at(c, y, x);
+            }
+        }
+    }
+}
+
+cnn::Tensor4D cnn::Tensor4D::reshape(const std::tuple<uint32_t, uint32_t, uint32_t> &shape) const {
+    assert(std::get<0>(shape) * std::get<1>(shape) * std::get<2>(shape) == sampleLength());
+    // 样本的数据个数不变, 对齐之后的样本间隔也不变
+    return {this->data_, this->batch_, shape, this->name_ + "_reshape"};
+}
+
+cnn::Tensor4D cnn::Tensor4D::flatten() const {
+    return reshape({sampleLength(), 1, 1});
+}
+
+cnn::Tensor4D cnn::Tensor4D::slice(const uint32_t begin, const uint32_t end) const {
+    assert(begin <= end && end <= this->batch_);
+    return {this->data(begin), end - begin, sampleShape(), this->name_ + "_slice"};
+}
@@ -0,0 +1,824 @@
+#include<dataset.hpp>
+#include<runtime.hpp>
+#include<allocator.hpp>
+#include<cassert>
+#include<cstdio>
+#include<cstring>
+#include<algorithm>
+#include<charconv>
+#include<cmath>
+#include<fstream>
+#include<iomanip>
+#include<limits>
+#include<numeric>
+#include<stdexcept>
+#include<opencv2/imgcodecs.hpp>
+#include<opencv2/imgproc.hpp>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<unistd.h>
+
+namespace {
+    constexpr char PACK_MAGIC[8] = {'C', 'N', 'N', 'P', 'A', 'C', 'K', '\0'};
+    constexpr uint32_t PACK_VERSION = 1;
+    constexpr char MANIFEST_MAGIC[] = "cnn-manifest";
+    constexpr uint32_t MANIFEST_VERSION = 1;
+    constexpr size_t TAR_BLOCK = 512;
+    constexpr size_t STREAM_BUFFER = 4 << 20;
+    constexpr size_t NOT_IN_PASS = std::numeric_limits<size_t>::max(); // 样本不在这一轮的读取顺序中
+
+    size_t alignUp(const size_t bytes) {
+        return cnn::memory::paddedBytes(bytes);
+    }
+
+    /**
+     * @brief 从 JPEG 的 SOF 段读出图像的宽高, 不是 JPEG 或者没有找到时返回空的大小
+     */
+    cv::Size jpegSize(const std::vector<uchar> &bytes) {
+        if (bytes.size() < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8) {
+            return {};
+        }
+        size_t pos = 2;
+        while (pos + 4 <= bytes.size()) {
+            if (bytes[pos] != 0xFF) {
+                return {};
+            }
+            const uchar marker = bytes[pos + 1];
+            // 填充字节
+            if (marker == 0xFF) {
+                ++pos;
+                continue;
+            }
+            // 没有长度的标记
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                pos += 2;
+                continue;
+            }
+            const size_t length = (bytes[pos + 2] << 8) | bytes[pos + 3];
+            // SOF0 ~ SOF15, 除去 DHT(C4), JPG(C8), DAC(CC)
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                if (pos + 9 > bytes.size()) {
+                    return {};
+                }
+                const int height = (bytes[pos + 5] << 8) | bytes[pos + 6];
+                const int width = (bytes[pos + 7] << 8) | bytes[pos + 8];
+                return {width, height};
+            }
+            // 到了扫描数据还没有 SOF
+            if (marker == 0xDA) {
+                return {};
+            }
+            pos += 2 + length;
+        }
+        return {};
+    }
+
+    /**
+     * @brief 从 PNG 的 IHDR 段读出图像的宽高, 不是 PNG 时返回空的大小
+     */
+    cv::Size pngSize(const std::vector<uchar> &bytes) {
+        static const uchar signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        if (bytes.size() < 24 || std::memcmp(bytes.data(), signature, 8) != 0 ||
+            std::memcmp(bytes.data() + 12, "IHDR", 4) != 0) {
+            return {};
+        }
+        auto read = [&](const size_t pos) {
+            return static_cast<int>((bytes[pos] << 24) | (bytes[pos + 1] << 16) | (bytes[pos + 2] << 8) | bytes[pos + 3]);
+        };
+        return {read(16), read(20)};
+    }
+
+    uint64_t fnv1a(const uchar *data, const size_t length) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ data[i]) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /**
+     * @brief 由相对路径的哈希决定划分, 同一张图像的划分和其它图像的增减无关
+     */
+    std::string assignSplit(const std::string &path, const std::pair<float, float> &ratios) {
+        const auto *data = reinterpret_cast<const uchar *>(path.data());
+        const double position = static_cast<double>(fnv1a(data, path.size()) % 1000000) / 1000000;
+        if (position < ratios.first) {
+            return "train";
+        }
+        if (position < ratios.first + ratios.second) {
+            return "test";
+        }
+        return "valid";
+    }
+
+    int64_t modifiedTime(const std::filesystem::path &file) {
+        return std::filesystem::last_write_time(file).time_since_epoch().count();
+    }
+
+    uint64_t parseOctal(const char *field, const size_t length) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < length && field[i] >= '0' && field[i] <= '7'; ++i) {
+            value = value * 8 + (field[i] - '0');
+        }
+        return value;
+    }
+
+    /**
+     * @brief .cls 的内容是一个非负的十进制整数, 前后可以有空白. 格式不对时抛出异常, 指出是哪个分片的哪个成员
+     */
+    int parseLabel(const std::string &text, const std::filesystem::path &shard, const std::string &member) {
+        const size_t first = text.find_first_not_of(" \t\r\n");
+        const size_t last = text.find_last_not_of(" \t\r\n");
+        int label = -1;
+        if (first != std::string::npos) {
+            const char *end = text.data() + last + 1;
+            const auto [parsed, error] = std::from_chars(text.data() + first, end, label);
+            if (error != std::errc() || parsed != end) {
+                label = -1;
+            }
+        }
+        if (label < 0) {
+            throw std::runtime_error(shard.string() + ": invalid label \"" + text + "\" in " + member);
+        }
+        return label;
+    }
+
+    /**
+     * @brief ustar 格式的文件头, 校验和按标准计算
+     */
+    void writeTarMember(std::ofstream &output, const std::string &name, const char *data, const size_t length) {
+        char header[TAR_BLOCK] = {};
+        assert(name.size() < 100);
+        std::memcpy(header, name.data(), name.size());
+        std::snprintf(header + 100, 8, "%07o", 0644);
+        std::snprintf(header + 108, 8, "%07o", 0);
+        std::snprintf(header + 116, 8, "%07o", 0);
+        std::snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(length));
+        std::snprintf(header + 136, 12, "%011o", 0);
+        header[156] = '0';
+        std::memcpy(header + 257, "ustar", 6);
+        std::memcpy(header + 263, "00", 2);
+
+        std::memset(header + 148, ' ', 8);
+        unsigned checksum = 0;
+        for (const char byte: header) {
+            checksum += static_cast<uchar>(byte);
+        }
+        std::snprintf(header + 148, 8, "%06o", checksum);
+
+        static const char padding[TAR_BLOCK] = {};
+        output.write(header, TAR_BLOCK);
+        output.write(data, static_cast<std::streamsize>(length));
+        output.write(padding, static_cast<std::streamsize>((TAR_BLOCK - length % TAR_BLOCK) % TAR_BLOCK));
+    }
+}
+
+/**
+ * @brief 缩小的倍数取宽高都不小于 minimum 的最大的一个
+ * @param minimum 之后要缩放到的大小, 空的时候按原始分辨率解码
+ */
+cv::Mat cnn::pipeline::decodeImage(const std::vector<uchar> &bytes, const cv::Size minimum) {
+    int flag = cv::IMREAD_COLOR;
+    const cv::Size size = minimum.empty() ? cv::Size() : jpegSize(bytes);
+    if (!size.empty()) {
+        const std::pair<int, int> reductions[] = {{8, cv::IMREAD_REDUCED_COLOR_8},
+                                                  {4, cv::IMREAD_REDUCED_COLOR_4},
+                                                  {2, cv::IMREAD_REDUCED_COLOR_2}};
+        for (const auto &[factor, reduced]: reductions) {
+            if (size.width / factor >= minimum.width && size.height / factor >= minimum.height) {
+                flag = reduced;
+                break;
+            }
+        }
+    }
+    return cv::imdecode(bytes, flag);
+}
+
+/**
+ * @brief 整个文件读进每个线程自己的缓冲区, 解析文件头和解码都在内存里完成, 只读一次文件
+ */
+cv::Mat cnn::pipeline::readImage(const std::string &path, const cv::Size minimum) {
+    if (minimum.empty()) {
+        return cv::imread(path);
+    }
+
+    thread_local std::vector<uchar> bytes;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return {};
+    }
+    bytes.resize(file.tellg());
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    return decodeImage(bytes, minimum);
+}
+
+const uchar *cnn::pipeline::DatasetSource::raw(const size_t, const uint32_t, const uint32_t) const {
+    return nullptr;
+}
+
+std::string cnn::pipeline::DatasetSource::key(const size_t) const {
+    return {};
+}
+
+void cnn::pipeline::DatasetSource::arrange(std::vector<size_t> &order, const Sampler &sampler,
+                                           const uint64_t epoch) const {
+    order = sampler.order(size(), epoch);
+}
+
+cv::Mat cnn::pipeline::DatasetSource::decodeAtLeast(const size_t index, const cv::Size) const {
+    return decode(index);
+}
+
+cnn::pipeline::FileSource::FileSource(listType images) : images_(std::move(images)) {}
+
+size_t cnn::pipeline::FileSource::size() const {
+    return this->images_.size();
+}
+
+int cnn::pipeline::FileSource::label(const size_t index) const {
+    return this->images_.at(index).second;
+}
+
+cv::Mat cnn::pipeline::FileSource::decode(const size_t index) const {
+    return cv::imread(this->images_.at(index).first);
+}
+
+cv::Mat cnn::pipeline::FileSource::decodeAtLeast(const size_t index, const cv::Size minimum) const {
+    return readImage(this->images_.at(index).first, minimum);
+}
+
+std::string cnn::pipeline::FileSource::key(const size_t index) const {
+    return this->images_.at(index).first;
+}
+
+/**
+ * @brief 每张图像的大小固定, 所有的偏移事先就能算出来. 先把文件扩展到最终的大小并映射,
+ * 再由线程池并行解码, 缩放之后直接写进各自的位置. 有图像读不出来时删除输出文件并抛出异常
+ * @param output 打包文件的路径, 已经存在时覆盖
+ * @param imageSize (height, width, channels), 和 DataLoader 的参数一致
+ */
+void cnn::pipeline::packDataset(const listType &images, const std::filesystem::path &output,
+                                const std::tuple<uint32_t, uint32_t, uint32_t> &imageSize) {
+    const auto [height, width, channels] = imageSize;
+    assert(channels == 3);
+
+    PackHeader header{};
+    std::memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version = PACK_VERSION;
+    header.count = images.size();
+    header.height = height;
+    header.width = width;
+    header.channels = channels;
+    header.dataOffset = alignUp(sizeof(PackHeader) + sizeof(PackEntry) * images.size());
+    header.stride = alignUp(static_cast<size_t>(height) * width * channels);
+    const size_t total = header.dataOffset + header.stride * header.count;
+
+    if (output.has_parent_path()) {
+        std::filesystem::create_directories(output.parent_path());
+    }
+    const int fd = ::open(output.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(total)) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw std::runtime_error("cannot create " + output.string());
+    }
+    void *mapped = ::mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + output.string());
+    }
+
+    auto *bytes = static_cast<uchar *>(mapped);
+    auto *entries = reinterpret_cast<PackEntry *>(bytes + sizeof(header));
+
+    // 读不出来的图像先记下来, 不能在线程池的任务里抛出异常
+    std::mutex failedMutex;
+    std::vector<std::string> failed;
+    runtime::parallelFor(images.size(), [&](const size_t i) {
+        entries[i] = {images[i].second, 0};
+
+        cv::Mat image = readImage(images[i].first, {static_cast<int>(width), static_cast<int>(height)});
+        if (image.empty()) {
+            std::lock_guard<std::mutex> lock(failedMutex);
+            failed.push_back(images[i].first);
+            return;
+        }
+        cv::Mat resized(static_cast<int>(height), static_cast<int>(width), CV_8UC3,
+                        bytes + header.dataOffset + header.stride * i);
+        cv::resize(image, resized, resized.size());
+    });
+
+    // 所有图像都写好之后才写文件头, 中途失败的文件不会被当成有效的打包文件
+    if (!failed.empty()) {
+        ::munmap(mapped, total);
+        std::filesystem::remove(output);
+        throw std::runtime_error("cannot read " + std::to_string(failed.size()) + " images while packing " +
+                                 output.string() + ", first: " + failed.front());
+    }
+    std::memcpy(bytes, &header, sizeof(header));
+
+    ::msync(mapped, total, MS_SYNC);
+    ::munmap(mapped, total);
+}
+
+cnn::pipeline::PackedSource::PackedSource(const std::filesystem::path &file) {
+    const int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + file.string());
+    }
+    this->mappedBytes_ = std::filesystem::file_size(file);
+    void *mapped = ::mmap(nullptr, this->mappedBytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + file.string());
+    }
+    this->mapped_ = static_cast<const uchar *>(mapped);
+
+    // 按顺序读取, 让内核提前读入后面的页
+    ::madvise(mapped, this->mappedBytes_, MADV_WILLNEED);
+
+    this->header_ = reinterpret_cast<const PackHeader *>(this->mapped_);
+    if (this->mappedBytes_ < sizeof(PackHeader) ||
+        std::memcmp(this->header_->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 ||
+        this->header_->version != PACK_VERSION ||
+        this->mappedBytes_ < this->header_->dataOffset + this->header_->stride * this->header_->count) {
+        ::munmap(mapped, this->mappedBytes_);
+        throw std::runtime_error(file.string() + " is not a valid pack file");
+    }
+    this->entries_ = reinterpret_cast<const PackEntry *>(this->mapped_ + sizeof(PackHeader));
+}
+
+cnn::pipeline::PackedSource::~PackedSource() {
+    if (this->mapped_ != nullptr) {
+        ::munmap(const_cast<uchar *>(this->mapped_), this->mappedBytes_);
+    }
+}
+
+size_t cnn::pipeline::PackedSource::size() const {
+    return this->header_->count;
+}
+
+int cnn::pipeline::PackedSource::label(const size_t index) const {
+    assert(index < size());
+    return this->entries_[index].label;
+}
+
+/**
+ * @brief 映射的内存是只读的, 数据增强需要原地修改, 这里返回一份拷贝
+ */
+cv::Mat cnn::pipeline::PackedSource::decode(const size_t index) const {
+    const cv::Mat mapped(static_cast<int>(this->header_->height), static_cast<int>(this->header_->width), CV_8UC3,
+                         const_cast<uchar *>(raw(index, this->header_->height, this->header_->width)));
+    return mapped.clone();
+}
+
+const uchar *cnn::pipeline::PackedSource::raw(const size_t index, const uint32_t height, const uint32_t width) const {
+    assert(index < size());
+    if (height != this->header_->height || width != this->header_->width) {
+        return nullptr;
+    }
+    return this->mapped_ + this->header_->dataOffset + this->header_->stride * index;
+}
+
+std::tuple<uint32_t, uint32_t, uint32_t> cnn::pipeline::PackedSource::imageSize() const {
+    return {this->header_->height, this->header_->width, this->header_->channels};
+}
+
+cnn::pipeline::DatasetManifest::DatasetManifest(std::filesystem::path dataset, std::vector<std::string> categories,
+                                                const std::pair<float, float> &ratios) :
+        dataset_(std::move(dataset)), categories_(std::move(categories)), ratios_(ratios) {}
+
+/**
+ * @brief 文本格式, 第一行是格式和版本, 之后是数据集目录, 划分比例和类别, 每张图像一行,
+ * 用制表符分隔, 路径放在最后
+ */
+cnn::pipeline::DatasetManifest cnn::pipeline::DatasetManifest::load(const std::filesystem::path &file) {
+    std::ifstream input(file);
+    std::string magic;
+    uint32_t version = 0;
+    input >> magic >> version;
+    if (!input || magic != MANIFEST_MAGIC || version != MANIFEST_VERSION) {
+        throw std::runtime_error(file.string() + " is not a valid manifest");
+    }
+
+    std::string dataset;
+    std::pair<float, float> ratios;
+    size_t numCategories = 0;
+    input >> std::quoted(dataset) >> ratios.first >> ratios.second >> numCategories;
+    std::vector<std::string> categories(numCategories);
+    for (auto &category: categories) {
+        input >> std::quoted(category);
+    }
+
+    DatasetManifest manifest(dataset, categories, ratios);
+    size_t count = 0;
+    input >> count;
+    manifest.entries_.resize(count);
+    for (auto &entry: manifest.entries_) {
+        input >> entry.split >> entry.label >> entry.bytes >> entry.modified >> entry.width >> entry.height
+              >> std::hex >> entry.hash >> std::dec;
+        input.ignore(1);
+        std::getline(input, entry.path);
+    }
+    if (!input) {
+        throw std::runtime_error(file.string() + " is truncated");
+    }
+    return manifest;
+}
+
+/**
+ * @brief 先写到临时文件再改名, 中途退出不会留下不完整的清单
+ */
+void cnn::pipeline::DatasetManifest::save(const std::filesystem::path &file) const {
+    if (file.has_parent_path()) {
+        std::filesystem::create_directories(file.parent_path());
+    }
+    auto temporary = file;
+    temporary += ".tmp";
+    {
+        std::ofstream output(temporary);
+        output << MANIFEST_MAGIC << ' ' << MANIFEST_VERSION << '\n'
+               << std::quoted(this->dataset_.string()) << ' ' << this->ratios_.first << ' ' << this->ratios_.second
+               << ' ' << this->categories_.size();
+        for (const auto &category: this->categories_) {
+            output << ' ' << std::quoted(category);
+        }
+        output << '\n' << this->entries_.size() << '\n';
+        for (const auto &entry: this->entries_) {
+            output << entry.split << '\t' << entry.label << '\t' << entry.bytes << '\t' << entry.modified << '\t'
+                   << entry.width << '\t' << entry.height << '\t' << std::hex << entry.hash << std::dec << '\t'
+                   << entry.path << '\n';
+        }
+        if (!output) {
+            throw std::runtime_error("cannot write " + temporary.string());
+        }
+    }
+    std::filesystem::rename(temporary, file);
+}
+
+/**
+ * @brief 大小和修改时间都没变的图像直接沿用清单中的记录, 其余的由线程池并行读取, 计算哈希,
+ * 从文件头解析宽高, 既不是 JPEG 也不是 PNG 时才完整解码一次
+ */
+size_t cnn::pipeline::DatasetManifest::update() {
+    std::map<std::string, ManifestEntry> previous;
+    for (auto &entry: this->entries_) {
+        previous.emplace(entry.path, std::move(entry));
+    }
+
+    std::vector<ManifestEntry> entries;
+    std::vector<size_t> changed;
+    for (size_t label = 0; label < this->categories_.size(); ++label) {
+        const auto dir = this->dataset_ / this->categories_[label];
+        if (!std::filesystem::is_directory(dir)) {
+            throw std::runtime_error(dir.string() + " does not exist");
+        }
+        for (const auto &item: std::filesystem::directory_iterator(dir)) {
+            if (!item.is_regular_file()) {
+                continue;
+            }
+            ManifestEntry entry{};
+            entry.path = (std::filesystem::path(this->categories_[label]) / item.path().filename()).string();
+            entry.label = static_cast<int>(label);
+            entry.bytes = item.file_size();
+            entry.modified = modifiedTime(item.path());
+
+            const auto old = previous.find(entry.path);
+            if (old != previous.end() && old->second.bytes == entry.bytes && old->second.modified == entry.modified) {
+                entry.width = old->second.width;
+                entry.height = old->second.height;
+                entry.hash = old->second.hash;
+            } else {
+                changed.push_back(entries.size());
+            }
+            entries.push_back(std::move(entry));
+        }
+    }
+
+    runtime::parallelFor(changed.size(), [&](const size_t i) {
+        auto &entry = entries[changed[i]];
+        std::ifstream file(this->dataset_ / entry.path, std::ios::binary);
+        std::vector<uchar> bytes(entry.bytes);
+        file.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        entry.hash = fnv1a(bytes.data(), bytes.size());
+
+        cv::Size size = jpegSize(bytes);
+        if (size.empty()) {
+            size = pngSize(bytes);
+        }
+        if (size.empty()) {
+            size = cv::imdecode(bytes, cv::IMREAD_COLOR).size();
+        }
+        entry.width = size.width;
+        entry.height = size.height;
+    });
+
+    for (auto &entry: entries) {
+        entry.split = assignSplit(entry.path, this->ratios_);
+    }
+    std::sort(entries.begin(), entries.end(), [](const ManifestEntry &a, const ManifestEntry &b) {
+        return a.path < b.path;
+    });
+    this->entries_ = std::move(entries);
+    return changed.size();
+}
+
+bool cnn::pipeline::DatasetManifest::matches(const std::filesystem::path &dataset,
+                                             const std::vector<std::string> &categories,
+                                             const std::pair<float, float> &ratios) const {
+    // 比例经过文本往返, 按保存的精度比较
+    return this->dataset_ == dataset && this->categories_ == categories &&
+           std::abs(this->ratios_.first - ratios.first) < 1e-6 && std::abs(this->ratios_.second - ratios.second) < 1e-6;
+}
+
+std::map<std::string, cnn::pipeline::listType> cnn::pipeline::DatasetManifest::splits() const {
+    std::map<std::string, listType> results{{"train", {}},
+                                            {"test",  {}},
+                                            {"valid", {}}};
+    for (const auto &entry: this->entries_) {
+        results[entry.split].emplace_back((this->dataset_ / entry.path).string(), entry.label);
+    }
+    return results;
+}
+
+const std::vector<cnn::pipeline::ManifestEntry> &cnn::pipeline::DatasetManifest::entries() const {
+    return this->entries_;
+}
+
+/**
+ * @brief 图像原样写进分片, key 是图像在列表中的序号, 类别写成 key.cls
+ * @param directory 分片所在的目录, 分片命名为 shard-000000.tar
+ */
+std::vector<std::filesystem::path> cnn::pipeline::writeShards(const listType &images,
+                                                              const std::filesystem::path &directory,
+                                                              const size_t perShard) {
+    assert(perShard > 0);
+    std::filesystem::create_directories(directory);
+    std::vector<std::filesystem::path> shards;
+    std::ofstream output;
+    std::vector<char> bytes;
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (i % perShard == 0) {
+            if (output.is_open()) {
+                // 两个全零的块表示结束
+                output.write(std::vector<char>(2 * TAR_BLOCK).data(), 2 * TAR_BLOCK);
+                output.close();
+            }
+            char name[32];
+            std::snprintf(name, sizeof(name), "shard-%06zu.tar", shards.size());
+            shards.push_back(directory / name);
+            output.open(shards.back(), std::ios::binary | std::ios::trunc);
+            if (!output) {
+                throw std::runtime_error("cannot create " + shards.back().string());
+            }
+        }
+
+        const std::filesystem::path path(images[i].first);
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            throw std::runtime_error("cannot read " + path.string());
+        }
+        bytes.resize(file.tellg());
+        file.seekg(0);
+        file.read(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+
+        char key[16];
+        std::snprintf(key, sizeof(key), "%08zu", i);
+        std::string extension = path.extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        const std::string label = std::to_string(images[i].second);
+        writeTarMember(output, key + extension, bytes.data(), bytes.size());
+        writeTarMember(output, std::string(key) + ".cls", label.data(), label.size());
+    }
+    if (output.is_open()) {
+        output.write(std::vector<char>(2 * TAR_BLOCK).data(), 2 * TAR_BLOCK);
+    }
+    return shards;
+}
+
+/**
+ * @brief 只读取每个成员的文件头和 .cls 的内容, 图像的数据直接跳过. 缺少图像或者类别的 key 被忽略
+ * @param bufferSize 打乱用的缓冲区中最多的图像数目, 同时也是顺序读取时提前读进内存的图像数目
+ */
+cnn::pipeline::TarShardSource::TarShardSource(std::vector<std::filesystem::path> shards, const size_t bufferSize) :
+        shards_(std::move(shards)), bufferSize_(std::max<size_t>(bufferSize, 1)),
+        streamBuffer_(new char[STREAM_BUFFER]) {
+    for (uint32_t shard = 0; shard < this->shards_.size(); ++shard) {
+        std::ifstream input(this->shards_[shard], std::ios::binary);
+        if (!input) {
+            throw std::runtime_error("cannot open " + this->shards_[shard].string());
+        }
+        const size_t first = this->members_.size();
+
+        std::string key;
+        Member current{shard, 0, 0, -1};
+        auto flush = [&]() {
+            if (!key.empty() && current.bytes > 0 && current.label >= 0) {
+                this->members_.push_back(current);
+            }
+            current = {shard, 0, 0, -1};
+        };
+
+        char header[TAR_BLOCK];
+        uint64_t offset = 0;
+        while (input.read(header, TAR_BLOCK) && header[0] != '\0') {
+            offset += TAR_BLOCK;
+            const uint64_t length = parseOctal(header + 124, 12);
+            const uint64_t padded = (length + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+            // 普通文件, 其它类型的成员 (目录, pax 扩展头) 直接跳过
+            if (header[156] == '0' || header[156] == '\0') {
+                std::string name(header, strnlen(header, 100));
+                if (std::memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') {
+                    name = std::string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+                }
+                const size_t slash = name.rfind('/');
+                const size_t dot = name.find('.', slash == std::string::npos ? 0 : slash + 1);
+                if (dot != std::string::npos) {
+                    if (name.compare(0, dot, key) != 0) {
+                        flush();
+                        key = name.substr(0, dot);
+                    }
+                    std::string extension = name.substr(dot + 1);
+                    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+                    if (extension == "jpg" || extension == "jpeg" || extension == "png") {
+                        current.offset = offset;
+                        current.bytes = length;
+                    } else if (extension == "cls") {
+                        std::string text(length, '\0');
+                        input.read(text.data(), static_cast<std::streamsize>(length));
+                        current.label = parseLabel(text, this->shards_[shard], name);
+                    }
+                }
+            }
+            offset += padded;
+            input.seekg(static_cast<std::streamoff>(offset));
+        }
+        flush();
+        this->ranges_.emplace_back(first, this->members_.size());
+    }
+
+    // 第一轮按给定的分片顺序读取, 和 DataLoader 初始的顺序一致
+    std::vector<size_t> pass(this->members_.size());
+    std::iota(pass.begin(), pass.end(), size_t(0));
+    startPass_(std::move(pass));
+}
+
+size_t cnn::pipeline::TarShardSource::size() const {
+    return this->members_.size();
+}
+
+int cnn::pipeline::TarShardSource::label(const size_t index) const {
+    return this->members_.at(index).label;
+}
+
+cv::Mat cnn::pipeline::TarShardSource::decode(const size_t index) const {
+    return decodeAtLeast(index, {});
+}
+
+/**
+ * @brief 这一轮还没有读到的样本, 顺序读取直到把它读进内存, 经过的样本留在缓冲区里等待之后取走.
+ * 不在这一轮中的样本 (例如分给了其它读取者) 单独定位读取. 读取在锁内完成, 解码在锁外进行
+ */
+cv::Mat cnn::pipeline::TarShardSource::decodeAtLeast(const size_t index, const cv::Size minimum) const {
+    std::vector<uchar> bytes;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        auto found = this->buffer_.find(index);
+        const size_t position = this->passPosition_.at(index);
+        if (found == this->buffer_.end() && position != NOT_IN_PASS && position >= this->cursor_) {
+            while (this->cursor_ <= position) {
+                readNext_();
+            }
+            found = this->buffer_.find(index);
+        }
+        if (found != this->buffer_.end()) {
+            bytes = std::move(found->second.bytes);
+            this->buffer_.erase(found);
+        } else {
+            ++this->randomReads_;
+        }
+    }
+    if (bytes.empty()) {
+        bytes = readAt_(index);
+    }
+    return decodeImage(bytes, minimum);
+}
+
+void cnn::pipeline::TarShardSource::readNext_() const {
+    const size_t index = this->pass_[this->cursor_++];
+    const Member &member = this->members_[index];
+
+    // 换到下一个分片, 或者这一轮重新开始
+    if (this->streamShard_ != member.shard || this->streamOffset_ > member.offset) {
+        this->stream_.close();
+        this->stream_.clear();
+        this->stream_.rdbuf()->pubsetbuf(this->streamBuffer_.get(), STREAM_BUFFER);
+        this->stream_.open(this->shards_[member.shard], std::ios::binary);
+        if (!this->stream_) {
+            throw std::runtime_error("cannot open " + this->shards_[member.shard].string());
+        }
+        this->streamShard_ = member.shard;
+        this->streamOffset_ = 0;
+    }
+
+    // 中间的文件头和 .cls 从读入的大块中跳过, 不做 seek
+    this->stream_.ignore(static_cast<std::streamsize>(member.offset - this->streamOffset_));
+    std::vector<uchar> bytes(member.bytes);
+    this->stream_.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    this->streamOffset_ = member.offset + member.bytes;
+    this->buffer_[index] = {this->generation_, std::move(bytes)};
+}
+
+std::vector<uchar> cnn::pipeline::TarShardSource::readAt_(const size_t index) const {
+    const Member &member = this->members_.at(index);
+    std::ifstream input(this->shards_[member.shard], std::ios::binary);
+    input.seekg(static_cast<std::streamoff>(member.offset));
+    std::vector<uchar> bytes(member.bytes);
+    input.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    return bytes;
+}
+
+/**
+ * @brief 预取时新的一轮开始之后, 解码线程可能还在处理上一轮领取的样本. 上一轮剩下没读的样本不多时
+ * 先顺序读完, 读进缓冲区的样本保留到下一轮结束, 再早的才丢掉. 上一轮没读完并且剩下很多, 说明这些样本
+ * 不会再被请求 (例如已经在解码缓存中), 不再读取; 万一有人要, 单独定位读取
+ */
+void cnn::pipeline::TarShardSource::startPass_(std::vector<size_t> pass) const {
+    if (this->cursor_ > 0 && this->pass_.size() - this->cursor_ <= this->bufferSize_) {
+        while (this->cursor_ < this->pass_.size()) {
+            readNext_();
+        }
+    }
+    ++this->generation_;
+    for (auto it = this->buffer_.begin(); it != this->buffer_.end();) {
+        if (it->second.generation + 1 < this->generation_) {
+            it = this->buffer_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // 分给多个读取者时这一轮只包含自己的样本, 其它样本的位置是 NOT_IN_PASS
+    this->passPosition_.assign(this->members_.size(), NOT_IN_PASS);
+    for (size_t i = 0; i < pass.size(); ++i) {
+        this->passPosition_[pass[i]] = i;
+    }
+    this->pass_ = std::move(pass);
+    this->cursor_ = 0;
+    this->streamShard_ = -1;
+}
+
+/**
+ * @brief 读取顺序是分片内的文件顺序, 打乱只发生在缓冲区内: 缓冲区满了之后每读入一个样本,
+ * 就从缓冲区中随机取出一个放进 order. Sequential 时按给定的分片顺序读取. 多个读取者按分片划分
+ */
+void cnn::pipeline::TarShardSource::arrange(std::vector<size_t> &order, const Sampler &sampler,
+                                            const uint64_t epoch) const {
+    auto engine = sampler.engine(epoch);
+    const bool shuffle = sampler.mode() != SampleMode::Sequential;
+    const auto shards = sampler.blocks(this->shards_.size(), engine);
+
+    std::vector<size_t> pass;
+    pass.reserve(this->members_.size());
+    for (const size_t shard: shards) {
+        for (size_t i = this->ranges_[shard].first; i < this->ranges_[shard].second; ++i) {
+            pass.push_back(i);
+        }
+    }
+
+    order.clear();
+    if (shuffle) {
+        std::vector<size_t> window;
+        window.reserve(this->bufferSize_);
+        for (const size_t index: pass) {
+            if (window.size() < this->bufferSize_) {
+                window.push_back(index);
+                continue;
+            }
+            std::uniform_int_distribution<size_t> pick(0, window.size() - 1);
+            auto &slot = window[pick(engine)];
+            order.push_back(slot);
+            slot = index;
+        }
+        std::shuffle(window.begin(), window.end(), engine);
+        order.insert(order.end(), window.begin(), window.end());
+    } else {
+        order = pass;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    startPass_(std::move(pass));
+}
+
+std::string cnn::pipeline::TarShardSource::key(const size_t index) const {
+    const Member &member = this->members_.at(index);
+    return this->shards_[member.shard].string() + ":" + std::to_string(member.offset);
+}
+
+size_t cnn::pipeline::TarShardSource::randomReads() const {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->randomReads_;
+}
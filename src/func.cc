@@ -12,14 +12,13 @@ inline cnn::dataType __exp(const cnn::dataType x) {
     return std::exp(x);
 }
 
-std::vector<cnn::tensor> softMax(const std::vector<cnn::tensor> &input) {
-    const int batchSize = input.size();
-    const int numOfClasses = input.front()->length();
-    std::vector<cnn::tensor> output;
-    output.reserve(batchSize);
+cnn::Tensor4D softMax(const cnn::Tensor4D &input) {
+    const int batchSize = input.getBatch();
+    const int numOfClasses = input.sampleLength();
+    cnn::Tensor4D output(batchSize, numOfClasses, 1, 1, "probs");
 
     for (int b = 0; b < batchSize; ++b) {
-        cnn::tensor probs = std::make_shared<cnn::Tensor3D>(numOfClasses);
+        const cnn::tensor &probs = output.at(b);
         // 首先计算输出的最大值，防止溢出
         const cnn::dataType maxValue = input.at(b)->max();
         cnn::dataType sumValue = 0;
@@ -34,51 +33,105 @@ std::vector<cnn::tensor> softMax(const std::vector<cnn::tensor> &input) {
                 probs->getData()[i] = 0.f;
             }
         }
-        output.emplace_back(std::move(probs));
     }
 
     return output;
 }
 
-std::vector<cnn::tensor> oneHot(const std::vector<int> &labels, const int numOfClasses) {
+cnn::Tensor4D oneHot(const std::vector<int> &labels, const int numOfClasses) {
     const int batchSize = labels.size();
-    std::vector<cnn::tensor> oneHotCode;
-    oneHotCode.reserve(batchSize);
+    cnn::Tensor4D oneHotCode(batchSize, numOfClasses, 1, 1, "one_hot");
+    oneHotCode.setZero();
 
     for (int b = 0; b < batchSize; ++b) {
-        cnn::tensor sample = std::make_shared<cnn::Tensor3D>(numOfClasses);
-        sample->setZero();
-
         assert(labels.at(b) >= 0 && labels.at(b) < numOfClasses);
-        sample->getData()[labels[b]] = 1.0;
-        oneHotCode.emplace_back(sample);
+        oneHotCode.data(b)[labels[b]] = 1.0;
     }
 
     return oneHotCode;
 }
 
-std::pair<cnn::dataType, std::vector<cnn::tensor>>
-crossEntropyBackward(const std::vector<cnn::tensor> &probs, const std::vector<cnn::tensor> &labels) {
+std::pair<cnn::dataType, cnn::Tensor4D>
+crossEntropyBackward(const cnn::Tensor4D &probs, const cnn::Tensor4D &labels) {
     //最小化KL散度等同于最小化交叉熵。
-    const int batchSize = labels.size();
-    const int numOfClasses = probs.front()->length();
-
-    std::vector<cnn::tensor> delta;
+    const int batchSize = labels.getBatch();
+    const int numOfClasses = probs.sampleLength();
 
-    delta.reserve(batchSize); //预分配内存
+    cnn::Tensor4D delta(batchSize, numOfClasses, 1, 1, "delta_from_loss");
 
     cnn::dataType lossValue = 0;
     for (int b = 0; b < batchSize; ++b) {
-        cnn::tensor piece = std::make_shared<cnn::Tensor3D>(numOfClasses);
+        cnn::dataType *piece = delta.data(b);
         for (int i = 0; i < numOfClasses; ++i) {
-            piece->getData()[i] = probs.at(b)->getData()[i] - labels.at(b)->getData()[i];
-            lossValue += std::log(probs.at(b)->getData()[i]) * labels.at(b)->getData()[i];
+            piece[i] = probs.data(b)[i] - labels.data(b)[i];
+            lossValue += std::log(probs.data(b)[i]) * labels.data(b)[i];
         }
-        delta.emplace_back(piece);
     }
 
     lossValue = lossValue * (-1.0) / batchSize;
-    return {lossValue, delta};
+    return {lossValue, std::move(delta)};
+}
+
+/**
+ * @brief log(prob_i) = z_i - max - log(sum_j exp(z_j - max)), 减去最大值之后指数不会上溢,
+ * 最大的一项是 exp(0) = 1, 求和也不会下溢到 0. 每个样本只遍历一遍 logits 求最大值和类别,
+ * 再遍历一遍求指数, 指数直接写进 delta 之后归一化
+ * @param logits 网络的输出, batch x numOfClasses
+ * @param labels 每个样本的类别
+ * @param predict 每个样本的预测类别
+ * @param delta 对 logits 的梯度, 为空时只计算损失
+ * @return 平均的交叉熵
+ */
+cnn::dataType softmaxCrossEntropy(const cnn::Tensor4D &logits, const std::vector<int> &labels,
+                                  std::vector<int> &predict, cnn::Tensor4D *delta) {
+    const int batchSize = logits.getBatch();
+    const int numOfClasses = logits.sampleLength();
+    assert(labels.size() == static_cast<size_t>(batchSize));
+
+    if (delta != nullptr && (delta->getBatch() != static_cast<uint32_t>(batchSize) ||
+                             delta->sampleShape() != logits.sampleShape())) {
+        *delta = cnn::Tensor4D(batchSize, logits.sampleShape(), "delta_from_loss");
+    }
+    predict.resize(batchSize);
+
+    // batch 很大时逐个累加的舍入误差也不小, 用 double 累加
+    double lossValue = 0;
+    for (int b = 0; b < batchSize; ++b) {
+        assert(labels[b] >= 0 && labels[b] < numOfClasses);
+        const cnn::dataType *z = logits.data(b);
+
+        cnn::dataType maxValue = z[0];
+        int index = 0;
+        for (int i = 1; i < numOfClasses; ++i) {
+            if (z[i] > maxValue) {
+                maxValue = z[i];
+                index = i;
+            }
+        }
+        predict[b] = index;
+
+        cnn::dataType *piece = delta != nullptr ? delta->data(b) : nullptr;
+        double sumValue = 0;
+        for (int i = 0; i < numOfClasses; ++i) {
+            const cnn::dataType e = std::exp(z[i] - maxValue);
+            sumValue += e;
+            if (piece != nullptr) {
+                piece[i] = e;
+            }
+        }
+
+        lossValue += maxValue + std::log(sumValue) - z[labels[b]];
+
+        if (piece != nullptr) {
+            const auto inverse = static_cast<cnn::dataType>(1.0 / sumValue);
+            for (int i = 0; i < numOfClasses; ++i) {
+                piece[i] *= inverse;
+            }
+            piece[labels[b]] -= 1;
+        }
+    }
+
+    return static_cast<cnn::dataType>(lossValue / batchSize);
 }
 
 std::string floatToString(const float value, const int precision) {
@@ -0,0 +1,373 @@
+#include<gemm.hpp>
+#include<runtime.hpp>
+#include<algorithm>
+#include<vector>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include<immintrin.h>
+#endif
+
+namespace {
+    using cnn::dataType;
+
+    // 寄存器分块：每次微内核计算 MR x NR 的 C 子块
+    constexpr int MR = 6;
+    constexpr int NR = 16;
+
+    // 缓存分块：A 的 MC x KC 块放在 L2, B 的 KC x NR 条带放在 L1
+    constexpr int MC = 120;
+    constexpr int KC = 256;
+    constexpr int NC = 2048;
+
+    // 计算量小于这个值(乘加次数)的矩阵乘法不切分, 直接在当前线程计算
+    constexpr size_t PARALLEL_FLOPS = 1 << 18;
+
+    // im2col/col2im 每块至少处理的元素个数
+    constexpr size_t PARALLEL_ELEMENTS = 1 << 14;
+
+    size_t channelGrain(const size_t channelLength) {
+        return std::max<size_t>(1, PARALLEL_ELEMENTS / std::max<size_t>(channelLength, 1));
+    }
+
+    /**
+     * @brief 把 op(A) 的 mc x kc 子块打包成若干个 MR 行的条带, 条带内按列存放, 不足 MR 的部分补零
+     */
+    void packA(const bool transA, const dataType *A, const int lda, const int i0, const int p0,
+               const int mc, const int kc, dataType *buffer) {
+        for (int i = 0; i < mc; i += MR) {
+            const int mr = std::min(MR, mc - i);
+            for (int p = 0; p < kc; ++p) {
+                for (int r = 0; r < MR; ++r) {
+                    if (r < mr) {
+                        const int row = i0 + i + r;
+                        const int col = p0 + p;
+                        buffer[r] = transA ? A[col * lda + row] : A[row * lda + col];
+                    } else {
+                        buffer[r] = 0;
+                    }
+                }
+                buffer += MR;
+            }
+        }
+    }
+
+    /**
+     * @brief 把 op(B) 的 kc x nc 子块打包成若干个 NR 列的条带, 条带内按行存放, 不足 NR 的部分补零
+     */
+    void packB(const bool transB, const dataType *B, const int ldb, const int p0, const int j0,
+               const int kc, const int nc, dataType *buffer) {
+        for (int j = 0; j < nc; j += NR) {
+            const int nr = std::min(NR, nc - j);
+            if (!transB) {
+                for (int p = 0; p < kc; ++p) {
+                    const dataType *src = B + (p0 + p) * ldb + j0 + j;
+                    int c = 0;
+                    for (; c < nr; ++c) {
+                        buffer[c] = src[c];
+                    }
+                    for (; c < NR; ++c) {
+                        buffer[c] = 0;
+                    }
+                    buffer += NR;
+                }
+            } else {
+                // 转置的情况下按源矩阵的行去读, 保证读取是连续的
+                for (int c = 0; c < NR; ++c) {
+                    const dataType *src = B + (j0 + j + c) * ldb + p0;
+                    for (int p = 0; p < kc; ++p) {
+                        buffer[p * NR + c] = (c < nr) ? src[p] : 0;
+                    }
+                }
+                buffer += kc * NR;
+            }
+        }
+    }
+
+    /**
+     * @brief 微内核, C[mr x nr] += alpha * a[MR x kc] * b[kc x NR]
+     */
+    void microKernel(const int kc, const dataType *a, const dataType *b, dataType *C, const int ldc,
+                     const int mr, const int nr, const dataType alpha) {
+        alignas(32) dataType acc[MR][NR];
+#if defined(__AVX2__) && defined(__FMA__)
+        __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+        __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+        __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+        __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+        __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+        __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+        for (int p = 0; p < kc; ++p) {
+            const __m256 b0 = _mm256_loadu_ps(b);
+            const __m256 b1 = _mm256_loadu_ps(b + 8);
+            __m256 av;
+
+            av = _mm256_broadcast_ss(a);
+            c00 = _mm256_fmadd_ps(av, b0, c00);
+            c01 = _mm256_fmadd_ps(av, b1, c01);
+            av = _mm256_broadcast_ss(a + 1);
+            c10 = _mm256_fmadd_ps(av, b0, c10);
+            c11 = _mm256_fmadd_ps(av, b1, c11);
+            av = _mm256_broadcast_ss(a + 2);
+            c20 = _mm256_fmadd_ps(av, b0, c20);
+            c21 = _mm256_fmadd_ps(av, b1, c21);
+            av = _mm256_broadcast_ss(a + 3);
+            c30 = _mm256_fmadd_ps(av, b0, c30);
+            c31 = _mm256_fmadd_ps(av, b1, c31);
+            av = _mm256_broadcast_ss(a + 4);
+            c40 = _mm256_fmadd_ps(av, b0, c40);
+            c41 = _mm256_fmadd_ps(av, b1, c41);
+            av = _mm256_broadcast_ss(a + 5);
+            c50 = _mm256_fmadd_ps(av, b0, c50);
+            c51 = _mm256_fmadd_ps(av, b1, c51);
+
+            a += MR;
+            b += NR;
+        }
+
+        if (mr == MR && nr == NR) {
+            // 完整的块直接在寄存器里完成累加
+            const __m256 alphaV = _mm256_set1_ps(alpha);
+            const __m256 rows[MR][2] = {{c00, c01}, {c10, c11}, {c20, c21},
+                                        {c30, c31}, {c40, c41}, {c50, c51}};
+            for (int r = 0; r < MR; ++r) {
+                dataType *dst = C + r * ldc;
+                _mm256_storeu_ps(dst, _mm256_fmadd_ps(alphaV, rows[r][0], _mm256_loadu_ps(dst)));
+                _mm256_storeu_ps(dst + 8, _mm256_fmadd_ps(alphaV, rows[r][1], _mm256_loadu_ps(dst + 8)));
+            }
+            return;
+        }
+
+        _mm256_store_ps(acc[0], c00);
+        _mm256_store_ps(acc[0] + 8, c01);
+        _mm256_store_ps(acc[1], c10);
+        _mm256_store_ps(acc[1] + 8, c11);
+        _mm256_store_ps(acc[2], c20);
+        _mm256_store_ps(acc[2] + 8, c21);
+        _mm256_store_ps(acc[3], c30);
+        _mm256_store_ps(acc[3] + 8, c31);
+        _mm256_store_ps(acc[4], c40);
+        _mm256_store_ps(acc[4] + 8, c41);
+        _mm256_store_ps(acc[5], c50);
+        _mm256_store_ps(acc[5] + 8, c51);
+#else
+        for (int r = 0; r < MR; ++r) {
+            for (int c = 0; c < NR; ++c) {
+                acc[r][c] = 0;
+            }
+        }
+
+        for (int p = 0; p < kc; ++p) {
+            for (int r = 0; r < MR; ++r) {
+                const dataType av = a[r];
+                for (int c = 0; c < NR; ++c) {
+                    acc[r][c] += av * b[c];
+                }
+            }
+            a += MR;
+            b += NR;
+        }
+#endif
+        for (int r = 0; r < mr; ++r) {
+            dataType *dst = C + r * ldc;
+            for (int c = 0; c < nr; ++c) {
+                dst[c] += alpha * acc[r][c];
+            }
+        }
+    }
+
+    /**
+     * @brief 单线程的分块矩阵乘法 C = alpha * op(A) * op(B) + beta * C, 所有矩阵均为行主序
+     * @param transA A 是否转置
+     * @param transB B 是否转置
+     * @param M op(A) 和 C 的行数
+     * @param N op(B) 和 C 的列数
+     * @param K op(A) 的列数, op(B) 的行数
+     * @param lda A 的行跨度
+     * @param ldb B 的行跨度
+     * @param ldc C 的行跨度
+     */
+    void serialSgemm(const bool transA, const bool transB, const int M, const int N, const int K,
+                     const dataType alpha, const dataType *A, const int lda, const dataType *B, const int ldb,
+                     const dataType beta, dataType *C, const int ldc) {
+        if (M <= 0 || N <= 0) {
+            return;
+        }
+
+        // 先处理 beta, 之后所有的分块都只做累加
+        if (beta != 1) {
+            for (int i = 0; i < M; ++i) {
+                dataType *row = C + i * ldc;
+                if (beta == 0) {
+                    std::fill(row, row + N, dataType(0));
+                } else {
+                    for (int j = 0; j < N; ++j) {
+                        row[j] *= beta;
+                    }
+                }
+            }
+        }
+
+        if (K <= 0 || alpha == 0) {
+            return;
+        }
+
+        // 打包缓冲区每个线程一份，避免重复分配
+        thread_local std::vector<dataType> packedA;
+        thread_local std::vector<dataType> packedB;
+        packedA.resize(static_cast<size_t>((MC + MR - 1) / MR * MR) * KC);
+        packedB.resize(static_cast<size_t>(KC) * ((NC + NR - 1) / NR * NR));
+
+        for (int jc = 0; jc < N; jc += NC) {
+            const int nc = std::min(NC, N - jc);
+
+            for (int pc = 0; pc < K; pc += KC) {
+                const int kc = std::min(KC, K - pc);
+                packB(transB, B, ldb, pc, jc, kc, nc, packedB.data());
+
+                for (int ic = 0; ic < M; ic += MC) {
+                    const int mc = std::min(MC, M - ic);
+                    packA(transA, A, lda, ic, pc, mc, kc, packedA.data());
+
+                    for (int jr = 0; jr < nc; jr += NR) {
+                        const int nr = std::min(NR, nc - jr);
+                        for (int ir = 0; ir < mc; ir += MR) {
+                            const int mr = std::min(MR, mc - ir);
+                            microKernel(kc, packedA.data() + ir * kc, packedB.data() + jr * kc,
+                                        C + (ic + ir) * ldc + jc + jr, ldc, mr, nr, alpha);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief 分块的单精度矩阵乘法 C = alpha * op(A) * op(B) + beta * C, 所有矩阵均为行主序.
+ * 计算量足够大时把 C 切成若干个互不重叠的子块, 由线程池并行计算, 每个子块内部仍然是串行的分块乘法
+ * @param transA A 是否转置
+ * @param transB B 是否转置
+ * @param M op(A) 和 C 的行数
+ * @param N op(B) 和 C 的列数
+ * @param K op(A) 的列数, op(B) 的行数
+ */
+void cnn::kernels::sgemm(const bool transA, const bool transB, const int M, const int N, const int K,
+                         const dataType alpha, const dataType *A, const int lda, const dataType *B, const int ldb,
+                         const dataType beta, dataType *C, const int ldc) {
+    const int threads = runtime::getNumThreads();
+    if (M <= 0 || N <= 0 || threads == 1 ||
+        static_cast<size_t>(M) * N * std::max(K, 1) < PARALLEL_FLOPS) {
+        serialSgemm(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+        return;
+    }
+
+    // 子块先按 MC 行 x 256 列划分, 块数不够每个线程分到两块时再把列和行依次减半
+    int rowsPerBlock = MC;
+    int colsPerBlock = 256;
+    auto blockCount = [&]() {
+        return ((M + rowsPerBlock - 1) / rowsPerBlock) * ((N + colsPerBlock - 1) / colsPerBlock);
+    };
+    while (blockCount() < 2 * threads && colsPerBlock > 4 * NR) {
+        colsPerBlock /= 2;
+    }
+    while (blockCount() < 2 * threads && rowsPerBlock > 4 * MR) {
+        rowsPerBlock /= 2;
+    }
+
+    const int rowBlocks = (M + rowsPerBlock - 1) / rowsPerBlock;
+    const int colBlocks = (N + colsPerBlock - 1) / colsPerBlock;
+    runtime::parallelFor(static_cast<size_t>(rowBlocks) * colBlocks, [&](const size_t block) {
+        const int i0 = static_cast<int>(block / colBlocks) * rowsPerBlock;
+        const int j0 = static_cast<int>(block % colBlocks) * colsPerBlock;
+        const dataType *a = transA ? A + i0 : A + i0 * lda;
+        const dataType *b = transB ? B + j0 * ldb : B + j0;
+        serialSgemm(transA, transB, std::min(rowsPerBlock, M - i0), std::min(colsPerBlock, N - j0), K, alpha,
+                    a, lda, b, ldb, beta, C + i0 * ldc + j0, ldc);
+    });
+}
+
+/**
+ * @brief im2col 展开, 第 (c*k*k + kx*k + ky) 行存放卷积核在 (c, kx, ky) 位置上对应的所有输入像素.
+ * 不同通道展开出的行互不重叠, 按通道并行
+ * @param image 输入图像 channels x height x width
+ * @param columns 输出矩阵 (channels*kernelSize*kernelSize) x (outHeight*outWidth)
+ */
+void cnn::kernels::im2col(const dataType *image, const int channels, const int height, const int width,
+                          const int kernelSize, const int stride, const int padding, dataType *columns) {
+    const int outHeight = (height + 2 * padding - kernelSize) / stride + 1;
+    const int outWidth = (width + 2 * padding - kernelSize) / stride + 1;
+    const size_t channelLength = static_cast<size_t>(kernelSize) * kernelSize * outHeight * outWidth;
+
+    runtime::parallelFor(0, channels, channelGrain(channelLength), [&](const size_t begin, const size_t end) {
+        for (size_t c = begin; c < end; ++c) {
+            const dataType *plane = image + c * height * width;
+            dataType *dst = columns + c * channelLength;
+            for (int kx = 0; kx < kernelSize; ++kx) {
+                for (int ky = 0; ky < kernelSize; ++ky) {
+                    for (int oy = 0; oy < outHeight; ++oy) {
+                        const int iy = oy * stride - padding + kx;
+                        dataType *row = dst + oy * outWidth;
+
+                        if (iy < 0 || iy >= height) {
+                            std::fill(row, row + outWidth, dataType(0));
+                            continue;
+                        }
+
+                        const dataType *src = plane + iy * width;
+                        if (stride == 1 && padding == 0) {
+                            std::copy(src + ky, src + ky + outWidth, row);
+                            continue;
+                        }
+
+                        for (int ox = 0; ox < outWidth; ++ox) {
+                            const int ix = ox * stride - padding + ky;
+                            row[ox] = (ix >= 0 && ix < width) ? src[ix] : 0;
+                        }
+                    }
+                    dst += outHeight * outWidth;
+                }
+            }
+        }
+    });
+}
+
+/**
+ * @brief col2im, 把展开矩阵中的每个元素累加回它在 im2col 时来自的输入位置, 调用前需要先把 image 清零.
+ * 每个通道只写自己的平面, 按通道并行不需要同步
+ * @param columns 展开矩阵 (channels*kernelSize*kernelSize) x (outHeight*outWidth)
+ * @param image 输出图像 channels x height x width
+ */
+void cnn::kernels::col2im(const dataType *columns, const int channels, const int height, const int width,
+                          const int kernelSize, const int stride, const int padding, dataType *image) {
+    const int outHeight = (height + 2 * padding - kernelSize) / stride + 1;
+    const int outWidth = (width + 2 * padding - kernelSize) / stride + 1;
+    const size_t channelLength = static_cast<size_t>(kernelSize) * kernelSize * outHeight * outWidth;
+
+    runtime::parallelFor(0, channels, channelGrain(channelLength), [&](const size_t begin, const size_t end) {
+        for (size_t c = begin; c < end; ++c) {
+            dataType *plane = image + c * height * width;
+            const dataType *src = columns + c * channelLength;
+            for (int kx = 0; kx < kernelSize; ++kx) {
+                for (int ky = 0; ky < kernelSize; ++ky) {
+                    for (int oy = 0; oy < outHeight; ++oy) {
+                        const int iy = oy * stride - padding + kx;
+                        if (iy < 0 || iy >= height) {
+                            continue;
+                        }
+
+                        const dataType *row = src + oy * outWidth;
+                        dataType *dst = plane + iy * width;
+                        for (int ox = 0; ox < outWidth; ++ox) {
+                            const int ix = ox * stride - padding + ky;
+                            if (ix >= 0 && ix < width) {
+                                dst[ix] += row[ox];
+                            }
+                        }
+                    }
+                    src += outHeight * outWidth;
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,57 @@
+#include<image_cache.hpp>
+
+cnn::pipeline::ImageCache::ImageCache(const size_t capacityBytes) : capacity_(capacityBytes) {}
+
+/**
+ * @brief 命中的图像移到最前面. 训练集数据增强时要求的尺寸比验证集大, 验证集缓存的图像不能给训练集用
+ */
+cv::Mat cnn::pipeline::ImageCache::find(const std::string &key, const cv::Size minimum) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    const auto found = this->index_.find(key);
+    if (found == this->index_.end() || found->second->minimum.width < minimum.width ||
+        found->second->minimum.height < minimum.height) {
+        ++this->stats_.misses;
+        return {};
+    }
+    ++this->stats_.hits;
+    this->entries_.splice(this->entries_.begin(), this->entries_, found->second);
+    return found->second->image;
+}
+
+/**
+ * @brief 放不下时从最久没有使用的开始淘汰, 单张比容量还大的图像不缓存
+ */
+void cnn::pipeline::ImageCache::insert(const std::string &key, const cv::Mat &image, const cv::Size minimum) {
+    const size_t bytes = image.total() * image.elemSize();
+    if (bytes > this->capacity_) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    const auto found = this->index_.find(key);
+    if (found != this->index_.end()) {
+        this->stats_.bytes -= found->second->image.total() * found->second->image.elemSize();
+        --this->stats_.images;
+        this->entries_.erase(found->second);
+        this->index_.erase(found);
+    }
+
+    while (this->stats_.bytes + bytes > this->capacity_) {
+        const Entry &last = this->entries_.back();
+        this->stats_.bytes -= last.image.total() * last.image.elemSize();
+        --this->stats_.images;
+        ++this->stats_.evictions;
+        this->index_.erase(last.key);
+        this->entries_.pop_back();
+    }
+
+    this->entries_.push_front({key, image, minimum});
+    this->index_.emplace(key, this->entries_.begin());
+    this->stats_.bytes += bytes;
+    ++this->stats_.images;
+}
+
+cnn::pipeline::CacheStats cnn::pipeline::ImageCache::stats() const {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->stats_;
+}
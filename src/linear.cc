@@ -1,45 +1,45 @@
 #include<architectures.hpp>
+#include<runtime.hpp>
 
 /**
  * @brief  线性层正向传播
  * @param input 上一层的输入
  * @return 传给下一层的输出，即经过线性层运算之后输出的结果
  */
-std::vector<cnn::tensor> cnn::architectures::LinearLayer::forward(const std::vector<tensor> &input) {
+const cnn::Tensor4D &cnn::architectures::LinearLayer::forward(const Tensor4D &input) {
     // 线性层前向传播
-    const int batchSize = input.size();
-    this->deltaShape_ = input.front()->shape();
-
-    // 开始 forward 之前清空 output, 再进行重新填充
-    std::vector<tensor>().swap(this->output_);
-    for (int b = 0; b < batchSize; ++b) {
-        this->output_.emplace_back(
-                std::make_shared<Tensor3D>(outChannels_, this->name_ + "_output_" + std::to_string(b)));
-    }
+    const int batchSize = input.getBatch();
+    this->deltaShape_ = input.sampleShape();
 
-    // 反向传播需要
-    if (!noGrad) {
-        this->_input_ = input;
-    }
+    // 输出的形状为 outChannels x 1 x 1
+    initBuffer(this->output_, batchSize, {outChannels_, 1, 1}, this->name_ + "_output");
 
+    // 把 CHW 的输入展平, 只是换一个形状的视图, 不复制数据. 输入的地址和 batch 大小不变时复用上一次的视图,
+    // 不用每一步都重新创建每个样本的 Tensor3D
+    assert(input.sampleLength() == static_cast<uint32_t>(inChannels_));
+    if (this->flatInput_.getBatch() != static_cast<uint32_t>(batchSize) || this->flatInput_.data(0) != input.data(0)) {
+        this->flatInput_ = input.flatten();
+    }
+    const Tensor4D &flat = this->flatInput_;
 
-    // 输入的每一个 batch
-    for (int b = 0; b < batchSize; ++b) {
-        dataType *srcPtr = input.at(b)->getData();
-        dataType *outPtr = this->output_.at(b)->getData();
+    // 输入的每一个 batch 按输出的块并行, 内层沿着权重的行连续累加
+    runtime::parallelFor(0, outChannels_, 64, [&](const size_t ocBegin, const size_t ocEnd) {
+        for (int b = 0; b < batchSize; ++b) {
+            const dataType *srcPtr = flat.data(b);
+            dataType *outPtr = this->output_.data(b);
 
-        // 每一个卷积核
-        for (int oc = 0; oc < outChannels_; ++oc) {
-            dataType sumValue = 0;
+            std::fill(outPtr + ocBegin, outPtr + ocEnd, dataType(0));
             for (int ic = 0; ic < inChannels_; ++ic) {
-                sumValue += srcPtr[ic] * weights_[ic * outChannels_ + oc];
+                const dataType value = srcPtr[ic];
+                const dataType *weightPtr = this->weights_.data() + ic * outChannels_;
+                for (size_t oc = ocBegin; oc < ocEnd; ++oc) {
+                    outPtr[oc] += value * weightPtr[oc];
+                }
             }
-
-            // 输出结果赋值
-            outPtr[oc] = sumValue;
         }
-    }
-    return std::vector<tensor>{this->output_};
+    });
+
+    return this->output_;
 }
 
 
@@ -48,8 +48,8 @@ std::vector<cnn::tensor> cnn::architectures::LinearLayer::forward(const std::vec
  * @param delta 下一层传播上来的 delta
  * @return 传给上一层的 delta
  */
-std::vector<cnn::tensor> cnn::architectures::LinearLayer::backward(std::vector<tensor> &delta) {
-    const int batchSize = delta.size();
+cnn::Tensor4D &cnn::architectures::LinearLayer::backward(Tensor4D &delta) {
+    const int batchSize = delta.getBatch();
     if (this->weightGradients_.empty()) {
         this->weightGradients_.assign(inChannels_ * outChannels_, 0);
         this->biasGradients_.assign(outChannels_, 0);
@@ -58,17 +58,11 @@ std::vector<cnn::tensor> cnn::architectures::LinearLayer::backward(std::vector<t
     calWeightGradients(delta);
     calBiasGradients(delta);
 
-    if (deltaOutPut_.empty()) {
-        this->deltaOutPut_.reserve(batchSize);
-        for (int b = 0; b < batchSize; ++b) {
-            this->deltaOutPut_.emplace_back(
-                    std::make_shared<Tensor3D>(static_cast<std::tuple<uint32_t, uint32_t, uint32_t> &>(deltaShape_),
-                                               "linear_delta_" + std::to_string(b)));
-        }
-    }
+    initBuffer(this->deltaOutPut_, batchSize, deltaShape_, this->name_ + "_delta");
 
     calInputGradients(delta);
 
+    // 梯度按展平的形状计算, 数据排布和输入的形状一致
     return this->deltaOutPut_;
 }
 
@@ -98,39 +92,57 @@ void cnn::architectures::LinearLayer::loadWeights(std::ifstream &reader) {
     reader.read((char *) (&bias_[0]), static_cast<std::streamsize>(sizeof(dataType) * outChannels_));
 }
 
-void cnn::architectures::LinearLayer::calWeightGradients(std::vector<tensor> &delta) {
-    int batchSize = delta.size();
-    for (int ic = 0; ic < inChannels_; ++ic) {
-        dataType *weightGradientsPtr = weightGradients_.data() + ic * outChannels_;
-        for (int oc = 0; oc < outChannels_; ++oc) {
-            dataType sumValue = 0;
-            for (int b = 0; b < batchSize; ++b) {
-                sumValue += this->_input_.at(b)->getData()[ic] * delta.at(b)->getData()[oc];
+void cnn::architectures::LinearLayer::calWeightGradients(Tensor4D &delta) {
+    int batchSize = delta.getBatch();
+    const size_t length = static_cast<size_t>(inChannels_) * outChannels_;
+    this->gradientShards_.reset(runtime::shardCount(batchSize), length);
+
+    // batch 切分给若干个梯度分片, 每个分片累加自己负责的图像的外积 input_b^T * delta_b
+    runtime::parallelFor(this->gradientShards_.count(), [&](const size_t s) {
+        dataType *shard = this->gradientShards_.shard(s);
+        const auto [begin, end] = this->gradientShards_.range(batchSize, s);
+        for (size_t b = begin; b < end; ++b) {
+            const dataType *srcPtr = this->flatInput_.data(b);
+            const dataType *deltaPtr = delta.data(b);
+            for (int ic = 0; ic < inChannels_; ++ic) {
+                const dataType value = srcPtr[ic];
+                dataType *row = shard + ic * outChannels_;
+                for (int oc = 0; oc < outChannels_; ++oc) {
+                    row[oc] += value * deltaPtr[oc];
+                }
             }
-            weightGradientsPtr[oc] = sumValue / randomTimes;
         }
+    });
+
+    const dataType *sum = this->gradientShards_.reduce();
+    for (size_t i = 0; i < length; ++i) {
+        this->weightGradients_[i] = sum[i] / randomTimes;
     }
 }
 
-void cnn::architectures::LinearLayer::calBiasGradients(std::vector<tensor> &delta) {
-    int batchSize = delta.size();
+void cnn::architectures::LinearLayer::calBiasGradients(Tensor4D &delta) {
+    int batchSize = delta.getBatch();
     for (int oc = 0; oc < outChannels_; ++oc) {
         dataType sumValue = 0;
         for (int b = 0; b < batchSize; ++b) {
-            sumValue += delta.at(b)->getData()[oc];
+            sumValue += delta.data(b)[oc];
         }
         this->biasGradients_[oc] = sumValue / batchSize;
     }
 }
 
-void cnn::architectures::LinearLayer::calInputGradients(std::vector<tensor> &delta) {
+void cnn::architectures::LinearLayer::calInputGradients(Tensor4D &delta) {
 
-    int batchSize = delta.size();
-    for (int b = 0; b < batchSize; ++b) {
-        dataType *deltaPtr = delta.at(b)->getData();
-        dataType *outPtr = deltaOutPut_.at(b)->getData();
+    int batchSize = delta.getBatch();
+    // 按 (图像, 输入通道) 展平之后并行, 每块处理一段连续的输入通道
+    runtime::parallelFor(0, static_cast<size_t>(batchSize) * inChannels_, 64,
+                         [&](const size_t begin, const size_t end) {
+        for (size_t index = begin; index < end; ++index) {
+            const int b = index / inChannels_;
+            const int ic = index % inChannels_;
+            dataType *deltaPtr = delta.data(b);
+            dataType *outPtr = deltaOutPut_.data(b);
 
-        for (int ic = 0; ic < inChannels_; ++ic) {
             dataType sumValue = 0;
             dataType *weightPtr = this->weights_.data() + ic * outChannels_;
             for (int oc = 0; oc < outChannels_; ++oc) {
@@ -138,6 +150,31 @@ void cnn::architectures::LinearLayer::calInputGradients(std::vector<tensor> &del
             }
             outPtr[ic] = sumValue;
         }
+    });
+}
+
+
+std::tuple<uint32_t, uint32_t, uint32_t>
+cnn::architectures::LinearLayer::planBuffers(memory::Planner &planner, const uint32_t batchSize,
+                                             const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                                             const LayerSchedule &schedule) {
+    assert(std::get<0>(inputShape) * std::get<1>(inputShape) * std::get<2>(inputShape) ==
+           static_cast<uint32_t>(inChannels_));
+    const std::tuple<uint32_t, uint32_t, uint32_t> outShape{outChannels_, 1, 1};
+
+    planner.addTensor(this->output_, batchSize, outShape, this->name_ + "_output", schedule.forward,
+                      schedule.outputEnd);
+    if (schedule.training()) {
+        planner.addTensor(this->deltaOutPut_, batchSize, inputShape, this->name_ + "_delta", schedule.backward,
+                          schedule.deltaEnd);
     }
+    return outShape;
 }
 
+void cnn::architectures::LinearLayer::releaseBackward() {
+    this->flatInput_ = Tensor4D();
+    this->deltaOutPut_ = Tensor4D();
+    std::vector<dataType>().swap(this->weightGradients_);
+    std::vector<dataType>().swap(this->biasGradients_);
+    this->gradientShards_.release();
+}
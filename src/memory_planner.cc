@@ -0,0 +1,120 @@
+#include<memory_planner.hpp>
+#include<algorithm>
+#include<numeric>
+
+namespace {
+    bool overlap(const cnn::memory::Request &a, const cnn::memory::Request &b) {
+        return a.begin <= b.end && b.begin <= a.end;
+    }
+}
+
+void cnn::memory::Planner::add(std::string name, const size_t bytes, const int begin, const int end,
+                               std::function<void(void *)> bind) {
+    assert(begin <= end);
+    this->requests_.push_back({std::move(name), paddedBytes(bytes), begin, end, std::move(bind)});
+}
+
+void cnn::memory::Planner::addTensor(Tensor4D &tensor, const uint32_t batch,
+                                     const std::tuple<uint32_t, uint32_t, uint32_t> &shape,
+                                     const std::string &name, const int begin, const int end) {
+    add(name, Tensor4D::bytes(batch, shape), begin, end, [&tensor, batch, shape, name](void *data) {
+        tensor = Tensor4D(static_cast<dataType *>(data), batch, shape, name);
+    });
+}
+
+/**
+ * @brief 按大小从大到小依次放置, 每个缓冲区放在和它生命周期重叠的、已经放好的缓冲区之间第一个足够大的空隙里
+ * @return 内存池需要的字节数
+ */
+size_t cnn::memory::Planner::plan() {
+    std::vector<int> order(this->requests_.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](const int a, const int b) {
+        return this->requests_[a].bytes > this->requests_[b].bytes;
+    });
+
+    std::vector<int> placed;
+    placed.reserve(order.size());
+    this->plannedBytes_ = 0;
+
+    for (const int index: order) {
+        Request &request = this->requests_[index];
+
+        // 和当前缓冲区同时存活的, 按偏移排序
+        std::vector<const Request *> alive;
+        for (const int other: placed) {
+            if (overlap(request, this->requests_[other])) {
+                alive.push_back(&this->requests_[other]);
+            }
+        }
+        std::sort(alive.begin(), alive.end(), [](const Request *a, const Request *b) {
+            return a->offset < b->offset;
+        });
+
+        size_t offset = 0;
+        for (const Request *other: alive) {
+            if (other->offset >= offset + request.bytes) {
+                break;
+            }
+            offset = std::max(offset, other->offset + other->bytes);
+        }
+
+        request.offset = offset;
+        placed.push_back(index);
+        this->plannedBytes_ = std::max(this->plannedBytes_, offset + request.bytes);
+    }
+
+    return this->plannedBytes_;
+}
+
+void cnn::memory::Planner::bind(char *arena) const {
+    for (const auto &request: this->requests_) {
+        request.bind(arena + request.offset);
+    }
+}
+
+size_t cnn::memory::Planner::plannedBytes() const {
+    return this->plannedBytes_;
+}
+
+size_t cnn::memory::Planner::naiveBytes() const {
+    return std::accumulate(this->requests_.begin(), this->requests_.end(), size_t(0),
+                           [](const size_t sum, const Request &request) {
+                               return sum + request.bytes;
+                           });
+}
+
+const std::vector<cnn::memory::Request> &cnn::memory::Planner::requests() const {
+    return this->requests_;
+}
+
+void cnn::memory::Planner::clear() {
+    this->requests_.clear();
+    this->plannedBytes_ = 0;
+}
+
+char *cnn::memory::Arena::reserve(const size_t bytes) {
+    if (bytes > this->capacity_) {
+        if (this->data_ != nullptr) {
+            this->allocator_->deallocate(this->data_, this->capacity_);
+        }
+        this->allocator_ = &defaultAllocator();
+        this->data_ = static_cast<char *>(this->allocator_->allocate(bytes));
+        this->capacity_ = bytes;
+    }
+    return this->data_;
+}
+
+void cnn::memory::Arena::release() {
+    if (this->data_ != nullptr) {
+        this->allocator_->deallocate(this->data_, this->capacity_);
+    }
+    this->data_ = nullptr;
+    this->capacity_ = 0;
+}
+
+cnn::memory::Arena::~Arena() {
+    if (this->data_ != nullptr) {
+        this->allocator_->deallocate(this->data_, this->capacity_);
+    }
+}
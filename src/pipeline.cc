@@ -1,9 +1,13 @@
 
 #include <pipeline.hpp>
+#include <convert.hpp>
 #include<opencv2/core.hpp>
 #include<opencv2/highgui.hpp>
 #include<opencv2/imgproc.hpp>
 #include <utility>
+#include <chrono>
+#include <numeric>
+#include <optional>
 
 
 void cnn::pipeline::display(cv::Mat image, std::string win) {
@@ -30,116 +34,447 @@ int cnn::pipeline::DataLoader::length() const {
     return this->imageNum_;
 }
 
-std::pair<std::vector<cnn::tensor>, std::vector<int>> cnn::pipeline::DataLoader::generateBatch() {
-    std::vector<tensor> images;
+/**
+ * @brief 取下一个 batch. 预取模式下只是从队列里取出解码好的 batch, 并把上一次借出的位置还回去
+ * @return 图像和标签, 图像的引用在下一次调用之前有效
+ */
+std::pair<const cnn::Tensor4D &, std::vector<int>> cnn::pipeline::DataLoader::generateBatch() {
+    if (this->workerCount_ > 0) {
+        if (this->workers_.empty()) {
+            startWorkers_();
+        }
+        std::unique_lock<std::mutex> lock(this->mutex_);
+        if (this->lent_ >= 0) {
+            this->ring_[this->lent_]->state = Slot::State::Free;
+            this->changed_.notify_all();
+        }
+
+        const int index = this->consumed_ % this->ring_.size();
+        Slot &slot = *this->ring_[index];
+        if (slot.state != Slot::State::Ready) {
+            const auto start = std::chrono::steady_clock::now();
+            this->changed_.wait(lock, [&slot]() {
+                return slot.state == Slot::State::Ready;
+            });
+            ++this->stats_.stalls;
+            this->stats_.stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        slot.state = Slot::State::Lent;
+        this->lent_ = index;
+        ++this->consumed_;
+        ++this->stats_.batches;
+        return {slot.labels.size() < this->batchSize_ ? slot.partial : slot.images, slot.labels};
+    }
+
     std::vector<int> labels;
-    images.reserve(this->batchSize_);
     labels.reserve(this->batchSize_);
 
+    // 和预取时一样按 batch 的序号设置增强的随机数
+    this->imageAugmentor_.reseed(this->sampler_.seed(), this->stats_.batches);
     for (int i = 0; i < batchSize_; ++i) {
         auto sample = this->addToBuffer_(i);
-        images.emplace_back(sample.first);
         labels.emplace_back(sample.second);
+        if (batchEnds_()) {
+            break;
+        }
     }
 
-    return std::make_pair(std::move(images), std::move(labels));
+    // 图像直接写进连续的 buffer_，这里只返回引用，下一次 generateBatch 会覆盖
+    ++this->stats_.batches;
+    if (labels.size() < this->batchSize_) {
+        this->partial_ = this->buffer_.slice(0, labels.size());
+        return {this->partial_, std::move(labels)};
+    }
+    return {this->buffer_, std::move(labels)};
 }
 
 std::pair<cnn::tensor, int> cnn::pipeline::DataLoader::addToBuffer_(const int batchIndex) {
     // 获取图像的序号
+    const size_t index = nextSample_();
+    int label = this->source_->label(index);
+
+    loadSample_(index, this->imageAugmentor_, this->buffer_.data(batchIndex));
+
+    // 返回图像的内容和 buffer
+    //this->buffer_.at(batchIndex)->opencvMat(3);
+    return {this->buffer_.at(batchIndex), label};
+}
+
+size_t cnn::pipeline::DataLoader::nextSample_() {
     ++this->iterator_;
     if (this->iterator_ == this->imageNum_) {
         this->iterator_ = 0;
-        if (this->shuffle_) {
-            std::shuffle(images_.begin(), images_.end(), std::default_random_engine(789));
+        this->source_->arrange(this->order_, this->sampler_, ++this->epoch_);
+        this->imageNum_ = this->order_.size();
+    }
+    return this->order_.at(iterator_);
+}
+
+bool cnn::pipeline::DataLoader::batchEnds_() const {
+    return this->partialLast_ && this->iterator_ + 1 == this->imageNum_;
+}
+
+/**
+ * @brief 数据来源里已经是目标尺寸的字节并且不做增强时, 直接从原始字节转换, 不需要解码和缩放.
+ * 像素的拆分, 缩放和归一化一次完成, 直接写进 batch 中对应的位置
+ * @param target batch 中这张图像的起始位置
+ */
+void cnn::pipeline::DataLoader::loadSample_(const size_t index, ImageAugmentor &augmentor, dataType *target) const {
+    if (!this->augment_) {
+        if (const uchar *raw = this->source_->raw(index, height_, width_)) {
+            kernels::hwcToChw(raw, height_ * width_, this->scale_, this->bias_, target);
+            return;
         }
     }
 
-    // 读取图像
-    auto image = this->images_.at(iterator_);
-    std::string path = image.first;
-    int label = image.second;
+    // 数据增强会裁剪, 裁剪之后也要不小于输出的大小
+    const cv::Size size{static_cast<int>(width_), static_cast<int>(height_)};
+    const float crop = this->augment_ ? ImageAugmentor::MIN_CROP_RATIO : 1.0f;
+    const cv::Size minimum{static_cast<int>(std::ceil(size.width / crop)),
+                           static_cast<int>(std::ceil(size.height / crop))};
+
+    // 缓存中的图像是共享的, 之后只读不写
+    cv::Mat origin;
+    const std::string key = this->cache_ ? this->source_->key(index) : std::string();
+    if (!key.empty()) {
+        origin = this->cache_->find(key, minimum);
+    }
+    if (origin.empty()) {
+        origin = this->source_->decodeAtLeast(index, minimum);
+        if (!key.empty()) {
+            this->cache_->insert(key, origin, minimum);
+        }
+    }
 
-    cv::Mat origin = cv::imread(path);
+    // 增强和缩放在同一次 warpAffine 中完成, 输出的缓冲区每个线程复用
+    thread_local cv::Mat resized;
     if (this->augment_) {
-        imageAugmentor_.makeAugment(origin);
+        augmentor.augment(origin, size, resized);
+        origin = resized;
+    } else if (origin.size() != size) {
+        cv::resize(origin, resized, size);
+        origin = resized;
     }
 
-    // resize 必须在数据增强之后
-    cv::resize(origin, origin, {static_cast<int>(width_), static_cast<int>(height_)});
-
     //从 OpenCV
-    this->buffer_.at(batchIndex)->readData(origin);
+    assert(origin.isContinuous() && origin.channels() == 3);
+    kernels::hwcToChw(origin.data, height_ * width_, this->scale_, this->bias_, target);
+}
 
-    // 返回图像的内容和 buffer
-    //this->buffer_.at(batchIndex)->opencvMat(3);
-    return {this->buffer_.at(batchIndex), label};
+void cnn::pipeline::DataLoader::setPartialLastBatch(const bool partial) {
+    assert(this->workers_.empty());
+    this->partialLast_ = partial;
+}
+
+int cnn::pipeline::DataLoader::batchesPerEpoch() const {
+    return this->partialLast_ ? (this->imageNum_ + this->batchSize_ - 1) / this->batchSize_
+                              : this->imageNum_ / this->batchSize_;
+}
+
+void cnn::pipeline::DataLoader::setCache(std::shared_ptr<ImageCache> cache) {
+    assert(this->workers_.empty());
+    this->cache_ = std::move(cache);
+}
+
+void cnn::pipeline::DataLoader::setNormalization(const std::vector<dataType> &mean,
+                                                 const std::vector<dataType> &standardDeviation) {
+    kernels::normalizeParams(mean, standardDeviation, this->scale_, this->bias_);
+}
+
+/**
+ * @brief 解码线程. 按序号领取 batch, 图像列表的遍历在锁内完成, 所以 batch 的内容和同步读取时一样;
+ * 解码和增强在锁外进行, 多个线程可以同时填充不同的位置. 每个线程有自己的增强器, 每个 batch 开始时
+ * 按 batch 的序号重新设置随机数, 增强的结果和哪个线程领取无关, 也和同步读取时一样
+ */
+void cnn::pipeline::DataLoader::prefetchLoop_() {
+    ImageAugmentor augmentor = this->imageAugmentor_;
+    std::vector<size_t> samples;
+    size_t sequence;
+    samples.reserve(this->batchSize_);
+
+    while (true) {
+        Slot *slot;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex_);
+            auto free = [this]() {
+                return this->ring_[this->produced_ % this->ring_.size()]->state == Slot::State::Free;
+            };
+            if (!this->stop_ && !free()) {
+                ++this->stats_.producerWaits;
+                this->changed_.wait(lock, [this, &free]() {
+                    return this->stop_ || free();
+                });
+            }
+            if (this->stop_) {
+                return;
+            }
+
+            slot = this->ring_[this->produced_ % this->ring_.size()].get();
+            slot->state = Slot::State::Filling;
+            sequence = this->produced_++;
+
+            samples.clear();
+            for (int i = 0; i < this->batchSize_; ++i) {
+                samples.push_back(nextSample_());
+                if (batchEnds_()) {
+                    break;
+                }
+            }
+        }
+
+        augmentor.reseed(this->sampler_.seed(), sequence);
+        slot->labels.clear();
+        if (samples.size() < this->batchSize_) {
+            slot->partial = slot->images.slice(0, samples.size());
+        }
+        for (size_t i = 0; i < samples.size(); ++i) {
+            loadSample_(samples[i], augmentor, slot->images.data(i));
+            slot->labels.push_back(this->source_->label(samples[i]));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            slot->state = Slot::State::Ready;
+        }
+        this->changed_.notify_all();
+    }
+}
+
+cnn::pipeline::PrefetchStats cnn::pipeline::DataLoader::stats() {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->stats_;
 }
 
 cnn::pipeline::DataLoader::DataLoader(cnn::pipeline::listType images, const uint32_t batchSize,
                                       const bool augment, const bool shuffle,
-                                      std::tuple<uint32_t, uint32_t, uint32_t> imageSize, const int seed) :
-        images_(std::move(images)),
+                                      std::tuple<uint32_t, uint32_t, uint32_t> imageSize, const int seed,
+                                      const int workers, const int queueDepth) :
+        DataLoader(std::make_shared<FileSource>(std::move(images)), batchSize, augment, shuffle, imageSize, seed,
+                   workers, queueDepth) {}
+
+cnn::pipeline::DataLoader::DataLoader(std::shared_ptr<const DatasetSource> source, const uint32_t batchSize,
+                                      const bool augment, const bool shuffle,
+                                      std::tuple<uint32_t, uint32_t, uint32_t> imageSize, const int seed,
+                                      const int workers, const int queueDepth) :
+        DataLoader(std::move(source), batchSize, augment,
+                   Sampler(shuffle ? SampleMode::Shuffle : SampleMode::Sequential, seed), imageSize, workers,
+                   queueDepth) {}
+
+cnn::pipeline::DataLoader::DataLoader(std::shared_ptr<const DatasetSource> source, const uint32_t batchSize,
+                                      const bool augment, const Sampler &sampler,
+                                      std::tuple<uint32_t, uint32_t, uint32_t> imageSize,
+                                      const int workers, const int queueDepth) :
+        source_(std::move(source)),
         batchSize_(batchSize),
         augment_(augment),
-        shuffle_(shuffle),
-        seed_(seed),
+        sampler_(sampler),
+        buffer_(workers > 0 ? 0 : batchSize, std::get<2>(imageSize), std::get<0>(imageSize), std::get<1>(imageSize),
+                "batch"),
         height_(std::get<0>(imageSize)),
         width_(std::get<1>(imageSize)),
-        channels_(std::get<2>(imageSize)) {
+        channels_(std::get<2>(imageSize)),
+        workerCount_(workers) {
+
+    this->source_->arrange(this->order_, this->sampler_, this->epoch_);
+    this->imageNum_ = this->order_.size();
+    assert(this->imageNum_ > 0);
+
+    if (workers > 0) {
+        // 多出来的一个位置是借给训练线程正在使用的 batch
+        const int slots = std::max(queueDepth, 1) + 1;
+        for (int i = 0; i < slots; ++i) {
+            this->ring_.emplace_back(std::make_unique<Slot>(batchSize, channels_, height_, width_));
+        }
+    }
+}
 
-    this->imageNum_ = this->images_.size();
-    this->buffer_.reserve(this->batchSize_);
-    for (int i = 0; i < batchSize_; ++i) {
-        buffer_.emplace_back(std::make_shared<cnn::Tensor3D>(channels_, height_, width_));
+/**
+ * @brief 推迟到第一次取 batch 时才启动, 构造之后的设置 (归一化, 缓存) 不会和解码线程竞争
+ */
+void cnn::pipeline::DataLoader::startWorkers_() {
+    for (int i = 0; i < this->workerCount_; ++i) {
+        this->workers_.emplace_back(&DataLoader::prefetchLoop_, this);
     }
 }
 
-void cnn::pipeline::ImageAugmentor::makeAugment(cv::Mat &origin, const bool show) {
+cnn::pipeline::DataLoader::~DataLoader() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->stop_ = true;
+    }
+    this->changed_.notify_all();
+    for (auto &worker: this->workers_) {
+        worker.join();
+    }
+}
+
+cnn::pipeline::Affine cnn::pipeline::Affine::then(const Affine &next) const {
+    const double *a = this->m;
+    const double *b = next.m;
+    Affine result;
+    result.m[0] = b[0] * a[0] + b[1] * a[3];
+    result.m[1] = b[0] * a[1] + b[1] * a[4];
+    result.m[2] = b[0] * a[2] + b[1] * a[5] + b[2];
+    result.m[3] = b[3] * a[0] + b[4] * a[3];
+    result.m[4] = b[3] * a[1] + b[4] * a[4];
+    result.m[5] = b[3] * a[2] + b[4] * a[5] + b[5];
+    return result;
+}
+
+cnn::pipeline::ImageAugmentor::ImageAugmentor(const std::vector<std::pair<std::string, float>> &operations) :
+        e_(212), l_(826), c_(230), r_(520),
+        engine_(0.0, 1.0), cropEngine_(0.0, 0.25), rotateEngine_(15, 75), minusEngine_(1, 10) {
+    static const std::map<std::string, AugmentOp> names{{"hflip",  AugmentOp::HFlip},
+                                                        {"vflip",  AugmentOp::VFlip},
+                                                        {"crop",   AugmentOp::Crop},
+                                                        {"rotate", AugmentOp::Rotate}};
+    for (const auto &[name, probability]: operations) {
+        const auto op = names.find(name);
+        assert(op != names.end());
+        this->operations_.emplace_back(op->second, probability);
+    }
+}
+
+/**
+ * @brief 按随机的顺序决定每个操作是否执行, 执行的操作不去真正变换图像, 只把对应的坐标变换乘到一起.
+ * 随机数的使用顺序和逐个操作变换图像时一样
+ * @param source 原图的大小
+ * @param size 返回所有操作之后图像的大小
+ */
+cnn::pipeline::Affine cnn::pipeline::ImageAugmentor::compose(const cv::Size source, cv::Size &size) {
     // 随机打乱次序
     std::shuffle(operations_.begin(), operations_.end(), this->l_);
 
+    Affine transform;
+    size = source;
+
     // 遍历整个操作
-    for (const auto &item: operations_) {
+    for (const auto &[op, chance]: operations_) {
         const float probability = engine_(e_);
         // 概率太小，不执行操作
-        if (probability < 1.0 - item.second) {
+        if (probability < 1.0 - chance) {
             continue;
         }
 
-        if (item.first == "hflip") {
-            cv::flip(origin, origin, 1);
-        } else if (item.first == "vflip") {
-            cv::flip(origin, origin, 0);
-        } else if (item.first == "crop") {
-            const int row = origin.rows;
-            const int col = origin.cols;
-
-            float ratio = 0.7f + cropEngine_(c_);
-
-            // 计算机裁剪尺寸
-            const int rowAfterCrop = row * ratio;
-            const int colAfterCrop = col * ratio;
-
-            // 获取随机的裁剪位置
-            std::uniform_int_distribution posOfRow(0, row - rowAfterCrop - 10);
-            std::uniform_int_distribution posOfCol(0, col - colAfterCrop - 10);
-
-            origin = origin(cv::Rect(posOfCol(c_), posOfRow(c_), colAfterCrop, rowAfterCrop));
-        } else if (item.first == "rotate") {
-            float angle = rotateEngine_(r_);
-            if (minusEngine_(r_) & 1) {
-                angle = -angle;
+        Affine step;
+        switch (op) {
+            case AugmentOp::HFlip:
+                step.m[0] = -1;
+                step.m[2] = size.width - 1;
+                break;
+            case AugmentOp::VFlip:
+                step.m[4] = -1;
+                step.m[5] = size.height - 1;
+                break;
+            case AugmentOp::Crop: {
+                const int row = size.height;
+                const int col = size.width;
+
+                float ratio = MIN_CROP_RATIO + cropEngine_(c_);
+
+                // 计算机裁剪尺寸
+                const int rowAfterCrop = row * ratio;
+                const int colAfterCrop = col * ratio;
+
+                // 获取随机的裁剪位置
+                std::uniform_int_distribution posOfRow(0, row - rowAfterCrop - 10);
+                std::uniform_int_distribution posOfCol(0, col - colAfterCrop - 10);
+                const int x = posOfCol(c_);
+                const int y = posOfRow(c_);
+
+                step.m[2] = -x;
+                step.m[5] = -y;
+                size = {colAfterCrop, rowAfterCrop};
+                break;
+            }
+            case AugmentOp::Rotate: {
+                float angle = rotateEngine_(r_);
+                if (minusEngine_(r_) & 1) {
+                    angle = -angle;
+                }
+
+                // 绕中心旋转, 画布扩大到能放下旋转之后的整张图像, 和 cv::getRotationMatrix2D 的方向一致
+                const double radian = angle * CV_PI / 180;
+                const double alpha = std::cos(radian);
+                const double beta = std::sin(radian);
+                const double cx = (size.width - 1) / 2.0;
+                const double cy = (size.height - 1) / 2.0;
+                const double boundWidth = size.width * std::abs(alpha) + size.height * std::abs(beta);
+                const double boundHeight = size.width * std::abs(beta) + size.height * std::abs(alpha);
+
+                step.m[0] = alpha;
+                step.m[1] = beta;
+                step.m[2] = (1 - alpha) * cx - beta * cy + (boundWidth - size.width) / 2;
+                step.m[3] = -beta;
+                step.m[4] = alpha;
+                step.m[5] = beta * cx + (1 - alpha) * cy + (boundHeight - size.height) / 2;
+                size = {static_cast<int>(std::lround(boundWidth)), static_cast<int>(std::lround(boundHeight))};
+                break;
             }
-            origin = cnn::pipeline::rotate(origin, angle);
         }
+        transform = transform.then(step);
+    }
 
-        if (show) {
-            pipeline::display(origin, std::to_string(engine_(e_)));
-        }
+    return transform;
+}
+
+/**
+ * @brief 增强和缩放合成一次仿射变换. 缩放的坐标对应关系和 cv::resize 一致, 即像素中心对齐
+ * @param target 输出图像的大小
+ * @param output 输出, 大小和类型已经正确时不会重新分配
+ */
+void cnn::pipeline::ImageAugmentor::augment(const cv::Mat &origin, const cv::Size target, cv::Mat &output) {
+    cv::Size size;
+    const Affine transform = compose(origin.size(), size);
+
+    Affine scale;
+    scale.m[0] = static_cast<double>(target.width) / size.width;
+    scale.m[2] = 0.5 * scale.m[0] - 0.5;
+    scale.m[4] = static_cast<double>(target.height) / size.height;
+    scale.m[5] = 0.5 * scale.m[4] - 0.5;
+
+    Affine full = transform.then(scale);
+    output.create(target, origin.type());
+    cv::warpAffine(origin, output, cv::Mat(2, 3, CV_64F, full.m), target, cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+}
+
+void cnn::pipeline::ImageAugmentor::makeAugment(cv::Mat &origin, const bool show) {
+    cv::Size size;
+    Affine transform = compose(origin.size(), size);
+
+    cv::Mat output;
+    cv::warpAffine(origin, output, cv::Mat(2, 3, CV_64F, transform.m), size, cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+    origin = output;
+
+    if (show) {
+        pipeline::display(origin, std::to_string(engine_(e_)));
     }
 }
 
+/**
+ * @brief compose 会打乱操作列表, 这里按操作的种类排回固定的次序, 之后的增强只由 seed 和 sequence 决定,
+ * 和这个增强器之前处理过哪些图像无关
+ * @param seed 基础的随机数种子
+ * @param sequence 序号, 例如 batch 的序号
+ */
+void cnn::pipeline::ImageAugmentor::reseed(const uint32_t seed, const uint64_t sequence) {
+    std::seed_seq sequenceSeed{seed, static_cast<uint32_t>(sequence), static_cast<uint32_t>(sequence >> 32)};
+    uint32_t seeds[4];
+    sequenceSeed.generate(seeds, seeds + 4);
+    this->e_.seed(seeds[0]);
+    this->l_.seed(seeds[1]);
+    this->c_.seed(seeds[2]);
+    this->r_.seed(seeds[3]);
+    this->engine_.reset();
+    this->cropEngine_.reset();
+    this->rotateEngine_.reset();
+    this->minusEngine_.reset();
+    std::stable_sort(this->operations_.begin(), this->operations_.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+}
+
 std::map<std::string, cnn::pipeline::listType>
 cnn::pipeline::getImagesForClassification(const std::filesystem::path &dataset,
                                           const std::vector<std::string> &categories,
@@ -179,3 +514,39 @@ cnn::pipeline::getImagesForClassification(const std::filesystem::path &dataset,
 
     return results;
 }
+
+/**
+ * @brief 清单有效时只读清单文件. 增量更新只重新读取新增或者变化的图像, 划分由路径的哈希决定,
+ * 新增图像不会改变已有图像的划分
+ * @param manifest 清单文件的路径, 更新之后写回
+ * @param rescan 清单有效时也遍历目录, 用来发现新增或者变化的图像
+ */
+std::map<std::string, cnn::pipeline::listType>
+cnn::pipeline::getImagesForClassification(const std::filesystem::path &dataset,
+                                          const std::vector<std::string> &categories,
+                                          const std::filesystem::path &manifest,
+                                          const bool rescan,
+                                          const std::pair<float, float> &ratios) {
+    std::optional<DatasetManifest> loaded;
+    if (std::filesystem::exists(manifest)) {
+        try {
+            loaded = DatasetManifest::load(manifest);
+        } catch (const std::exception &error) {
+            std::cout << error.what() << ", rebuilding" << std::endl;
+        }
+    }
+
+    if (!loaded || !loaded->matches(dataset, categories, ratios)) {
+        loaded = DatasetManifest(dataset, categories, ratios);
+        loaded->update();
+        loaded->save(manifest);
+    } else if (rescan && loaded->update() > 0) {
+        loaded->save(manifest);
+    }
+
+    auto results = loaded->splits();
+    std::cout << "\ntraint : " << results["train"].size() << "\ntest : " << results["test"].size() << "\nvalid : "
+              << results["valid"].size() << std::endl;
+
+    return results;
+}
@@ -1,14 +1,15 @@
 #include<architectures.hpp>
+#include<pooling.hpp>
+#include<runtime.hpp>
 
-std::vector<cnn::tensor> cnn::architectures::MaxPool2D::forward(const std::vector<tensor> &input) {
+const cnn::Tensor4D &cnn::architectures::MaxPool2D::forward(const Tensor4D &input) {
 
-    int batchSize = input.size();
+    int batchSize = input.getBatch();
     //std::cout << "batchSize  " << __LINE__ << "  " << batchSize << std::endl;
-    const auto &first = input.front();
 
-    const uint32_t channels = first->getChannels();
-    const uint32_t height = first->getHeight();
-    const uint32_t width = first->getWidth();
+    const uint32_t channels = input.getChannels();
+    const uint32_t height = input.getHeight();
+    const uint32_t width = input.getWidth();
     std::tuple<uint32_t, uint32_t, uint32_t> shape{channels, height, width};
 
     const uint32_t poolOutPutHeight = (height - kernelSize_ + 2 * padding_) / step_ + 1;
@@ -19,104 +20,96 @@ std::vector<cnn::tensor> cnn::architectures::MaxPool2D::forward(const std::vecto
     // 开始池化
     const uint32_t length = height * width;
     const uint32_t outLength = poolOutPutWidth * poolOutPutHeight;
-    const uint32_t poolBoundaryOfHeight = height - kernelSize_;
-    const uint32_t poolBoundaryOfWidth = width - kernelSize_;
-    const int windowsLength = kernelSize_ * kernelSize_;
-
-    for (int b = 0; b < batchSize; ++b) {
-        for (int c = 0; c < channels; ++c) {
-            dataType *src = input.at(b)->getData() + c * length;
-            dataType *dst = output_.at(b)->getData() + c * outLength;
-            int *maskPtr = this->mask_.at(b).data() + c * outLength;
-
-            int cnt = 0;
-
-            for (int x = 0; x <= poolBoundaryOfHeight; x += step_) {
-                dataType *row = src + x * width;
-                for (int y = 0; y <= poolBoundaryOfWidth; y += step_) {
-                    dataType maxValue = row[y];
-                    int index = 0;
-                    for (int i = 0; i < windowsLength; ++i) {
-                        dataType comp = row[y + offset_[i]];
-                        //std::cout << comp << " \n";
-                        if (comp > maxValue) {
-                            maxValue = comp;
-                            index = offset_[i];
-                        }
-                    }
-
-                    // 局部最大值输出到对应位置
-                    dst[cnt] = maxValue;
-
-                    if (!noGrad) {
-                        index += x * width + y;
-                        maskPtr[cnt] = c * length + index;
-                    }
-                    cnt++;
-                }
-            }
-        }
-    }
+
+    // 每个 (图像, 通道) 的池化互不影响, 展平之后并行. 需要反向传播时记录每个窗口中最大值的位置
+    runtime::parallelFor(batchSize * channels, [&](const size_t plane) {
+        const int b = plane / channels;
+        const int c = plane % channels;
+        uint8_t *maskPtr = noGrad ? nullptr : this->mask_ + b * this->maskLength_ + c * outLength;
+        kernels::maxPool(input.data(b) + c * length, height, width, kernelSize_, step_,
+                         this->output_.data(b) + c * outLength, maskPtr);
+    });
 
     return this->output_;
 }
 
-std::vector<cnn::tensor> cnn::architectures::MaxPool2D::backward(std::vector<tensor> &delta) {
+cnn::Tensor4D &cnn::architectures::MaxPool2D::backward(Tensor4D &delta) {
     // 获取输入的梯度的信息
-    const int batchSize = delta.size();
+    const int batchSize = delta.getBatch();
 
     // 先对 setZero 清零处理 因为不提供最大值的部分的梯度都是零
-    for (int b = 0; b < batchSize; ++b) {
-        this->deltaOutput_.at(b)->setZero();
-    }
-
-    const int totalLength = delta.front()->length();
-    for (int b = 0; b < batchSize; ++b) {
-        int *maskPtr = this->mask_.at(b).data();
-
-        dataType *src = delta[b]->getData();
-        dataType *dst = deltaOutput_[b]->getData();
-
-        for (int i = 0; i < totalLength; ++i) {
-            dst[maskPtr[i]] = src[i];
-        }
-    }
+    this->deltaOutput_.setZero();
+
+    // mask 只记录窗口内的下标, 由窗口的位置还原出输入中的位置. 每个 (图像, 通道) 只写自己的平面, 展平之后并行
+    const int channels = delta.getChannels();
+    const int outLength = delta.getHeight() * delta.getWidth();
+    const int height = deltaOutput_.getHeight();
+    const int width = deltaOutput_.getWidth();
+    runtime::parallelFor(batchSize * channels, [&](const size_t plane) {
+        const int b = plane / channels;
+        const int c = plane % channels;
+        kernels::maxPoolBackward(delta.data(b) + c * outLength, this->mask_ + b * this->maskLength_ + c * outLength,
+                                 height, width, kernelSize_, step_, this->deltaOutput_.data(b) + c * height * width);
+    });
 
     return deltaOutput_;
 }
 
 void cnn::architectures::MaxPool2D::init(int batchSize, std::tuple<uint32_t, uint32_t, uint32_t> shape, uint32_t height,
                                          uint32_t width) {
-    if (!this->output_.empty()) {
-        return;
-    }
     //std::cout << "maxPool Init  "<<batchSize << std::endl;
 
     std::tuple<uint32_t, uint32_t, uint32_t> outShape{std::get<0>(shape), height, width};
-    this->output_.reserve(batchSize);
-    for (int i = 0; i < batchSize; ++i) {
-        this->output_.emplace_back(std::make_shared<Tensor3D>(outShape, this->name_ + "_output_" + std::to_string(i)));
-    }
+    initBuffer(this->output_, batchSize, outShape, this->name_ + "_output");
 
     if (!noGrad) {
-        this->deltaOutput_.reserve(batchSize);
-        for (int i = 0; i < batchSize; ++i) {
-            this->deltaOutput_.emplace_back(
-                    std::make_shared<Tensor3D>(shape, this->name_ + "_delta_" + std::to_string(i)));
-        }
-
-        // mask 对 batch 中的每一张图都分配空间
-        int length = std::get<0>(shape) * height * width;
-        this->mask_.reserve(batchSize);
-        for (int i = 0; i < batchSize; ++i) {
-            this->mask_.emplace_back(length);
+        initBuffer(this->deltaOutput_, batchSize, shape, this->name_ + "_delta");
+
+        // mask 对 batch 中的每一张图都分配空间, 内存规划已经分配好的就直接使用
+        this->maskLength_ = std::get<0>(shape) * height * width;
+        if (this->maskCapacity_ < batchSize * this->maskLength_) {
+            this->maskStorage_.resize(batchSize * this->maskLength_);
+            this->mask_ = this->maskStorage_.data();
+            this->maskCapacity_ = this->maskStorage_.size();
         }
     }
+}
 
-    int position = 0;
-    for (int i = 0; i < kernelSize_; ++i) {
-        for (int j = 0; j < kernelSize_; ++j) {
-            this->offset_.at(position++) = i * std::get<2>(shape) + j;
-        }
+/**
+ * @brief 池化层需要的缓冲区: 输出, 传给上一层的梯度, 以及 backward 用到的最大值位置 mask, 每个输出一个字节
+ */
+std::tuple<uint32_t, uint32_t, uint32_t>
+cnn::architectures::MaxPool2D::planBuffers(memory::Planner &planner, const uint32_t batchSize,
+                                           const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                                           const LayerSchedule &schedule) {
+    const uint32_t channels = std::get<0>(inputShape);
+    const uint32_t outHeight = (std::get<1>(inputShape) - kernelSize_ + 2 * padding_) / step_ + 1;
+    const uint32_t outWidth = (std::get<2>(inputShape) - kernelSize_ + 2 * padding_) / step_ + 1;
+    const std::tuple<uint32_t, uint32_t, uint32_t> outShape{channels, outHeight, outWidth};
+
+    planner.addTensor(this->output_, batchSize, outShape, this->name_ + "_output", schedule.forward,
+                      schedule.outputEnd);
+
+    if (schedule.training()) {
+        planner.addTensor(this->deltaOutput_, batchSize, inputShape, this->name_ + "_delta", schedule.backward,
+                          schedule.deltaEnd);
+
+        const size_t maskCapacity = static_cast<size_t>(batchSize) * channels * outHeight * outWidth;
+        planner.add(this->name_ + "_mask", maskCapacity * sizeof(uint8_t), schedule.forward, schedule.backward,
+                    [this, maskCapacity](void *data) {
+                        this->mask_ = static_cast<uint8_t *>(data);
+                        this->maskCapacity_ = maskCapacity;
+                        std::vector<uint8_t>().swap(this->maskStorage_);
+                    });
     }
+
+    return outShape;
+}
+
+void cnn::architectures::MaxPool2D::releaseBackward() {
+    this->deltaOutput_ = Tensor4D();
+    std::vector<uint8_t>().swap(this->maskStorage_);
+    this->mask_ = nullptr;
+    this->maskCapacity_ = 0;
+    this->maskLength_ = 0;
 }
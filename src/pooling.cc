@@ -0,0 +1,134 @@
+#include<pooling.hpp>
+#include<cassert>
+
+#if defined(__AVX2__)
+#include<immintrin.h>
+#endif
+
+namespace {
+    using cnn::dataType;
+
+    /**
+     * @brief 任意窗口大小和步长的最大池化, 窗口内按行扫描
+     */
+    void maxPoolGeneric(const dataType *input, const int height, const int width, const int size, const int step,
+                        dataType *output, uint8_t *mask) {
+        const int outHeight = cnn::kernels::pooledLength(height, size, step);
+        const int outWidth = cnn::kernels::pooledLength(width, size, step);
+        for (int x = 0; x < outHeight; ++x) {
+            for (int y = 0; y < outWidth; ++y) {
+                const dataType *window = input + x * step * width + y * step;
+                dataType maxValue = window[0];
+                int index = 0;
+                for (int kx = 0; kx < size; ++kx) {
+                    for (int ky = 0; ky < size; ++ky) {
+                        const dataType comp = window[kx * width + ky];
+                        if (comp > maxValue) {
+                            maxValue = comp;
+                            index = kx * size + ky;
+                        }
+                    }
+                }
+                output[x * outWidth + y] = maxValue;
+                if (mask != nullptr) {
+                    mask[x * outWidth + y] = static_cast<uint8_t>(index);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief 2x2 步长为 2 的池化, 一行输出只读输入的两行. 比较的顺序和 maxPoolGeneric 一样, 结果逐位一致.
+     * 有 AVX2 时一次处理 8 个输出, 把两行的 16 个输入拆成偶数列和奇数列之后逐个比较
+     */
+    void maxPool2x2(const dataType *input, const int height, const int width, dataType *output, uint8_t *mask) {
+        const int outHeight = height / 2;
+        const int outWidth = width / 2;
+        for (int x = 0; x < outHeight; ++x) {
+            const dataType *row0 = input + 2 * x * width;
+            const dataType *row1 = row0 + width;
+            dataType *dst = output + x * outWidth;
+            uint8_t *maskRow = mask == nullptr ? nullptr : mask + x * outWidth;
+
+            int y = 0;
+#if defined(__AVX2__)
+            // 16 个连续的值拆成偶数列和奇数列, shuffle 之后 64 位一组的顺序是 0 2 1 3, 再换回来
+            const auto split = [](const dataType *src, __m256 &even, __m256 &odd) {
+                const __m256 low = _mm256_loadu_ps(src);
+                const __m256 high = _mm256_loadu_ps(src + 8);
+                even = _mm256_castpd_ps(_mm256_permute4x64_pd(
+                        _mm256_castps_pd(_mm256_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+                odd = _mm256_castpd_ps(_mm256_permute4x64_pd(
+                        _mm256_castps_pd(_mm256_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+            };
+            for (; y + 8 <= outWidth; y += 8) {
+                __m256 a, b, c, d;
+                split(row0 + 2 * y, a, b);
+                split(row1 + 2 * y, c, d);
+                if (maskRow == nullptr) {
+                    // max_ps(p, q) 就是 p > q ? p : q, 按同样的顺序比较
+                    _mm256_storeu_ps(dst + y, _mm256_max_ps(d, _mm256_max_ps(c, _mm256_max_ps(b, a))));
+                    continue;
+                }
+
+                // 和标量的 comp > maxValue 一样, 只有严格大于才替换
+                __m256 maxValue = a;
+                __m256i index = _mm256_setzero_si256();
+                const __m256 candidates[3] = {b, c, d};
+                for (int i = 0; i < 3; ++i) {
+                    const __m256 greater = _mm256_cmp_ps(candidates[i], maxValue, _CMP_GT_OQ);
+                    maxValue = _mm256_blendv_ps(maxValue, candidates[i], greater);
+                    index = _mm256_blendv_epi8(index, _mm256_set1_epi32(i + 1), _mm256_castps_si256(greater));
+                }
+                _mm256_storeu_ps(dst + y, maxValue);
+
+                // 8 个 32 位的下标压缩成 8 个字节
+                const __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(index),
+                                                      _mm256_extracti128_si256(index, 1));
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(maskRow + y), _mm_packus_epi16(words, words));
+            }
+#endif
+            for (; y < outWidth; ++y) {
+                const dataType values[4] = {row0[2 * y], row0[2 * y + 1], row1[2 * y], row1[2 * y + 1]};
+                dataType maxValue = values[0];
+                uint8_t index = 0;
+                for (uint8_t i = 1; i < 4; ++i) {
+                    if (values[i] > maxValue) {
+                        maxValue = values[i];
+                        index = i;
+                    }
+                }
+                dst[y] = maxValue;
+                if (maskRow != nullptr) {
+                    maskRow[y] = index;
+                }
+            }
+        }
+    }
+}
+
+int cnn::kernels::pooledLength(const int length, const int size, const int step) {
+    return (length - size) / step + 1;
+}
+
+void cnn::kernels::maxPool(const dataType *input, const int height, const int width, const int size, const int step,
+                           dataType *output, uint8_t *mask) {
+    assert(size > 0 && step > 0 && size * size <= 256);
+    if (size == 2 && step == 2) {
+        maxPool2x2(input, height, width, output, mask);
+    } else {
+        maxPoolGeneric(input, height, width, size, step, output, mask);
+    }
+}
+
+void cnn::kernels::maxPoolBackward(const dataType *delta, const uint8_t *mask, const int height, const int width,
+                                   const int size, const int step, dataType *inputDelta) {
+    const int outHeight = pooledLength(height, size, step);
+    const int outWidth = pooledLength(width, size, step);
+    for (int x = 0; x < outHeight; ++x) {
+        for (int y = 0; y < outWidth; ++y) {
+            const int index = mask[x * outWidth + y];
+            inputDelta[(x * step + index / size) * width + y * step + index % size] += delta[x * outWidth + y];
+        }
+    }
+}
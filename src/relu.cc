@@ -1,51 +1,89 @@
 #include<architectures.hpp>
+#include<runtime.hpp>
 
-std::vector<cnn::tensor> cnn::architectures::ReLU::forward(const std::vector<tensor> &input) {
-    const int batchSize = input.size();
-    auto shape = input.front()->shape();
-    init(batchSize, shape);
+namespace {
+    // 逐元素的运算每个任务至少处理这么多个元素, 再小的话调度开销比计算还大
+    constexpr int CHUNK = 1 << 14;
+}
+
+/**
+ * @brief ReLU 正向传播. 原地计算时直接改写输入, 返回的就是输入本身; backward 只需要输出的正负,
+ * 输入被改写之后正负和输出一样, 所以两种方式都不需要额外的 mask
+ */
+const cnn::Tensor4D &cnn::architectures::ReLU::forward(const Tensor4D &input) {
+    const int batchSize = input.getBatch();
+    auto shape = input.sampleShape();
+    if (!this->inPlace_) {
+        init(batchSize, shape);
+    }
+    this->result_ = this->inPlace_ ? &input : &this->output_;
 
-    const int length = input.front()->length();
+    const int length = input.sampleLength();
+    const int chunks = (length + CHUNK - 1) / CHUNK;
 
-    for (int i = 0; i < batchSize; ++i) {
-        dataType *src = input.at(i)->getData();
-        dataType *dst = this->output_.at(i)->getData();
+    // 按 (图像, 块) 展平之后并行
+    runtime::parallelFor(batchSize * chunks, [&](const size_t index) {
+        const int i = index / chunks;
+        const int begin = index % chunks * CHUNK;
+        const int end = std::min(begin + CHUNK, length);
+        dataType *src = input.data(i);
+        dataType *dst = this->result_->data(i);
 
-        for (int j = 0; j < length; ++j) {
+        for (int j = begin; j < end; ++j) {
             dst[j] = (src[j] >= 0) ? src[j] : 0;
         }
-    }
+    });
 
-    return this->output_;
+    return *this->result_;
 }
 
-std::vector<cnn::tensor> cnn::architectures::ReLU::backward(std::vector<tensor> &delta) {
+cnn::Tensor4D &cnn::architectures::ReLU::backward(Tensor4D &delta) {
     // 反向传播不需要在分配空间啦
     // 同时ReLU 层是原地进行反向传播，也并不需要返回给上一层 delta 的输出
 
-    const int batchSize = delta.size();
-    const int length = delta.front()->length();
+    const int batchSize = delta.getBatch();
+    const int length = delta.sampleLength();
+    const int chunks = (length + CHUNK - 1) / CHUNK;
 
-    for (int i = 0; i < batchSize; ++i) {
-        dataType *src = delta.at(i)->getData();
-        dataType *out = this->output_.at(i)->getData();
+    runtime::parallelFor(batchSize * chunks, [&](const size_t index) {
+        const int i = index / chunks;
+        const int begin = index % chunks * CHUNK;
+        const int end = std::min(begin + CHUNK, length);
+        dataType *src = delta.data(i);
+        const dataType *out = this->result_->data(i);
 
-        for (int j = 0; j < length; ++j) {
+        for (int j = begin; j < end; ++j) {
             src[j] = (out[j] <= 0) ? 0 : src[j];
         }
-    }
+    });
 
     return delta;
 }
 
-void cnn::architectures::ReLU::init(int size, std::tuple<uint32_t, uint32_t, uint32_t> shape) {
-    if (this->output_.empty()) {
-        this->output_.reserve(size);
-
-        for (int i = 0; i < size; ++i) {
-            this->output_.emplace_back(std::make_shared<Tensor3D>(shape, this->name_ + "_output_" + std::to_string(i)));
-        }
+void cnn::architectures::ReLU::setInPlace(const bool inPlace) {
+    this->inPlace_ = inPlace;
+    if (inPlace) {
+        this->output_ = Tensor4D();
     }
+}
 
+const cnn::Tensor4D &cnn::architectures::ReLU::getOutput() {
+    return this->inPlace_ ? *this->result_ : this->output_;
+}
 
+void cnn::architectures::ReLU::init(int size, std::tuple<uint32_t, uint32_t, uint32_t> shape) {
+    initBuffer(this->output_, size, shape, this->name_ + "_output");
+}
+
+std::tuple<uint32_t, uint32_t, uint32_t>
+cnn::architectures::ReLU::planBuffers(memory::Planner &planner, const uint32_t batchSize,
+                                      const std::tuple<uint32_t, uint32_t, uint32_t> &inputShape,
+                                      const LayerSchedule &schedule) {
+    // backward 是原地进行的, 只需要输出, 并且要保留到 backward 时判断正负.
+    // 原地计算时输出就是上一层的输出, 由上一层申请
+    if (!this->inPlace_) {
+        planner.addTensor(this->output_, batchSize, inputShape, this->name_ + "_output", schedule.forward,
+                          schedule.outputEnd);
+    }
+    return inputShape;
 }
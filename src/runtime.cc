@@ -0,0 +1,249 @@
+#include<runtime.hpp>
+#include<algorithm>
+#include<cassert>
+#include<cstdlib>
+#include<opencv2/core.hpp>
+
+namespace {
+    // 当前线程所属的线程池和队列下标, 外部线程为 nullptr 和 -1
+    thread_local const cnn::runtime::ThreadPool *currentPool = nullptr;
+    thread_local int currentIndex = -1;
+
+    // 每个线程分到的块数, 块多一些负载不均时可以互相偷
+    constexpr size_t BLOCKS_PER_THREAD = 4;
+
+    int defaultThreads() {
+        if (const char *env = std::getenv("CNN_NUM_THREADS")) {
+            const int threads = std::atoi(env);
+            if (threads > 0) {
+                return threads;
+            }
+        }
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::mutex poolMutex;
+    std::unique_ptr<cnn::runtime::ThreadPool> globalPool;
+    std::atomic<cnn::runtime::ThreadPool *> poolPointer{nullptr}; // 创建之后直接读, 不用每次加锁
+}
+
+cnn::runtime::ThreadPool::ThreadPool(const int threads) {
+    const int total = std::max(threads, 1);
+    for (int i = 0; i < total; ++i) {
+        this->queues_.emplace_back(std::make_unique<Queue>());
+    }
+    for (int i = 0; i < total - 1; ++i) {
+        this->workers_.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+cnn::runtime::ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->sleepMutex_);
+        this->stop_ = true;
+    }
+    this->wake_.notify_all();
+    for (auto &worker: this->workers_) {
+        worker.join();
+    }
+}
+
+int cnn::runtime::ThreadPool::size() const {
+    return static_cast<int>(this->queues_.size());
+}
+
+/**
+ * @brief 调用线程先把其余的块放进队列, 自己执行第一块, 之后一边等待一边帮忙执行队列中的任务
+ * @param grain 每块至少包含的下标个数, 太小的块调度开销比计算还大
+ */
+void cnn::runtime::ThreadPool::parallelFor(const size_t begin, const size_t end, const size_t grain,
+                                           const std::function<void(size_t, size_t)> &func) {
+    if (begin >= end) {
+        return;
+    }
+    const size_t total = end - begin;
+    const size_t maxBlocks = std::min((total + std::max<size_t>(grain, 1) - 1) / std::max<size_t>(grain, 1),
+                                      this->queues_.size() * BLOCKS_PER_THREAD);
+    if (maxBlocks <= 1 || this->queues_.size() == 1) {
+        func(begin, end);
+        return;
+    }
+
+    const size_t step = (total + maxBlocks - 1) / maxBlocks;
+    const size_t blocks = (total + step - 1) / step;
+
+    std::atomic<size_t> remaining(blocks);
+    for (size_t i = 1; i < blocks; ++i) {
+        push([&func, &remaining, begin, end, step, i]() {
+            func(begin + i * step, std::min(end, begin + (i + 1) * step));
+            remaining.fetch_sub(1, std::memory_order_release);
+        });
+    }
+    {
+        // 加锁之后再唤醒, 避免工作线程检查完条件还没开始等待时错过通知
+        std::lock_guard<std::mutex> lock(this->sleepMutex_);
+    }
+    this->wake_.notify_all();
+
+    func(begin, std::min(end, begin + step));
+    remaining.fetch_sub(1, std::memory_order_release);
+
+    const int index = currentPool == this ? currentIndex : this->size() - 1;
+    while (remaining.load(std::memory_order_acquire) != 0) {
+        if (!tryRun(index)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void cnn::runtime::ThreadPool::push(Task task) {
+    // 工作线程放进自己的队列, 外部线程轮流放进各个队列
+    const size_t index = currentPool == this ? currentIndex : this->next_++ % this->queues_.size();
+    {
+        std::lock_guard<std::mutex> lock(this->queues_[index]->mutex);
+        this->queues_[index]->tasks.emplace_back(std::move(task));
+    }
+    ++this->pending_;
+}
+
+/**
+ * @brief 先从自己队列的队尾取, 没有的话从其他队列的队头偷一个
+ * @return 是否执行了任务
+ */
+bool cnn::runtime::ThreadPool::tryRun(const int index) {
+    const int total = this->size();
+    for (int k = 0; k < total; ++k) {
+        Queue &queue = *this->queues_[(index + k) % total];
+        Task task;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (k == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        --this->pending_;
+        task();
+        return true;
+    }
+    return false;
+}
+
+void cnn::runtime::ThreadPool::workerLoop(const int index) {
+    currentPool = this;
+    currentIndex = index;
+    while (true) {
+        if (tryRun(index)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(this->sleepMutex_);
+        this->wake_.wait(lock, [this]() {
+            return this->stop_ || this->pending_.load() > 0;
+        });
+        if (this->stop_ && this->pending_.load() == 0) {
+            return;
+        }
+    }
+}
+
+cnn::runtime::ThreadPool &cnn::runtime::pool() {
+    if (ThreadPool *current = poolPointer.load(std::memory_order_acquire)) {
+        return *current;
+    }
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if (!globalPool) {
+        globalPool = std::make_unique<ThreadPool>(defaultThreads());
+        poolPointer.store(globalPool.get(), std::memory_order_release);
+        cv::setNumThreads(1);
+    }
+    return *globalPool;
+}
+
+/**
+ * @brief 只能在没有并行任务执行的时候调用, 一般在程序开始时设置一次
+ */
+void cnn::runtime::setNumThreads(const int threads, const int opencvThreads) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    const int total = threads > 0 ? threads : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    poolPointer.store(nullptr, std::memory_order_release);
+    globalPool = std::make_unique<ThreadPool>(total);
+    poolPointer.store(globalPool.get(), std::memory_order_release);
+    cv::setNumThreads(opencvThreads);
+}
+
+int cnn::runtime::getNumThreads() {
+    return pool().size();
+}
+
+void cnn::runtime::parallelFor(const size_t begin, const size_t end, const size_t grain,
+                               const std::function<void(size_t, size_t)> &func) {
+    pool().parallelFor(begin, end, grain, func);
+}
+
+void cnn::runtime::parallelFor(const size_t count, const std::function<void(size_t)> &func) {
+    pool().parallelFor(0, count, 1, [&func](const size_t begin, const size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            func(i);
+        }
+    });
+}
+
+int cnn::runtime::shardCount(const size_t work) {
+    return static_cast<int>(std::max<size_t>(1, std::min<size_t>(getNumThreads(), work)));
+}
+
+void cnn::runtime::GradientShards::reset(const int count, const size_t length) {
+    if (this->shards_.size() < static_cast<size_t>(count)) {
+        this->shards_.resize(count);
+    }
+    for (int i = 0; i < count; ++i) {
+        this->shards_[i].assign(length, 0);
+    }
+    this->length_ = length;
+    this->count_ = count;
+}
+
+int cnn::runtime::GradientShards::count() const {
+    return this->count_;
+}
+
+cnn::dataType *cnn::runtime::GradientShards::shard(const int index) {
+    assert(index < this->count_);
+    return this->shards_[index].data();
+}
+
+std::pair<size_t, size_t> cnn::runtime::GradientShards::range(const size_t total, const int index) const {
+    return {total * index / this->count_, total * (index + 1) / this->count_};
+}
+
+/**
+ * @brief 第 k 轮把第 i + 2^k 个分片加到第 i 个分片上 (i 是 2^(k+1) 的倍数), 加法的顺序固定.
+ * 不同位置的元素互不影响, 按元素分块并行, 每块内部走完整棵树
+ */
+const cnn::dataType *cnn::runtime::GradientShards::reduce() {
+    assert(this->count_ > 0);
+    parallelFor(0, this->length_, 4096, [this](const size_t begin, const size_t end) {
+        for (int stride = 1; stride < this->count_; stride *= 2) {
+            for (int i = 0; i + stride < this->count_; i += 2 * stride) {
+                dataType *dst = this->shards_[i].data();
+                const dataType *src = this->shards_[i + stride].data();
+                for (size_t j = begin; j < end; ++j) {
+                    dst[j] += src[j];
+                }
+            }
+        }
+    });
+    return this->shards_[0].data();
+}
+
+void cnn::runtime::GradientShards::release() {
+    std::vector<std::vector<dataType>>().swap(this->shards_);
+    this->length_ = 0;
+    this->count_ = 0;
+}
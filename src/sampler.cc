@@ -0,0 +1,74 @@
+#include<sampler.hpp>
+#include<algorithm>
+#include<cassert>
+#include<numeric>
+
+cnn::pipeline::Sampler::Sampler(const SampleMode mode, const uint32_t seed, const size_t blockSize,
+                                const size_t window, const uint32_t shards, const uint32_t shard) :
+        mode_(mode), seed_(seed), blockSize_(std::max<size_t>(blockSize, 1)), window_(std::max<size_t>(window, 1)),
+        shards_(shards), shard_(shard) {
+    assert(shards > 0 && shard < shards);
+}
+
+/**
+ * @brief 种子和轮数一起混合, 相邻两轮的顺序互不相关, 不同的种子之间也是
+ */
+std::default_random_engine cnn::pipeline::Sampler::engine(const uint64_t epoch) const {
+    std::seed_seq sequence{this->seed_, static_cast<uint32_t>(epoch), static_cast<uint32_t>(epoch >> 32)};
+    return std::default_random_engine(sequence);
+}
+
+/**
+ * @brief 所有读取者用同样的种子得到同样的块顺序, 再按位置轮流分配, 所以各自的块不重叠, 合起来是全部
+ */
+std::vector<size_t> cnn::pipeline::Sampler::blocks(const size_t count, std::default_random_engine &engine) const {
+    std::vector<size_t> all(count);
+    std::iota(all.begin(), all.end(), size_t(0));
+    if (this->mode_ != SampleMode::Sequential) {
+        std::shuffle(all.begin(), all.end(), engine);
+    }
+    if (this->shards_ == 1) {
+        return all;
+    }
+
+    std::vector<size_t> owned;
+    owned.reserve(count / this->shards_ + 1);
+    for (size_t i = this->shard_; i < count; i += this->shards_) {
+        owned.push_back(all[i]);
+    }
+    return owned;
+}
+
+/**
+ * @brief 块模式下, 块打乱之后拼接起来, 再把结果分成不重叠的窗口各自打乱. 一个窗口跨越 window / blockSize 个块,
+ * 任意时刻读取的位置只集中在这几个块里
+ */
+std::vector<size_t> cnn::pipeline::Sampler::order(const size_t size, const uint64_t epoch) const {
+    auto random = engine(epoch);
+    const size_t blockSize = this->mode_ == SampleMode::BlockShuffle ? this->blockSize_ : 1;
+    const size_t count = (size + blockSize - 1) / blockSize;
+
+    std::vector<size_t> result;
+    result.reserve(size / this->shards_ + blockSize);
+    for (const size_t block: blocks(count, random)) {
+        for (size_t i = block * blockSize; i < std::min(size, (block + 1) * blockSize); ++i) {
+            result.push_back(i);
+        }
+    }
+
+    if (this->mode_ == SampleMode::BlockShuffle) {
+        for (size_t begin = 0; begin < result.size(); begin += this->window_) {
+            const size_t end = std::min(result.size(), begin + this->window_);
+            std::shuffle(result.begin() + begin, result.begin() + end, random);
+        }
+    }
+    return result;
+}
+
+cnn::pipeline::SampleMode cnn::pipeline::Sampler::mode() const {
+    return this->mode_;
+}
+
+uint32_t cnn::pipeline::Sampler::seed() const {
+    return this->seed_;
+}
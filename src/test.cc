@@ -1,9 +1,25 @@
 #include<architectures.hpp>
+#include<func.hpp>
 #include<pipeline.hpp>
+#include<pooling.hpp>
+#include<runtime.hpp>
+#include<algorithm>
+#include<chrono>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
 #include<random>
 #include<vector>
 #include<opencv2/highgui.hpp>
 
+// 测试的检查不能用 assert, 默认的 Release 构建定义了 NDEBUG. 失败时打印位置和条件之后退出
+#define CHECK(condition)                                                                        \
+    do {                                                                                        \
+        if (!(condition)) {                                                                     \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            std::abort();                                                                       \
+        }                                                                                       \
+    } while (false)
 
 void augmentTest() {
     cnn::pipeline::ImageAugmentor augmentor({{"hflip",  1.0},
@@ -12,7 +28,7 @@ void augmentTest() {
                                              {"rotate", 1.0}});
     cv::Mat origin = cv::imread("../datasets/images/dog.jpg");
 
-    assert(!origin.empty());
+    CHECK(!origin.empty());
 
     cnn::pipeline::display(origin, "ok");
     augmentor.makeAugment(origin, true);
@@ -33,6 +49,45 @@ void augmentTest() {
     augmentor.makeAugment(origin, true);
 }
 
+void fusedAugmentTest() {
+    // 两次水平翻转合成之后是恒等变换
+    cnn::pipeline::Affine flip;
+    flip.m[0] = -1;
+    flip.m[2] = 99;
+    const auto identity = flip.then(flip);
+    CHECK(identity.m[0] == 1 && identity.m[2] == 0 && identity.m[4] == 1 && identity.m[5] == 0);
+
+    // 只有翻转且输出大小不变时, 一次 warpAffine 的结果和 cv::flip 逐位一致
+    cv::Mat origin(160, 200, CV_8UC3);
+    cv::randu(origin, 0, 256);
+    cnn::pipeline::ImageAugmentor augmentor({{"hflip", 1.0},
+                                             {"vflip", 1.0}});
+    cv::Mat expected, actual;
+    cv::flip(origin, expected, -1);
+    augmentor.augment(origin, origin.size(), actual);
+    CHECK(cv::norm(expected, actual, cv::NORM_INF) == 0);
+
+    // 全部操作时和逐个操作再缩放的耗时对比
+    cnn::pipeline::ImageAugmentor fused({{"hflip", 0.5}, {"vflip", 0.5}, {"crop", 1.0}, {"rotate", 1.0}});
+    cnn::pipeline::ImageAugmentor sequential({{"hflip", 0.5}, {"vflip", 0.5}, {"crop", 1.0}, {"rotate", 1.0}});
+    cv::Mat large(480, 640, CV_8UC3);
+    cv::randu(large, 0, 256);
+    std::chrono::duration<double, std::milli> fusedCost{0}, sequentialCost{0};
+    for (int i = 0; i < 50; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        fused.augment(large, {224, 224}, actual);
+        fusedCost += std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        expected = large.clone();
+        sequential.makeAugment(expected);
+        cv::resize(expected, expected, {224, 224});
+        sequentialCost += std::chrono::steady_clock::now() - start;
+    }
+    std::cout << "fused " << fusedCost.count() / 50 << " ms, resize after augment "
+              << sequentialCost.count() / 50 << " ms" << std::endl;
+}
+
 void dataLoaderTest() {
     std::cout << "OpenCV " << CV_VERSION << std::endl;
     // 指定一些参数
@@ -54,13 +109,390 @@ void dataLoaderTest() {
             std::cout << "[Batch " << i << "] " << " [" << b + 1 << "/" << trainBatchSize << "]===> "
                       << categories[labels[b]] << std::endl;
 
-            const auto origin = images[b]->opencvMat(3);
+            const auto origin = images.at(b)->opencvMat(3);
             cnn::pipeline::display(origin, "ok" + std::to_string(b));
         }
     }
 }
 
 
+void prefetchLoaderTest() {
+    // 预取得到的 batch 和同步读取的一样, 只是解码在后台线程进行
+    const int trainBatchSize = 4;
+    const std::tuple<uint32_t, uint32_t, uint32_t> imageSize({224, 224, 3});
+    const std::vector<std::string> categories({"dog", "panda", "bird"});
+    auto dataset = cnn::pipeline::getImagesForClassification("../datasets/animals", categories);
+
+    cnn::pipeline::DataLoader syncLoader(dataset["train"], trainBatchSize, false, true, imageSize);
+    cnn::pipeline::DataLoader prefetchLoader(dataset["train"], trainBatchSize, false, true, imageSize, 212, 4, 3);
+
+    for (int i = 0; i < 50; ++i) {
+        const auto expected = syncLoader.generateBatch();
+        const auto actual = prefetchLoader.generateBatch();
+        CHECK(expected.second == actual.second);
+        for (int b = 0; b < trainBatchSize; ++b) {
+            CHECK(std::memcmp(expected.first.data(b), actual.first.data(b),
+                              expected.first.sampleLength() * sizeof(float)) == 0);
+        }
+    }
+
+    const auto stats = prefetchLoader.stats();
+    std::cout << "batches " << stats.batches << " stalls " << stats.stalls << " stall " << stats.stallSeconds
+              << " s producer waits " << stats.producerWaits << std::endl;
+
+    // 增强的随机数由 batch 的序号决定, 和哪个线程解码无关
+    cnn::pipeline::DataLoader syncAugmented(dataset["train"], trainBatchSize, true, true, imageSize);
+    cnn::pipeline::DataLoader prefetchAugmented(dataset["train"], trainBatchSize, true, true, imageSize, 212, 4, 3);
+    for (int i = 0; i < 20; ++i) {
+        const auto expected = syncAugmented.generateBatch();
+        const auto actual = prefetchAugmented.generateBatch();
+        CHECK(expected.second == actual.second);
+        for (int b = 0; b < trainBatchSize; ++b) {
+            CHECK(std::memcmp(expected.first.data(b), actual.first.data(b),
+                              expected.first.sampleLength() * sizeof(float)) == 0);
+        }
+    }
+}
+
+void packedDatasetTest() {
+    // 从打包文件读取和直接解码图像文件得到的 batch 一致
+    const int batchSize = 4;
+    const std::tuple<uint32_t, uint32_t, uint32_t> imageSize({224, 224, 3});
+    const std::vector<std::string> categories({"dog", "panda", "bird"});
+    auto dataset = cnn::pipeline::getImagesForClassification("../datasets/animals", categories);
+
+    const std::filesystem::path file = std::filesystem::temp_directory_path() / "cnn_valid_test.pack";
+    auto start = std::chrono::steady_clock::now();
+    cnn::pipeline::packDataset(dataset["valid"], file, imageSize);
+    std::cout << "pack " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+              << " s" << std::endl;
+
+    auto source = std::make_shared<cnn::pipeline::PackedSource>(file);
+    CHECK(source->size() == dataset["valid"].size());
+
+    cnn::pipeline::DataLoader fileLoader(dataset["valid"], batchSize, false, true, imageSize);
+    cnn::pipeline::DataLoader packedLoader(source, batchSize, false, true, imageSize);
+
+    const int batches = (source->size() + batchSize - 1) / batchSize;
+    std::chrono::duration<double> fileCost{0}, packedCost{0};
+    for (int i = 0; i < batches; ++i) {
+        start = std::chrono::steady_clock::now();
+        const auto expected = fileLoader.generateBatch();
+        fileCost += std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        const auto actual = packedLoader.generateBatch();
+        packedCost += std::chrono::steady_clock::now() - start;
+
+        CHECK(expected.second == actual.second);
+        for (int b = 0; b < batchSize; ++b) {
+            CHECK(std::memcmp(expected.first.data(b), actual.first.data(b),
+                              expected.first.sampleLength() * sizeof(float)) == 0);
+        }
+    }
+    std::cout << "file " << fileCost.count() << " s, packed " << packedCost.count() << " s" << std::endl;
+    std::filesystem::remove(file);
+
+    // 有图像读不出来时抛出异常, 不留下打包文件
+    auto broken = dataset["valid"];
+    broken.emplace_back("../datasets/animals/missing.jpg", 0);
+    bool thrown = false;
+    try {
+        cnn::pipeline::packDataset(broken, file, imageSize);
+    } catch (const std::runtime_error &error) {
+        thrown = std::string(error.what()).find("missing.jpg") != std::string::npos;
+    }
+    CHECK(thrown && !std::filesystem::exists(file));
+}
+
+void manifestTest() {
+    // 清单保存再读取之后内容不变, 增量更新只重新索引新增的图像, 已有图像的划分不变
+    const auto root = std::filesystem::temp_directory_path() / "cnn_manifest_test";
+    std::filesystem::remove_all(root);
+    const std::vector<std::string> categories{"cat", "dog"};
+    cv::Mat image(48, 64, CV_8UC3, cv::Scalar(30, 60, 90));
+    for (const auto &category: categories) {
+        std::filesystem::create_directories(root / category);
+        for (int i = 0; i < 20; ++i) {
+            cv::imwrite((root / category / (std::to_string(i) + ".jpg")).string(), image);
+        }
+    }
+
+    const auto file = root / "manifest.tsv";
+    cnn::pipeline::DatasetManifest manifest(root, categories);
+    CHECK(manifest.update() == 40);
+    CHECK(manifest.update() == 0);
+    manifest.save(file);
+
+    const auto loaded = cnn::pipeline::DatasetManifest::load(file);
+    CHECK(loaded.entries().size() == 40);
+    for (size_t i = 0; i < 40; ++i) {
+        const auto &expected = manifest.entries()[i];
+        const auto &actual = loaded.entries()[i];
+        CHECK(expected.path == actual.path && expected.label == actual.label && expected.split == actual.split &&
+              expected.hash == actual.hash && actual.width == 64 && actual.height == 48);
+    }
+
+    cv::imwrite((root / "dog" / "new.png").string(), image);
+    const auto before = loaded.splits();
+    auto splits = cnn::pipeline::getImagesForClassification(root, categories, file, true);
+    CHECK(cnn::pipeline::DatasetManifest::load(file).entries().size() == 41);
+    size_t total = 0;
+    for (const auto &[split, images]: before) {
+        for (const auto &image: images) {
+            CHECK(std::find(splits[split].begin(), splits[split].end(), image) != splits[split].end());
+        }
+        total += splits[split].size();
+    }
+    CHECK(total == 41);
+    std::filesystem::remove_all(root);
+}
+
+void imageCacheTest() {
+    // 超过容量时淘汰最久没有使用的图像; 分辨率不够的缓存不算命中
+    cnn::pipeline::ImageCache cache(3 * 100 * 100 * 3);
+    const cv::Mat image(100, 100, CV_8UC3);
+    cache.insert("a", image, {50, 50});
+    cache.insert("b", image, {50, 50});
+    cache.insert("c", image, {50, 50});
+    CHECK(!cache.find("a", {50, 50}).empty());
+    cache.insert("d", image, {50, 50});
+    CHECK(cache.find("b", {50, 50}).empty());
+    CHECK(!cache.find("a", {50, 50}).empty() && !cache.find("c", {50, 50}).empty());
+    CHECK(cache.find("c", {80, 80}).empty());
+    auto stats = cache.stats();
+    CHECK(stats.images == 3 && stats.bytes == 3 * 100 * 100 * 3 && stats.evictions == 1);
+    CHECK(stats.hits == 3 && stats.misses == 2);
+
+    // 第二轮开始全部命中, 读出的 batch 和不用缓存时一样; 训练集和验证集共享同一个缓存
+    const int batchSize = 4;
+    const std::tuple<uint32_t, uint32_t, uint32_t> imageSize({224, 224, 3});
+    const std::vector<std::string> categories({"dog", "panda", "bird"});
+    auto dataset = cnn::pipeline::getImagesForClassification("../datasets/animals", categories);
+    const auto &valid = dataset["valid"];
+
+    auto shared = std::make_shared<cnn::pipeline::ImageCache>(size_t(512) << 20);
+    cnn::pipeline::DataLoader plainLoader(valid, batchSize, false, false, imageSize);
+    cnn::pipeline::DataLoader cachedLoader(valid, batchSize, false, false, imageSize, 212, 2, 2);
+    cnn::pipeline::DataLoader trainLoader(dataset["train"], batchSize, true, true, imageSize, 212, 2, 2);
+    cachedLoader.setCache(shared);
+    trainLoader.setCache(shared);
+
+    const int batches = valid.size() / batchSize;
+    std::chrono::duration<double> cost[2]{};
+    for (int epoch = 0; epoch < 2; ++epoch) {
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < batches; ++i) {
+            const auto expected = plainLoader.generateBatch();
+            const auto actual = cachedLoader.generateBatch();
+            for (int b = 0; b < batchSize; ++b) {
+                CHECK(std::memcmp(expected.first.data(b), actual.first.data(b),
+                                  expected.first.sampleLength() * sizeof(float)) == 0);
+            }
+        }
+        cost[epoch] = std::chrono::steady_clock::now() - start;
+    }
+    for (int i = 0; i < 10; ++i) {
+        trainLoader.generateBatch();
+    }
+    stats = shared->stats();
+    std::cout << "cache hits " << stats.hits << " misses " << stats.misses << " images " << stats.images
+              << " bytes " << stats.bytes << ", epoch 1 " << cost[0].count() << " s, epoch 2 " << cost[1].count()
+              << " s" << std::endl;
+}
+
+void samplerTest() {
+    // 每种模式每一轮都是一个排列, 同样的轮数顺序相同; 分片之间不重叠, 合起来是全部; 块模式下一个窗口只跨越少数几个块
+    const size_t size = 1000, blockSize = 16, window = 64;
+    for (const auto mode: {cnn::pipeline::SampleMode::Sequential, cnn::pipeline::SampleMode::Shuffle,
+                           cnn::pipeline::SampleMode::BlockShuffle}) {
+        const cnn::pipeline::Sampler sampler(mode, 7, blockSize, window);
+        for (uint64_t epoch = 0; epoch < 3; ++epoch) {
+            auto order = sampler.order(size, epoch);
+            CHECK(order == sampler.order(size, epoch));
+            if (mode != cnn::pipeline::SampleMode::Sequential) {
+                CHECK(order != sampler.order(size, epoch + 1));
+            }
+            if (mode == cnn::pipeline::SampleMode::BlockShuffle) {
+                for (size_t begin = 0; begin < size; begin += window) {
+                    std::vector<size_t> blocks;
+                    for (size_t i = begin; i < std::min(size, begin + window); ++i) {
+                        blocks.push_back(order[i] / blockSize);
+                    }
+                    std::sort(blocks.begin(), blocks.end());
+                    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+                    CHECK(blocks.size() <= window / blockSize + 1);
+                }
+            }
+            std::sort(order.begin(), order.end());
+            for (size_t i = 0; i < size; ++i) {
+                CHECK(order[i] == i);
+            }
+        }
+
+        std::vector<int> seen(size, 0);
+        for (uint32_t shard = 0; shard < 3; ++shard) {
+            for (const size_t index: cnn::pipeline::Sampler(mode, 7, blockSize, window, 3, shard).order(size, 5)) {
+                ++seen[index];
+            }
+        }
+        CHECK(std::all_of(seen.begin(), seen.end(), [](const int count) { return count == 1; }));
+    }
+}
+
+void tarShardTest() {
+    // 不打乱时 tar 分片和图像文件读出的 batch 一致; 打乱时每一轮每张图像恰好出现一次, 而且都是顺序读取
+    const auto root = std::filesystem::temp_directory_path() / "cnn_shard_test";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "images");
+    cnn::pipeline::listType images;
+    for (int i = 0; i < 50; ++i) {
+        cv::Mat image(40 + i, 60, CV_8UC3, cv::Scalar(i, 2 * i, 3 * i));
+        const auto path = (root / "images" / (std::to_string(i) + ".png")).string();
+        cv::imwrite(path, image);
+        images.emplace_back(path, i % 3);
+    }
+    const auto shards = cnn::pipeline::writeShards(images, root / "shards", 8);
+    const std::tuple<uint32_t, uint32_t, uint32_t> imageSize({32, 32, 3});
+
+    cnn::pipeline::DataLoader fileLoader(images, 5, false, false, imageSize);
+    cnn::pipeline::DataLoader shardLoader(std::make_shared<cnn::pipeline::TarShardSource>(shards, 16), 5, false,
+                                          false, imageSize);
+    for (int i = 0; i < 10; ++i) {
+        const auto expected = fileLoader.generateBatch();
+        const auto actual = shardLoader.generateBatch();
+        CHECK(expected.second == actual.second);
+        for (int b = 0; b < 5; ++b) {
+            CHECK(std::memcmp(expected.first.data(b), actual.first.data(b),
+                              expected.first.sampleLength() * sizeof(float)) == 0);
+        }
+    }
+
+    auto source = std::make_shared<cnn::pipeline::TarShardSource>(shards, 16);
+    cnn::pipeline::DataLoader shuffled(source, 5, false, true, imageSize);
+    for (int epoch = 0; epoch < 3; ++epoch) {
+        std::vector<int> counts(3, 0);
+        for (int i = 0; i < 10; ++i) {
+            for (const int label: shuffled.generateBatch().second) {
+                ++counts[label];
+            }
+        }
+        CHECK(counts[0] == 17 && counts[1] == 17 && counts[2] == 16);
+    }
+    CHECK(source->randomReads() == 0);
+
+    // 预取时新的一轮开始之后, 上一轮还没解码完的样本仍然从缓冲区中取得, 内容和同步读取一样
+    auto prefetchSource = std::make_shared<cnn::pipeline::TarShardSource>(shards, 16);
+    cnn::pipeline::DataLoader syncShuffled(std::make_shared<cnn::pipeline::TarShardSource>(shards, 16), 5, false,
+                                           true, imageSize);
+    cnn::pipeline::DataLoader prefetchShuffled(prefetchSource, 5, false, true, imageSize, 212, 3, 3);
+    for (int i = 0; i < 30; ++i) {
+        const auto expected = syncShuffled.generateBatch();
+        const auto actual = prefetchShuffled.generateBatch();
+        CHECK(expected.second == actual.second);
+        for (int b = 0; b < 5; ++b) {
+            CHECK(std::memcmp(expected.first.data(b), actual.first.data(b),
+                              expected.first.sampleLength() * sizeof(float)) == 0);
+        }
+    }
+    std::cout << "prefetch random reads " << prefetchSource->randomReads() << std::endl;
+
+    // 两个读取者按分片划分, 每一轮各自的顺序不相交, 合起来覆盖所有样本, 每个样本都能解码
+    std::vector<std::unique_ptr<cnn::pipeline::TarShardSource>> readers;
+    std::vector<cnn::pipeline::Sampler> samplers;
+    for (uint32_t shard = 0; shard < 2; ++shard) {
+        readers.push_back(std::make_unique<cnn::pipeline::TarShardSource>(shards, 16));
+        samplers.emplace_back(cnn::pipeline::SampleMode::BlockShuffle, 1, 1, 4, 2, shard);
+    }
+    for (uint64_t epoch = 0; epoch < 3; ++epoch) {
+        std::vector<int> owners(images.size(), -1);
+        for (int shard = 0; shard < 2; ++shard) {
+            std::vector<size_t> order;
+            readers[shard]->arrange(order, samplers[shard], epoch);
+            CHECK(!order.empty());
+            for (const size_t index: order) {
+                CHECK(owners[index] == -1);
+                owners[index] = shard;
+                CHECK(!readers[shard]->decode(index).empty());
+            }
+        }
+        CHECK(std::count(owners.begin(), owners.end(), -1) == 0);
+    }
+    // 不在自己这一轮中的样本也能单独读取
+    for (size_t index = 0; index < readers[0]->size(); ++index) {
+        CHECK(!readers[0]->decode(index).empty());
+    }
+    std::filesystem::remove_all(root);
+}
+
+void reducedDecodeTest() {
+    // 文件头中的尺寸足够大时按缩小的分辨率解码, 宽高仍然不小于要求的大小
+    cv::Mat origin(1000, 1600, CV_8UC3);
+    cv::randu(origin, 0, 256);
+    const std::string file = (std::filesystem::temp_directory_path() / "cnn_reduced_test.jpg").string();
+    cv::imwrite(file, origin);
+
+    auto start = std::chrono::steady_clock::now();
+    cv::Mat full = cv::imread(file);
+    cv::resize(full, full, {224, 224});
+    const std::chrono::duration<double, std::milli> fullCost = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    cv::Mat reduced = cnn::pipeline::readImage(file, {320, 320});
+    cv::resize(reduced, reduced, {224, 224});
+    const std::chrono::duration<double, std::milli> reducedCost = std::chrono::steady_clock::now() - start;
+
+    // 1000 / 2 = 500 >= 320, 1000 / 4 = 250 < 320, 只能缩小一半; 要求更小时缩小到 1/8
+    CHECK(cnn::pipeline::readImage(file, {320, 320}).size() == cv::Size(800, 500));
+    CHECK(cnn::pipeline::readImage(file, {200, 100}).size() == cv::Size(200, 125));
+    CHECK(cnn::pipeline::readImage(file).size() == origin.size());
+    std::cout << "full decode " << fullCost.count() << " ms, reduced decode " << reducedCost.count() << " ms"
+              << std::endl;
+    std::filesystem::remove(file);
+}
+
+void convertTest() {
+    // 向量化的通道拆分和归一化要和逐个像素按定义计算的结果一致, 像素个数故意不是 16 的倍数
+    const uint32_t height = 223, width = 225, size = height * width;
+    std::default_random_engine e(3);
+    std::uniform_int_distribution<int> engine(0, 255);
+    std::vector<uchar> image(3 * size);
+    for (auto &pixel: image) {
+        pixel = engine(e);
+    }
+
+    const std::vector<cnn::dataType> mean{0.406, 0.456, 0.485};
+    const std::vector<cnn::dataType> std{0.225, 0.224, 0.229};
+
+    cnn::Tensor3D scaled(3, height, width);
+    cnn::Tensor3D fused(3, height, width);
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100; ++i) {
+        fused.readData(image.data(), size, mean, std);
+    }
+    std::cout << "fused convert " << std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count() / 100 << " ms" << std::endl;
+    scaled.readData(image.data(), size);
+
+    float maxError = 0, maxNormError = 0;
+    for (int c = 0; c < 3; ++c) {
+        for (uint32_t i = 0; i < size; ++i) {
+            const double value = image[3 * i + c] / 255.0;
+            maxError = std::max<float>(maxError, std::abs(scaled.getData()[c * size + i] - value));
+            maxNormError = std::max<float>(maxNormError, std::abs(fused.getData()[c * size + i] -
+                                                                  (value - mean[c]) / std[c]));
+        }
+    }
+
+    // 分两次做的归一化, 每个通道的平面都要被处理到
+    scaled.normalize(mean, std);
+    for (uint32_t i = 0; i < 3 * size; ++i) {
+        maxNormError = std::max(maxNormError, std::abs(scaled.getData()[i] - fused.getData()[i]));
+    }
+    std::cout << "convert max error " << maxError << " normalize max error " << maxNormError << std::endl;
+    CHECK(maxError < 1e-6 && maxNormError < 1e-5);
+}
+
 void tensorTest() {
     cnn::Tensor3D t(3, 5, 5);
     cv::Mat original = cv::imread("../datasets/images/dog.jpg");
@@ -76,11 +508,41 @@ void tensorTest() {
 }
 
 
+void tensorViewTest() {
+    // 视图的填充, 翻转, 切片和 reshape 都不复制数据, 读出的结果要和按定义计算的一致
+    cnn::Tensor3D t(2, 3, 4);
+    for (uint32_t i = 0; i < t.length(); ++i) {
+        t.getData()[i] = i;
+    }
+
+    const auto view = t.view();
+    const auto padded = view.padded(1);
+    CHECK(padded.getHeight() == 5 && padded.getWidth() == 6);
+    CHECK(padded.at(0, 0, 0) == 0 && padded.at(1, 4, 5) == 0);
+    CHECK(padded.at(1, 1, 1) == t.getData()[12]);
+
+    const auto rotated = view.rot180();
+    for (int c = 0; c < 2; ++c) {
+        for (int y = 0; y < 3; ++y) {
+            for (int x = 0; x < 4; ++x) {
+                CHECK(rotated.at(c, y, x) == t.getData()[c * 12 + (2 - y) * 4 + (3 - x)]);
+            }
+        }
+    }
+
+    const auto channel = view.slice(1, 2);
+    CHECK(channel.getChannels() == 1 && channel.at(0, 0, 0) == 12);
+    CHECK(view.flatten().shape() == std::make_tuple(24u, 1u, 1u) && view.flatten().data() == t.getData());
+
+    // 拷贝出来的结果和视图一致
+    auto pad = t.padding(1);
+    CHECK(pad->getData()[0] == 0 && pad->getData()[30 + 7] == 12);
+    t.rot180()->print(1);
+}
+
 void ReLUTest() {
-    std::vector<cnn::tensor> input;
     std::tuple<uint32_t, uint32_t, uint32_t> shape{16, 7, 7};
-
-    input.emplace_back(new cnn::Tensor3D(shape));
+    cnn::Tensor4D input(1, shape);
 
     //随机数生成引擎
     std::default_random_engine e;
@@ -90,42 +552,69 @@ void ReLUTest() {
     std::normal_distribution<float> engine(0.0, 1.0);
 
     // 初始化
-    cnn::dataType *dataPtr = input.front()->getData();
-    const int length = input.front()->length();
+    cnn::dataType *dataPtr = input.data(0);
+    const int length = input.sampleLength();
 
     for (int i = 0; i < length; ++i) {
         dataPtr[i] = engine(e);
     }
 
     // 打印第 0 张图像特征的第三个通道
-    input.front()->print(1);
+    input.at(0)->print(1);
 
     // 声明ReLU 层
 
     cnn::architectures::ReLU reLu("relu_test");
-    auto out = reLu.forward(input);
-    out.front()->print(1);
+    const auto &out = reLu.forward(input);
+    out.at(0)->print(1);
 
     // 模拟反向传播回来的 delta
-    std::vector<cnn::tensor> delta({cnn::tensor(std::make_shared<cnn::Tensor3D>(shape))});
+    cnn::Tensor4D delta(1, shape);
     for (int i = 0; i < length; ++i) {
-        delta.front()->getData()[i] = engine(e);
+        delta.data(0)[i] = engine(e);
     }
 
-    delta.front()->print(1);
+    delta.at(0)->print(1);
 
     // 计算反向传播
-    auto deltaBackward = reLu.backward(delta);
+    auto &deltaBackward = reLu.backward(delta);
 
-    deltaBackward.front()->print(1);
+    deltaBackward.at(0)->print(1);
+}
+
+void reluInPlaceTest() {
+    // 原地计算的 ReLU 和写到 output_ 的结果一样, 返回的就是输入本身
+    std::default_random_engine e(11);
+    std::normal_distribution<float> engine(0.0, 1.0);
+    cnn::Tensor4D input(2, 16, 9, 9);
+    cnn::Tensor4D copy(2, 16, 9, 9);
+    cnn::Tensor4D delta(2, 16, 9, 9);
+    cnn::Tensor4D deltaCopy(2, 16, 9, 9);
+    for (uint32_t b = 0; b < input.getBatch(); ++b) {
+        for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+            input.data(b)[i] = copy.data(b)[i] = engine(e);
+            delta.data(b)[i] = deltaCopy.data(b)[i] = engine(e);
+        }
+    }
+
+    cnn::architectures::ReLU relu("relu");
+    cnn::architectures::ReLU inPlace("relu_in_place", true);
+    const auto &expected = relu.forward(input);
+    const auto &actual = inPlace.forward(copy);
+    CHECK(&actual == &copy);
+    const auto &expectedDelta = relu.backward(delta);
+    const auto &actualDelta = inPlace.backward(deltaCopy);
+    const size_t sampleBytes = input.sampleLength() * sizeof(cnn::dataType);
+    for (uint32_t b = 0; b < input.getBatch(); ++b) {
+        CHECK(std::memcmp(expected.data(b), actual.data(b), sampleBytes) == 0);
+        CHECK(std::memcmp(expectedDelta.data(b), actualDelta.data(b), sampleBytes) == 0);
+    }
 }
 
 
 void maxPool2DTest() {
-    std::vector<cnn::tensor> input;
     std::tuple<uint32_t, uint32_t, uint32_t> shape{1, 6, 6};
-
-    input.emplace_back(std::make_shared<cnn::Tensor3D>(shape));
+    cnn::Tensor4D input(1, shape);
 
     std::default_random_engine e;
     e.seed(std::chrono::steady_clock::now().time_since_epoch().count());
@@ -133,45 +622,43 @@ void maxPool2DTest() {
     std::normal_distribution<float> engine(0, 1);
 
     // 初始化
-    cnn::dataType *dataPtr = input.front()->getData();
-    int length = input.front()->length();
+    cnn::dataType *dataPtr = input.data(0);
+    int length = input.sampleLength();
 
     for (int i = 0; i < length; ++i) {
         dataPtr[i] = engine(e);
     }
 
     const int channel = 1;
-    input.front()->print(channel);
+    input.at(0)->print(channel);
 
     //声明 MaxPool 层
     cnn::architectures::MaxPool2D maxPool2D("maxPoolTest", 2, 2);
 
-    auto out = maxPool2D.forward(input);
+    const auto &out = maxPool2D.forward(input);
 
-    out.front()->print(channel);
-    out.front()->printShape();
+    out.at(0)->print(channel);
+    out.printShape();
 
     // 模拟反向传播也就是下一层传回来的梯度
     shape = {1, 3, 3};
-    std::vector<cnn::tensor> delta({std::make_shared<cnn::Tensor3D>(shape)});
+    cnn::Tensor4D delta(1, shape);
 
-    length = delta.front()->length();
+    length = delta.sampleLength();
     for (int i = 0; i < length; ++i) {
-        delta.front()->getData()[i] = engine(e);
+        delta.data(0)[i] = engine(e);
     }
 
-    delta.front()->print(channel);
+    delta.at(0)->print(channel);
 
-    auto deltaBackward = maxPool2D.backward(delta);
-    deltaBackward.front()->print(channel);
+    auto &deltaBackward = maxPool2D.backward(delta);
+    deltaBackward.at(0)->print(channel);
 
 }
 
 void Conv2DTest() {
-    std::vector<cnn::tensor> input;
     std::tuple<uint32_t, uint32_t, uint32_t> shape{3, 224, 224};
-
-    input.emplace_back(std::make_shared<cnn::Tensor3D>(shape));
+    cnn::Tensor4D input(1, shape);
 
     std::default_random_engine e;
     e.seed(std::chrono::steady_clock::now().time_since_epoch().count());
@@ -179,36 +666,146 @@ void Conv2DTest() {
     std::normal_distribution<float> engine(0, 1);
 
     // 初始化
-    cnn::dataType *dataPtr = input.front()->getData();
-    int length = input.front()->length();
+    cnn::dataType *dataPtr = input.data(0);
+    int length = input.sampleLength();
 
     for (int i = 0; i < length; ++i) {
         dataPtr[i] = engine(e);
     }
 
     const int channel = 1;
-    //input.front()->print(channel);
+    //input.at(0)->print(channel);
 
     cnn::architectures::Conv2D conv2D("conv_test", 16, 3, 3, 3);
-    auto out = conv2D.forward(input);
+    const auto &out = conv2D.forward(input);
+
+    //out.at(0)->print(1);
+    out.printShape();
+
+
+}
+
+void Conv2DGemmTest() {
+    // 同样的卷积层配置, 权重初始化的种子也一样, 分别用直接卷积和 im2col+GEMM 计算
+    const std::vector<std::tuple<int, int, int, int, int>> configs{{3,  16, 224, 2, 0},
+                                                                   {16, 32, 55,  2, 0},
+                                                                   {32, 64, 27,  1, 0},
+                                                                   {16, 32, 28,  2, 1},
+                                                                   {32, 64, 13,  1, 1}};
+
+    std::default_random_engine e(1024);
+    std::normal_distribution<float> engine(0, 1);
 
-    //out.front()->print(1);
-    out.front()->printShape();
+    for (const auto &[inChannels, outChannels, size, stride, padding]: configs) {
+        cnn::Tensor4D input(2, inChannels, size, size);
+        for (uint32_t b = 0; b < input.getBatch(); ++b) {
+            for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+                input.data(b)[i] = engine(e);
+            }
+        }
+
+        cnn::architectures::Conv2D direct("conv_direct", inChannels, outChannels, 3, stride, padding,
+                                          cnn::architectures::ConvAlgorithm::Direct);
+        cnn::architectures::Conv2D gemm("conv_gemm", inChannels, outChannels, 3, stride, padding,
+                                        cnn::architectures::ConvAlgorithm::Im2col);
+
+        const auto &expected = direct.forward(input);
+        const auto &actual = gemm.forward(input);
+
+        float maxError = 0;
+        for (uint32_t b = 0; b < input.getBatch(); ++b) {
+            for (uint32_t i = 0; i < expected.sampleLength(); ++i) {
+                maxError = std::max(maxError, std::abs(expected.data(b)[i] - actual.data(b)[i]));
+            }
+        }
+        actual.printShape();
+        std::cout << "forward max error " << maxError << std::endl;
+        CHECK(maxError < 1e-4);
+
+        // 反向传播: 传给上一层的梯度要一致, 更新之后的权重也要一致
+        cnn::Tensor4D delta(input.getBatch(), expected.sampleShape());
+        for (uint32_t b = 0; b < delta.getBatch(); ++b) {
+            for (uint32_t i = 0; i < delta.sampleLength(); ++i) {
+                delta.data(b)[i] = engine(e);
+            }
+        }
+
+        const auto &expectedDelta = direct.backward(delta);
+        const auto &actualDelta = gemm.backward(delta);
+        maxError = 0;
+        for (uint32_t b = 0; b < input.getBatch(); ++b) {
+            for (uint32_t i = 0; i < expectedDelta.sampleLength(); ++i) {
+                maxError = std::max(maxError, std::abs(expectedDelta.data(b)[i] - actualDelta.data(b)[i]));
+            }
+        }
+        std::cout << "backward max error " << maxError << std::endl;
+        CHECK(maxError < 1e-4);
+
+        direct.updateGradients(1e-2);
+        gemm.updateGradients(1e-2);
+        // 输出缓冲区由层持有, 再次前向之后 expected 和 actual 引用的就是新的结果
+        direct.forward(input);
+        gemm.forward(input);
+        maxError = 0;
+        for (uint32_t b = 0; b < input.getBatch(); ++b) {
+            for (uint32_t i = 0; i < expected.sampleLength(); ++i) {
+                maxError = std::max(maxError, std::abs(expected.data(b)[i] - actual.data(b)[i]));
+            }
+        }
+        std::cout << "updated max error " << maxError << std::endl;
+        CHECK(maxError < 1e-3);
+    }
+}
+
+void Conv2DWinogradTest() {
+    // stride=1 的 3x3 卷积, 输出尺寸故意取不能被 tile 整除的大小, 检查边界上的块
+    const std::vector<std::tuple<int, int, int, int>> configs{{3,  16,  31, 0},
+                                                              {16, 32,  27, 0},
+                                                              {64, 128, 13, 0},
+                                                              {16, 32,  27, 1}};
+
+    std::default_random_engine e(2048);
+    std::normal_distribution<float> engine(0, 1);
 
+    for (const auto &[inChannels, outChannels, size, padding]: configs) {
+        cnn::Tensor4D input(2, inChannels, size, size);
+        for (uint32_t b = 0; b < input.getBatch(); ++b) {
+            for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+                input.data(b)[i] = engine(e);
+            }
+        }
 
+        cnn::architectures::Conv2D direct("conv_direct", inChannels, outChannels, 3, 1, padding,
+                                          cnn::architectures::ConvAlgorithm::Direct);
+        const auto &expected = direct.forward(input);
+
+        for (const auto algorithm: {cnn::architectures::ConvAlgorithm::Winograd2x2,
+                                    cnn::architectures::ConvAlgorithm::Winograd4x4}) {
+            cnn::architectures::Conv2D winograd("conv_winograd", inChannels, outChannels, 3, 1, padding, algorithm);
+            const auto &actual = winograd.forward(input);
+
+            // 相对误差, 以输出的最大绝对值为基准
+            float maxError = 0, maxValue = 0;
+            for (uint32_t b = 0; b < input.getBatch(); ++b) {
+                for (uint32_t i = 0; i < expected.sampleLength(); ++i) {
+                    maxValue = std::max(maxValue, std::abs(expected.data(b)[i]));
+                    maxError = std::max(maxError, std::abs(expected.data(b)[i] - actual.data(b)[i]));
+                }
+            }
+            actual.printShape();
+            std::cout << "winograd relative error " << maxError / maxValue << std::endl;
+            CHECK(maxError / maxValue < 1e-4);
+        }
+    }
 }
 
 void AlexNetTest() {
     cnn::architectures::AlexNet alexNet(3, false);
     alexNet.printInfo = true;
 
-    std::vector<cnn::tensor> input;
-
     const int batchSize = 1;
 
-    for (int i = 0; i < batchSize; ++i) {
-        input.emplace_back(std::make_shared<cnn::Tensor3D>(3, 9, 9));
-    }
+    cnn::Tensor4D input(batchSize, 3, 9, 9);
 
     std::default_random_engine e;
     e.seed(std::chrono::steady_clock::now().time_since_epoch().count());
@@ -216,40 +813,578 @@ void AlexNetTest() {
     std::uniform_int_distribution<int> engine(0, 200);
 
     // 初始化
-    cnn::dataType *dataPtr = input.front()->getData();
-    int length = input.front()->length();
+    cnn::dataType *dataPtr = input.data(0);
+    int length = input.sampleLength();
 
     for (int i = 0; i < length; ++i) {
         dataPtr[i] = engine(e);
     }
 
-    auto out = alexNet.forward(input);
+    const auto &out = alexNet.forward(input);
 
     cnn::architectures::printTensor(out);
 
 
-    std::vector<cnn::tensor> delta;
+    cnn::Tensor4D delta(batchSize, 3, 1, 1, "delta_from_loss");
+
+    alexNet.backward(delta);
+}
 
-    for (int i = 0; i < batchSize; ++i) {
-        delta.emplace_back(std::make_shared<cnn::Tensor3D>(3, 1, 1, "delta_from_loss" + std::to_string(i)));
+void dynamicShapeTest() {
+    // batch 大小和分辨率来回切换时, 同一组层的结果和每种形状新建的层一致, 切换回来的缓冲区从缓存中复用
+    auto *caching = new cnn::memory::CachingAllocator(cnn::memory::defaultAllocator());
+    cnn::memory::setDefaultAllocator(caching);
+    {
+        cnn::architectures::Conv2D conv("conv", 3, 8, 3, 1, 1);
+        cnn::architectures::ReLU relu("relu");
+        cnn::architectures::MaxPool2D pool("pool", 2, 2);
+
+        std::default_random_engine e(5);
+        std::normal_distribution<float> engine(0, 1);
+        // (batch, 边长)
+        const std::vector<std::pair<uint32_t, uint32_t>> shapes{{3, 32},
+                                                                {5, 32},
+                                                                {3, 32},
+                                                                {2, 48},
+                                                                {5, 32}};
+        for (int round = 0; round < 2; ++round) {
+            for (const auto &[batch, size]: shapes) {
+                cnn::Tensor4D input(batch, 3, size, size);
+                for (uint32_t b = 0; b < batch; ++b) {
+                    for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+                        input.data(b)[i] = engine(e);
+                    }
+                }
+
+                const auto &out = pool.forward(relu.forward(conv.forward(input)));
+
+                cnn::architectures::Conv2D freshConv("conv", 3, 8, 3, 1, 1);
+                cnn::architectures::ReLU freshRelu("relu");
+                cnn::architectures::MaxPool2D freshPool("pool", 2, 2);
+                const auto &expected = freshPool.forward(freshRelu.forward(freshConv.forward(input)));
+                CHECK(out.getBatch() == batch && out.sampleShape() == expected.sampleShape());
+                for (uint32_t b = 0; b < batch; ++b) {
+                    CHECK(std::memcmp(out.data(b), expected.data(b), out.sampleLength() * sizeof(float)) == 0);
+                }
+            }
+        }
     }
+    const auto stats = caching->stats();
+    std::cout << "allocations " << stats.allocations << " cache hits " << stats.cacheHits << " cached "
+              << stats.cachedBytes << " bytes" << std::endl;
+    CHECK(stats.cacheHits > 0);
+    cnn::memory::setDefaultAllocator(nullptr);
+}
 
-    alexNet.backward(delta);
+void batchedEvalTest() {
+    // 验证时按 batch 不求梯度的前向和逐张计算的结果一致, 之后恢复训练也不受影响
+    cnn::architectures::AlexNet alexNet(3, false);
+    const int batchSize = 5;
+    cnn::Tensor4D input(batchSize, 3, 224, 224);
+    std::default_random_engine e(11);
+    std::uniform_real_distribution<float> engine(0, 1);
+    for (int b = 0; b < batchSize; ++b) {
+        for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+            input.data(b)[i] = engine(e);
+        }
+    }
+
+    const auto trainOut = alexNet.forward(input.slice(0, 2)).flatten();
+    std::vector<float> expected(trainOut.getData(), trainOut.getData() + 2 * trainOut.sampleStride());
+    {
+        cnn::architectures::WithOutGrad guard;
+        std::vector<float> single;
+        for (int b = 0; b < batchSize; ++b) {
+            const auto &out = alexNet.forward(input.slice(b, b + 1));
+            single.insert(single.end(), out.data(0), out.data(0) + out.sampleLength());
+        }
+        const auto &batched = alexNet.forward(input);
+        for (int b = 0; b < batchSize; ++b) {
+            for (uint32_t i = 0; i < batched.sampleLength(); ++i) {
+                CHECK(std::abs(batched.data(b)[i] - single[b * batched.sampleLength() + i]) < 1e-4);
+            }
+        }
+    }
+    const auto &again = alexNet.forward(input.slice(0, 2));
+    for (int b = 0; b < 2; ++b) {
+        CHECK(std::memcmp(again.data(b), expected.data() + b * trainOut.sampleStride(),
+                          again.sampleLength() * sizeof(float)) == 0);
+    }
+
+    // 最后一个 batch 只包含这一轮剩下的图像, 之后从下一轮的开头继续
+    const std::vector<std::string> categories({"dog", "panda", "bird"});
+    auto dataset = cnn::pipeline::getImagesForClassification("../datasets/animals", categories);
+    const auto &valid = dataset["valid"];
+    for (const int workers: {0, 2}) {
+        cnn::pipeline::DataLoader loader(valid, 4, false, false, {224, 224, 3}, 212, workers);
+        loader.setPartialLastBatch();
+        const int batches = loader.batchesPerEpoch();
+        CHECK(static_cast<size_t>(batches) == (valid.size() + 3) / 4);
+        for (int epoch = 0; epoch < 2; ++epoch) {
+            size_t seen = 0;
+            for (int i = 0; i < batches; ++i) {
+                const auto batch = loader.generateBatch();
+                CHECK(batch.first.getBatch() == batch.second.size());
+                for (const int label: batch.second) {
+                    CHECK(label == valid[seen++].second);
+                }
+            }
+            CHECK(seen == valid.size());
+        }
+    }
+}
+
+void memoryPlanTest() {
+    // 规划之后同时存活的缓冲区不能有重叠的内存
+    cnn::architectures::AlexNet alexNet(3, true);
+    cnn::Tensor4D input(2, 3, 224, 224);
+    for (uint32_t b = 0; b < input.getBatch(); ++b) {
+        for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+            input.data(b)[i] = (i % 255) / 255.f;
+        }
+    }
+
+    const auto check = [&alexNet]() {
+        const auto &requests = alexNet.memoryPlan().requests();
+        for (size_t i = 0; i < requests.size(); ++i) {
+            for (size_t j = i + 1; j < requests.size(); ++j) {
+                const auto &a = requests[i];
+                const auto &b = requests[j];
+                const bool alive = a.begin <= b.end && b.begin <= a.end;
+                const bool shared = a.offset < b.offset + b.bytes && b.offset < a.offset + a.bytes;
+                if (alive && shared) {
+                    std::cout << a.name << " overlaps " << b.name << std::endl;
+                }
+                CHECK(!(alive && shared));
+            }
+        }
+    };
+
+    alexNet.forward(input);
+    check();
+    std::cout << "train planned " << alexNet.memoryPlan().plannedBytes() << " naive "
+              << alexNet.memoryPlan().naiveBytes() << " bytes" << std::endl;
+    {
+        cnn::architectures::WithOutGrad guard;
+        alexNet.forward(input);
+        check();
+        std::cout << "eval planned " << alexNet.memoryPlan().plannedBytes() << " naive "
+                  << alexNet.memoryPlan().naiveBytes() << " bytes" << std::endl;
+    }
+}
+
+void allocatorTest() {
+    // 所有张量的起始地址都按缓存行对齐, 释放之后计数器回到原来的值
+    const auto before = cnn::memory::defaultAllocator().stats();
+    {
+        cnn::Tensor3D small(3, 7, 7);
+        cnn::Tensor4D batch(4, 16, 111, 111);
+        cnn::Tensor4D large(32, 16, 111, 111);
+        CHECK(reinterpret_cast<uintptr_t>(small.getData()) % cnn::memory::CACHE_LINE == 0);
+        for (uint32_t b = 0; b < batch.getBatch(); ++b) {
+            CHECK(reinterpret_cast<uintptr_t>(batch.data(b)) % cnn::memory::CACHE_LINE == 0);
+        }
+        CHECK(reinterpret_cast<uintptr_t>(large.getData()) % cnn::memory::HUGE_PAGE == 0);
+
+        const auto during = cnn::memory::defaultAllocator().stats();
+        std::cout << "allocations " << during.allocations - before.allocations << " huge pages "
+                  << during.hugePageAllocations - before.hugePageAllocations << " in use " << during.bytesInUse
+                  << " peak " << during.peakBytes << std::endl;
+    }
+    const auto after = cnn::memory::defaultAllocator().stats();
+    CHECK(after.bytesInUse == before.bytesInUse);
+    CHECK(after.allocations - before.allocations == after.deallocations - before.deallocations);
+}
+
+void threadPoolTest() {
+    // 每个下标恰好执行一次, 嵌套调用不会死锁
+    std::vector<std::atomic<int>> hits(10007);
+    cnn::runtime::parallelFor(0, hits.size(), 7, [&](const size_t begin, const size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            cnn::runtime::parallelFor(3, [&](const size_t) {
+                ++hits[i];
+            });
+        }
+    });
+    for (auto &hit: hits) {
+        CHECK(hit.load() == 3);
+    }
+
+    // 多线程和单线程计算的卷积层结果要一致
+    std::default_random_engine e(1);
+    std::normal_distribution<float> engine(0.0, 1.0);
+    cnn::Tensor4D input(4, 16, 57, 57);
+    for (uint32_t b = 0; b < input.getBatch(); ++b) {
+        for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+            input.data(b)[i] = engine(e);
+        }
+    }
+
+    auto run = [&](const int threads) {
+        cnn::runtime::setNumThreads(threads);
+        cnn::architectures::Conv2D conv("conv", 16, 32, 3, 1, 1);
+        cnn::architectures::ReLU relu("relu");
+        cnn::architectures::MaxPool2D pool("pool", 2, 2);
+        cnn::architectures::WithOutGrad guard;
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto &out = pool.forward(relu.forward(conv.forward(input)));
+        const auto cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+        std::cout << threads << " threads: " << cost.count() << " ms" << std::endl;
+
+        std::vector<float> result;
+        for (uint32_t b = 0; b < out.getBatch(); ++b) {
+            result.insert(result.end(), out.data(b), out.data(b) + out.sampleLength());
+        }
+        return result;
+    };
+
+    const auto serial = run(1);
+    const auto parallel = run(std::max(2u, std::thread::hardware_concurrency()));
+    float maxError = 0;
+    for (size_t i = 0; i < serial.size(); ++i) {
+        maxError = std::max(maxError, std::abs(serial[i] - parallel[i]));
+    }
+    std::cout << "max error " << maxError << std::endl;
+    CHECK(maxError < 1e-4);
+}
+
+void gradientShardsTest() {
+    // 同样的线程数下按 batch 并行求出的梯度要逐位一致, 不同的线程数之间只有舍入误差
+    std::default_random_engine e(7);
+    std::normal_distribution<float> engine(0.0, 1.0);
+    cnn::Tensor4D input(6, 8, 15, 15);
+    cnn::Tensor4D delta(6, 16, 15, 15);
+    for (auto *tensor: {&input, &delta}) {
+        for (uint32_t b = 0; b < tensor->getBatch(); ++b) {
+            for (uint32_t i = 0; i < tensor->sampleLength(); ++i) {
+                tensor->data(b)[i] = engine(e);
+            }
+        }
+    }
+
+    // 求一次梯度并更新, 更新之后的输出反映了权重的梯度
+    auto run = [&](const int threads, const cnn::architectures::ConvAlgorithm algorithm) {
+        cnn::runtime::setNumThreads(threads);
+        cnn::architectures::Conv2D conv("conv", 8, 16, 3, 1, 1, algorithm);
+        conv.forward(input);
+        conv.backward(delta);
+        conv.updateGradients(1e-2);
+        const auto &out = conv.forward(input);
+
+        std::vector<float> result;
+        for (uint32_t b = 0; b < out.getBatch(); ++b) {
+            result.insert(result.end(), out.data(b), out.data(b) + out.sampleLength());
+        }
+        return result;
+    };
+
+    for (const auto algorithm: {cnn::architectures::ConvAlgorithm::Direct,
+                                cnn::architectures::ConvAlgorithm::Im2col}) {
+        const auto first = run(4, algorithm);
+        const auto second = run(4, algorithm);
+        CHECK(std::memcmp(first.data(), second.data(), first.size() * sizeof(float)) == 0);
+
+        const auto serial = run(1, algorithm);
+        float maxError = 0;
+        for (size_t i = 0; i < serial.size(); ++i) {
+            maxError = std::max(maxError, std::abs(serial[i] - first[i]));
+        }
+        std::cout << "gradient shards max error " << maxError << std::endl;
+        CHECK(maxError < 1e-4);
+    }
+}
+
+void freezeTest() {
+    // 冻结之后 BatchNorm2D 合并进卷积层, 推理结果和冻结之前一致, 推理需要的内存更少
+    std::default_random_engine e(3);
+    std::normal_distribution<float> engine(0.0, 1.0);
+    cnn::Tensor4D input(2, 3, 224, 224);
+    for (uint32_t b = 0; b < input.getBatch(); ++b) {
+        for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+            input.data(b)[i] = engine(e);
+        }
+    }
+
+    // 训练几步, 让滑动平均的统计量和 gamma, beta 都不是初始值
+    cnn::architectures::AlexNet alexNet(3, true);
+    for (int step = 0; step < 3; ++step) {
+        const auto &out = alexNet.forward(input);
+        cnn::Tensor4D delta(out.getBatch(), out.sampleShape());
+        for (uint32_t b = 0; b < delta.getBatch(); ++b) {
+            for (uint32_t i = 0; i < delta.sampleLength(); ++i) {
+                delta.data(b)[i] = engine(e);
+            }
+        }
+        alexNet.backward(delta);
+        alexNet.updateGradients(1e-1);
+    }
+
+    std::vector<float> expected;
+    size_t evalBytes = 0;
+    {
+        cnn::architectures::WithOutGrad guard;
+        const auto &out = alexNet.forward(input);
+        for (uint32_t b = 0; b < out.getBatch(); ++b) {
+            expected.insert(expected.end(), out.data(b), out.data(b) + out.sampleLength());
+        }
+        evalBytes = alexNet.memoryPlan().plannedBytes();
+    }
+
+    alexNet.freeze();
+    CHECK(alexNet.frozen());
+    // 冻结之后不在 WithOutGrad 里调用也只做推理
+    const auto &out = alexNet.forward(input);
+    const size_t frozenBytes = alexNet.memoryPlan().plannedBytes();
+    float maxError = 0;
+    float maxValue = 0;
+    for (uint32_t b = 0; b < out.getBatch(); ++b) {
+        for (uint32_t i = 0; i < out.sampleLength(); ++i) {
+            const float value = expected[b * out.sampleLength() + i];
+            maxError = std::max(maxError, std::abs(out.data(b)[i] - value));
+            maxValue = std::max(maxValue, std::abs(value));
+        }
+    }
+    std::cout << "freeze max error " << maxError << " max value " << maxValue << ", planned " << evalBytes
+              << " -> " << frozenBytes << " bytes" << std::endl;
+    CHECK(maxError <= 1e-4 * std::max(1.f, maxValue));
+    CHECK(frozenBytes < evalBytes);
+}
+
+void fusedEpilogueTest() {
+    // Conv2D 带 ReLU 和池化的 epilogue, 前向, 反向以及更新之后的结果都和分开的三层一致
+    using namespace cnn::architectures;
+    std::default_random_engine e(5);
+    std::normal_distribution<float> engine(0.0, 1.0);
+    cnn::Tensor4D input(3, 8, 23, 23);
+    for (uint32_t b = 0; b < input.getBatch(); ++b) {
+        for (uint32_t i = 0; i < input.sampleLength(); ++i) {
+            input.data(b)[i] = engine(e);
+        }
+    }
+
+    const auto flatten = [](const cnn::Tensor4D &tensor) {
+        std::vector<float> result;
+        for (uint32_t b = 0; b < tensor.getBatch(); ++b) {
+            result.insert(result.end(), tensor.data(b), tensor.data(b) + tensor.sampleLength());
+        }
+        return result;
+    };
+    const auto maxError = [](const std::vector<float> &a, const std::vector<float> &b) {
+        CHECK(a.size() == b.size());
+        float error = 0;
+        for (size_t i = 0; i < a.size(); ++i) {
+            error = std::max(error, std::abs(a[i] - b[i]));
+        }
+        return error;
+    };
+
+    for (const auto algorithm: {ConvAlgorithm::Direct, ConvAlgorithm::Im2col, ConvAlgorithm::Winograd2x2}) {
+        for (const int pool: {0, 2}) {
+            Conv2D conv("conv", 8, 16, 3, 1, 1, algorithm);
+            ReLU relu("relu");
+            MaxPool2D maxPool("pool", 2, 2);
+            Conv2D fused("fused", 8, 16, 3, 1, 1, algorithm);
+            fused.setEpilogue({true, pool, pool});
+
+            // 分开的三层
+            const cnn::Tensor4D *out = &relu.forward(conv.forward(input));
+            if (pool) {
+                out = &maxPool.forward(*out);
+            }
+            const auto expected = flatten(*out);
+            cnn::Tensor4D delta(out->getBatch(), out->sampleShape());
+            for (uint32_t b = 0; b < delta.getBatch(); ++b) {
+                for (uint32_t i = 0; i < delta.sampleLength(); ++i) {
+                    delta.data(b)[i] = engine(e);
+                }
+            }
+            const auto deltaValues = flatten(delta);
+            cnn::Tensor4D *back = &delta;
+            if (pool) {
+                back = &maxPool.backward(*back);
+            }
+            const auto expectedDelta = flatten(conv.backward(relu.backward(*back)));
+            conv.updateGradients(1e-2);
+            const auto expectedUpdated = flatten(conv.forward(input));
+
+            // 合并之后的一层
+            const auto &fusedOut = fused.forward(input);
+            CHECK(fusedOut.sampleShape() == out->sampleShape());
+            const auto actual = flatten(fusedOut);
+            for (uint32_t b = 0; b < delta.getBatch(); ++b) {
+                std::copy(deltaValues.begin() + b * delta.sampleLength(),
+                          deltaValues.begin() + (b + 1) * delta.sampleLength(), delta.data(b));
+            }
+            const auto actualDelta = flatten(fused.backward(delta));
+            fused.updateGradients(1e-2);
+            fused.setEpilogue({});
+            const auto actualUpdated = flatten(fused.forward(input));
+
+            std::cout << "algorithm " << static_cast<int>(algorithm) << " pool " << pool << " forward error "
+                      << maxError(expected, actual) << " backward error " << maxError(expectedDelta, actualDelta)
+                      << " updated error " << maxError(expectedUpdated, actualUpdated) << std::endl;
+            CHECK(maxError(expected, actual) == 0);
+            CHECK(maxError(expectedDelta, actualDelta) == 0);
+            CHECK(maxError(expectedUpdated, actualUpdated) == 0);
+        }
+    }
+}
+
+void maxPoolKernelTest() {
+    // 2x2 的专门实现和按定义的池化结果一致, 有相等的值时都取窗口内第一个最大值, backward 把梯度累加到同样的位置
+    std::default_random_engine e(13);
+    std::uniform_int_distribution<int> engine(-4, 4); // 取值很少, 窗口内经常有相等的值
+    for (const auto &[size, step]: {std::pair{2, 2}, std::pair{3, 2}, std::pair{3, 3}}) {
+        for (const int width: {5, 17, 38, 111}) {
+            const int height = 9;
+            const int outHeight = cnn::kernels::pooledLength(height, size, step);
+            const int outWidth = cnn::kernels::pooledLength(width, size, step);
+            std::vector<float> input(height * width);
+            for (auto &value: input) {
+                value = engine(e) * 0.5f;
+            }
+
+            std::vector<float> output(outHeight * outWidth);
+            std::vector<uint8_t> mask(outHeight * outWidth);
+            cnn::kernels::maxPool(input.data(), height, width, size, step, output.data(), mask.data());
+            std::vector<float> values(outHeight * outWidth);
+            cnn::kernels::maxPool(input.data(), height, width, size, step, values.data(), nullptr);
+
+            std::vector<float> delta(outHeight * outWidth);
+            std::vector<float> inputDelta(height * width, 0);
+            std::vector<float> expectedDelta(height * width, 0);
+            for (size_t i = 0; i < delta.size(); ++i) {
+                delta[i] = i + 1.f;
+            }
+            cnn::kernels::maxPoolBackward(delta.data(), mask.data(), height, width, size, step, inputDelta.data());
+
+            for (int x = 0; x < outHeight; ++x) {
+                for (int y = 0; y < outWidth; ++y) {
+                    int best = 0;
+                    for (int i = 1; i < size * size; ++i) {
+                        const float comp = input[(x * step + i / size) * width + y * step + i % size];
+                        if (comp > input[(x * step + best / size) * width + y * step + best % size]) {
+                            best = i;
+                        }
+                    }
+                    const int out = x * outWidth + y;
+                    const int position = (x * step + best / size) * width + y * step + best % size;
+                    CHECK(mask[out] == best);
+                    CHECK(output[out] == input[position] && values[out] == input[position]);
+                    expectedDelta[position] += delta[out];
+                }
+            }
+            CHECK(inputDelta == expectedDelta);
+        }
+    }
+}
+
+void softmaxCrossEntropyTest() {
+    // 和分开计算的 softMax, oneHot, crossEntropyBackward 结果一致, 预测的类别就是 argmax
+    std::default_random_engine e(17);
+    std::normal_distribution<float> engine(0.0, 3.0);
+    const int numOfClasses = 5;
+    cnn::Tensor4D logits(64, numOfClasses, 1, 1);
+    std::vector<int> labels(logits.getBatch());
+    for (uint32_t b = 0; b < logits.getBatch(); ++b) {
+        for (int i = 0; i < numOfClasses; ++i) {
+            logits.data(b)[i] = engine(e);
+        }
+        labels[b] = b % numOfClasses;
+    }
+
+    const auto probs = softMax(logits);
+    const auto [expectedLoss, expectedDelta] = crossEntropyBackward(probs, oneHot(labels, numOfClasses));
+
+    std::vector<int> predict;
+    cnn::Tensor4D delta;
+    const cnn::dataType loss = softmaxCrossEntropy(logits, labels, predict, &delta);
+    const cnn::dataType *buffer = delta.data(0);
+    CHECK(std::abs(loss - expectedLoss) < 1e-5);
+    CHECK(std::abs(softmaxCrossEntropy(logits, labels, predict) - loss) < 1e-7);
+    for (uint32_t b = 0; b < logits.getBatch(); ++b) {
+        CHECK(predict[b] == static_cast<int>(probs.at(b)->argmax()));
+        for (int i = 0; i < numOfClasses; ++i) {
+            CHECK(std::abs(delta.data(b)[i] - expectedDelta.data(b)[i]) < 1e-6);
+        }
+    }
+
+    // 形状不变时复用 delta 的内存
+    softmaxCrossEntropy(logits, labels, predict, &delta);
+    CHECK(delta.data(0) == buffer);
+
+    // 正确类别的概率下溢成 0 时, 损失仍然是有限的 logit 之差
+    cnn::Tensor4D extreme(1, 3, 1, 1);
+    extreme.data(0)[0] = 0.f;
+    extreme.data(0)[1] = 1000.f;
+    extreme.data(0)[2] = -1000.f;
+    const cnn::dataType extremeLoss = softmaxCrossEntropy(extreme, {0}, predict, &delta);
+    std::cout << "extreme loss " << extremeLoss << std::endl;
+    CHECK(std::abs(extremeLoss - 1000.f) < 1e-3);
+    CHECK(predict[0] == 1);
+    CHECK(std::abs(delta.data(0)[0] + 1.f) < 1e-6 && std::abs(delta.data(0)[1] - 1.f) < 1e-6);
 }
 
 int main1(int argc, char **argv) {
 
 //    augmentTest();
 //
+//    fusedAugmentTest();
+//
 //    dataLoaderTest();
 //
+//    prefetchLoaderTest();
+//
+//    packedDatasetTest();
+//
+//    reducedDecodeTest();
+//
+//    tarShardTest();
+//
+//    samplerTest();
+//
+//    imageCacheTest();
+//
+//    manifestTest();
+//
 //    tensorTest();
 //
+//    convertTest();
+//
+//    tensorViewTest();
+//
 //    ReLUTest();
 //
+//    reluInPlaceTest();
+//
 //    maxPool2DTest();
+//
+//    maxPoolKernelTest();
 
 //    Conv2DTest();
+//
+//    Conv2DGemmTest();
+//
+//    Conv2DWinogradTest();
+//
+//    memoryPlanTest();
+//
+//    batchedEvalTest();
+//
+//    dynamicShapeTest();
+//
+//    allocatorTest();
+//
+//    threadPoolTest();
+//
+//    gradientShardsTest();
+//
+//    softmaxCrossEntropyTest();
+//
+//    freezeTest();
+//
+//    fusedEpilogueTest();
 
     AlexNetTest();
     return 0;
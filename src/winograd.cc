@@ -0,0 +1,299 @@
+#include<winograd.hpp>
+#include<gemm.hpp>
+#include<runtime.hpp>
+#include<algorithm>
+#include<cassert>
+#include<vector>
+
+namespace {
+    using cnn::dataType;
+
+    constexpr int R = 3; // 卷积核大小
+    constexpr int MAX_ALPHA = 6;
+
+    // F(2x2, 3x3) 的卷积核变换矩阵, 输入和输出的变换见 Transform1D
+    constexpr dataType G2[4 * 3] = {1, 0, 0,
+                                    0.5, 0.5, 0.5,
+                                    0.5, -0.5, 0.5,
+                                    0, 0, 1};
+
+    // F(4x4, 3x3) 的卷积核变换矩阵
+    constexpr dataType G4[6 * 3] = {1.f / 4, 0, 0,
+                                    -1.f / 6, -1.f / 6, -1.f / 6,
+                                    -1.f / 6, 1.f / 6, -1.f / 6,
+                                    1.f / 24, 1.f / 12, 1.f / 6,
+                                    1.f / 24, -1.f / 12, 1.f / 6,
+                                    0, 0, 1};
+
+    struct Transform {
+        int alpha;
+        const dataType *G;
+    };
+
+    Transform getTransform(const int tile) {
+        assert(tile == 2 || tile == 4);
+        if (tile == 2) {
+            return {4, G2};
+        }
+        return {6, G4};
+    }
+
+    /**
+     * @brief 计算 out = left * in * left^T, left 为 rows x cols, in 为 cols x cols, 只用于卷积核变换
+     */
+    void sandwich(const dataType *left, const int rows, const int cols, const dataType *in, dataType *out) {
+        dataType temp[MAX_ALPHA * MAX_ALPHA];
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < cols; ++j) {
+                dataType sumValue = 0;
+                for (int k = 0; k < cols; ++k) {
+                    sumValue += left[i * cols + k] * in[k * cols + j];
+                }
+                temp[i * cols + j] = sumValue;
+            }
+        }
+
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < rows; ++j) {
+                dataType sumValue = 0;
+                for (int k = 0; k < cols; ++k) {
+                    sumValue += temp[i * cols + k] * left[j * cols + k];
+                }
+                out[i * rows + j] = sumValue;
+            }
+        }
+    }
+
+    // 输入和输出的一维变换, 把 B^T 和 A^T 中的常数展开, 省去和 0 相乘
+    template<int TILE>
+    struct Transform1D;
+
+    template<>
+    struct Transform1D<2> {
+        static constexpr int alpha = 4;
+
+        // out = B^T * in, in 和 out 的元素间隔分别为 is 和 os
+        static inline void input(const dataType *in, const int is, dataType *out, const int os) {
+            const dataType d0 = in[0], d1 = in[is], d2 = in[2 * is], d3 = in[3 * is];
+            out[0] = d0 - d2;
+            out[os] = d1 + d2;
+            out[2 * os] = d2 - d1;
+            out[3 * os] = d1 - d3;
+        }
+
+        // out = A^T * in
+        static inline void output(const dataType *in, const int is, dataType *out, const int os) {
+            const dataType m0 = in[0], m1 = in[is], m2 = in[2 * is], m3 = in[3 * is];
+            out[0] = m0 + m1 + m2;
+            out[os] = m1 - m2 - m3;
+        }
+    };
+
+    template<>
+    struct Transform1D<4> {
+        static constexpr int alpha = 6;
+
+        static inline void input(const dataType *in, const int is, dataType *out, const int os) {
+            const dataType d0 = in[0], d1 = in[is], d2 = in[2 * is];
+            const dataType d3 = in[3 * is], d4 = in[4 * is], d5 = in[5 * is];
+            out[0] = 4 * d0 - 5 * d2 + d4;
+            out[os] = -4 * (d1 + d2) + d3 + d4;
+            out[2 * os] = 4 * (d1 - d2) - d3 + d4;
+            out[3 * os] = 2 * (d3 - d1) - d2 + d4;
+            out[4 * os] = 2 * (d1 - d3) - d2 + d4;
+            out[5 * os] = 4 * d1 - 5 * d3 + d5;
+        }
+
+        static inline void output(const dataType *in, const int is, dataType *out, const int os) {
+            const dataType m0 = in[0], m1 = in[is], m2 = in[2 * is];
+            const dataType m3 = in[3 * is], m4 = in[4 * is], m5 = in[5 * is];
+            const dataType a = m1 + m2, b = m1 - m2, c = m3 + m4, d = m3 - m4;
+            out[0] = m0 + a + c;
+            out[os] = b + 2 * d;
+            out[2 * os] = a + 4 * c;
+            out[3 * os] = b + 8 * d + m5;
+        }
+    };
+
+    /**
+     * @brief 输入变换 V = B^T d B, 结果按 [alpha*alpha][inChannels][tiles] 写入, 填充部分在取块时补 0
+     * @param icBegin, icEnd 只变换这一段输入通道, 不同的段可以并行
+     */
+    template<int TILE>
+    void inputTransform(const dataType *image, const int inChannels, const int height, const int width,
+                        const int padding, const int tilesH, const int tilesW, dataType *V,
+                        const int icBegin, const int icEnd) {
+        using T = Transform1D<TILE>;
+        constexpr int alpha = T::alpha;
+        const int tiles = tilesH * tilesW;
+        const size_t pointStride = static_cast<size_t>(inChannels) * tiles;
+
+        dataType d[alpha * alpha];
+        dataType temp[alpha * alpha];
+        dataType v[alpha * alpha];
+        for (int ic = icBegin; ic < icEnd; ++ic) {
+            const dataType *plane = image + ic * height * width;
+            dataType *dst = V + static_cast<size_t>(ic) * tiles;
+            for (int th = 0; th < tilesH; ++th) {
+                const int y0 = th * TILE - padding;
+                for (int tw = 0; tw < tilesW; ++tw) {
+                    const int x0 = tw * TILE - padding;
+                    if (y0 >= 0 && x0 >= 0 && y0 + alpha <= height && x0 + alpha <= width) {
+                        for (int i = 0; i < alpha; ++i) {
+                            std::copy(plane + (y0 + i) * width + x0, plane + (y0 + i) * width + x0 + alpha,
+                                      d + i * alpha);
+                        }
+                    } else {
+                        for (int i = 0; i < alpha; ++i) {
+                            for (int j = 0; j < alpha; ++j) {
+                                const int y = y0 + i;
+                                const int x = x0 + j;
+                                const bool inside = y >= 0 && x >= 0 && y < height && x < width;
+                                d[i * alpha + j] = inside ? plane[y * width + x] : 0;
+                            }
+                        }
+                    }
+
+                    // 先对每一列做变换, 再对每一行做变换
+                    for (int j = 0; j < alpha; ++j) {
+                        T::input(d + j, alpha, temp + j, alpha);
+                    }
+                    for (int i = 0; i < alpha; ++i) {
+                        T::input(temp + i * alpha, 1, v + i * alpha, 1);
+                    }
+
+                    const int index = th * tilesW + tw;
+                    for (int xi = 0; xi < alpha * alpha; ++xi) {
+                        dst[xi * pointStride + index] = v[xi];
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief 输出变换 Y = A^T m A, 加上 bias 之后写回, 边界上多余的部分丢弃
+     * @param ocBegin, ocEnd 只变换这一段输出通道
+     */
+    template<int TILE>
+    void outputTransform(const dataType *M, const int outChannels, const int outHeight, const int outWidth,
+                         const int tilesH, const int tilesW, const dataType *bias, dataType *output,
+                         const int ocBegin, const int ocEnd) {
+        using T = Transform1D<TILE>;
+        constexpr int alpha = T::alpha;
+        const int tiles = tilesH * tilesW;
+        const size_t pointStride = static_cast<size_t>(outChannels) * tiles;
+
+        dataType m[alpha * alpha];
+        dataType temp[TILE * alpha];
+        dataType y[TILE * TILE];
+        for (int oc = ocBegin; oc < ocEnd; ++oc) {
+            const dataType *src = M + static_cast<size_t>(oc) * tiles;
+            dataType *outPtr = output + oc * outHeight * outWidth;
+            const dataType biasValue = bias[oc];
+
+            for (int th = 0; th < tilesH; ++th) {
+                for (int tw = 0; tw < tilesW; ++tw) {
+                    const int index = th * tilesW + tw;
+                    for (int xi = 0; xi < alpha * alpha; ++xi) {
+                        m[xi] = src[xi * pointStride + index];
+                    }
+
+                    for (int j = 0; j < alpha; ++j) {
+                        T::output(m + j, alpha, temp + j, alpha);
+                    }
+                    for (int i = 0; i < TILE; ++i) {
+                        T::output(temp + i * alpha, 1, y + i * TILE, 1);
+                    }
+
+                    const int rows = std::min(TILE, outHeight - th * TILE);
+                    const int cols = std::min(TILE, outWidth - tw * TILE);
+                    for (int i = 0; i < rows; ++i) {
+                        dataType *dst = outPtr + (th * TILE + i) * outWidth + tw * TILE;
+                        for (int j = 0; j < cols; ++j) {
+                            dst[j] = y[i * TILE + j] + biasValue;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+size_t cnn::kernels::winogradWeightsLength(const int outChannels, const int inChannels, const int tile) {
+    const int alpha = tile + R - 1;
+    return static_cast<size_t>(alpha) * alpha * outChannels * inChannels;
+}
+
+/**
+ * @brief 卷积核变换 U = G g G^T, 结果按 [alpha*alpha][outChannels][inChannels] 排布, 方便之后逐点做 GEMM
+ */
+void cnn::kernels::winogradWeights(const dataType *weights, const int outChannels, const int inChannels,
+                                   const int tile, dataType *transformed) {
+    const Transform t = getTransform(tile);
+    const int points = t.alpha * t.alpha;
+
+    dataType u[MAX_ALPHA * MAX_ALPHA];
+    for (int oc = 0; oc < outChannels; ++oc) {
+        for (int ic = 0; ic < inChannels; ++ic) {
+            const dataType *g = weights + (oc * inChannels + ic) * R * R;
+            sandwich(t.G, t.alpha, R, g, u);
+            for (int xi = 0; xi < points; ++xi) {
+                transformed[(xi * outChannels + oc) * inChannels + ic] = u[xi];
+            }
+        }
+    }
+}
+
+/**
+ * @brief Winograd 卷积, 输入按 tile x tile 的输出块切分, 每一块先做输入变换,
+ * 之后 alpha*alpha 个变换域上的点各做一次 [outChannels x inChannels] * [inChannels x tiles] 的 GEMM,
+ * 最后做输出变换写回, 边界上不完整的块和四周的填充都用 0 补齐.
+ * 两次变换分别按输入、输出通道并行, 逐点的 GEMM 由 sgemm 自己切分
+ * @param padding 四周填充的宽度
+ * @param bias 每个输出通道的偏置
+ */
+void cnn::kernels::winogradConv(const dataType *image, const int inChannels, const int height, const int width,
+                                const int padding, const dataType *transformed, const int outChannels,
+                                const int tile, const dataType *bias, dataType *output) {
+    const int alpha = getTransform(tile).alpha;
+    const int points = alpha * alpha;
+
+    const int outHeight = height + 2 * padding - R + 1;
+    const int outWidth = width + 2 * padding - R + 1;
+    const int tilesH = (outHeight + tile - 1) / tile;
+    const int tilesW = (outWidth + tile - 1) / tile;
+    const int tiles = tilesH * tilesW;
+
+    // 并行的子任务只使用这里取出的指针, 调用线程等待时不会再进入 winogradConv 改变缓冲区的大小
+    thread_local std::vector<dataType> V;
+    thread_local std::vector<dataType> M;
+    V.resize(static_cast<size_t>(points) * inChannels * tiles);
+    M.resize(static_cast<size_t>(points) * outChannels * tiles);
+    dataType *vPtr = V.data();
+    dataType *mPtr = M.data();
+
+    runtime::parallelFor(0, inChannels, 1, [&](const size_t begin, const size_t end) {
+        if (tile == 2) {
+            inputTransform<2>(image, inChannels, height, width, padding, tilesH, tilesW, vPtr, begin, end);
+        } else {
+            inputTransform<4>(image, inChannels, height, width, padding, tilesH, tilesW, vPtr, begin, end);
+        }
+    });
+
+    // 变换域上逐点相乘并在输入通道上求和, 等价于 alpha*alpha 个独立的 GEMM
+    runtime::parallelFor(points, [&](const size_t xi) {
+        kernels::sgemm(false, false, outChannels, tiles, inChannels, 1.f,
+                       transformed + static_cast<size_t>(xi) * outChannels * inChannels, inChannels,
+                       vPtr + static_cast<size_t>(xi) * inChannels * tiles, tiles, 0.f,
+                       mPtr + static_cast<size_t>(xi) * outChannels * tiles, tiles);
+    });
+
+    runtime::parallelFor(0, outChannels, 1, [&](const size_t begin, const size_t end) {
+        if (tile == 2) {
+            outputTransform<2>(mPtr, outChannels, outHeight, outWidth, tilesH, tilesW, bias, output, begin, end);
+        } else {
+            outputTransform<4>(mPtr, outChannels, outHeight, outWidth, tilesH, tilesW, bias, output, begin, end);
+        }
+    });
+}